@@ -0,0 +1,32 @@
+#ifndef FORK_SERVER_H
+#define FORK_SERVER_H
+
+#include <stdint.h>
+
+/**
+ * Fork server protocol of the runtime.
+ *
+ * A target started with INSTR_FORKSRV_FD=<fd> does not run main right away.
+ * Its runtime writes FORKSRV_HELLO to fd + 1 and waits for requests on fd.
+ * Every request is a ForkServerRequest followed by LogLength bytes, the
+ * INSTR_LOG of the run (none to keep the inherited one). The runtime forks a
+ * child that runs main with the stdin of the server, replies with the pid of
+ * the child and, once it is done, with its waitpid status, both as int32_t.
+ * The server exits when fd is closed.
+ *
+ * Clients rewind the stdin of the server between runs, e.g. a memfd whose
+ * file offset is shared with every child.
+ *
+ * The runtimes of lab3 and lab5 serve this protocol and TargetRunner.h is
+ * its client.
+ */
+
+#define FORKSRV_ENV "INSTR_FORKSRV_FD"
+#define FORKSRV_HELLO 0x53524b46u /* "FKRS" */
+#define FORKSRV_FD 198
+
+struct ForkServerRequest {
+  uint32_t LogLength;
+};
+
+#endif // FORK_SERVER_H
@@ -0,0 +1,299 @@
+#ifndef LOG_CORE_H
+#define LOG_CORE_H
+
+/**
+ * Crash-safe buffered logging for the instrumentation runtimes.
+ *
+ * Events of a log are appended to a pre-sized ring file <log>.<pid>.ring that
+ * is mapped in memory, so logging an event is a memcpy and no system call.
+ * The pages of a shared file mapping belong to the page cache, so buffered
+ * events survive the process dying at any point, even from SIGKILL.
+ *
+ * The ring is drained to the log when it is full, when the log is closed,
+ * and from the crash handlers of the runtimes. A ring that is still there
+ * once its process is gone belongs to a process that was killed before it
+ * could drain it: logcore_recover appends the valid part of such rings, as
+ * recorded by the header, to their log.
+ *
+ * All functions are static inline so that the runtimes and the tools reading
+ * their logs can include this header without linking anything. The runtimes
+ * and tools of lab3 and lab5 share this header through a link in their
+ * include directory, which zip stores as a copy, so that every lab still
+ * builds and submits on its own.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOGCORE_MAGIC 0x474e495252474f4cULL /* "LOGRRING" */
+#define LOGCORE_CAPACITY (1 << 20)
+#define LOGCORE_PATH_MAX 1024
+
+struct LogCoreHeader {
+  uint64_t Magic;
+  uint64_t Capacity;
+  uint64_t Length; /* bytes of valid events after the header */
+  uint32_t Lock;
+  uint32_t Padding[9]; /* the events start on a cache line */
+};
+
+struct logcore {
+  int fd; /* inherited log fd, -1 to log to log_path */
+  char log_path[LOGCORE_PATH_MAX];
+  char ring_path[LOGCORE_PATH_MAX + 32];
+  struct LogCoreHeader *ring;
+};
+
+static inline void logcore_write_fd(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, data, len);
+    if (ret <= 0) {
+      break;
+    }
+    data += ret;
+    len -= ret;
+  }
+}
+
+/**
+ * Append data to a file, opening it on every call since drains are rare.
+ * Only uses async-signal-safe functions.
+ */
+static inline void logcore_write_file(const char *path, const char *data,
+                                      size_t len) {
+  if (len == 0) {
+    return;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    return;
+  }
+  logcore_write_fd(fd, data, len);
+  close(fd);
+}
+
+/**
+ * Set the log a logcore appends to. The ring file is only created by the
+ * first append. Events of a log with an inherited fd, e.g. a pipe, are
+ * written to it directly without a ring.
+ */
+static inline void logcore_init(struct logcore *log, const char *log_path,
+                                int fd) {
+  log->fd = fd;
+  snprintf(log->log_path, sizeof(log->log_path), "%s", log_path);
+  log->ring_path[0] = 0;
+  log->ring = NULL;
+}
+
+static inline struct LogCoreHeader *logcore_map(struct logcore *log) {
+  snprintf(log->ring_path, sizeof(log->ring_path), "%s.%d.ring", log->log_path,
+           (int)getpid());
+  int fd = open(log->ring_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    return NULL;
+  }
+  size_t size = sizeof(struct LogCoreHeader) + LOGCORE_CAPACITY;
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    unlink(log->ring_path);
+    return NULL;
+  }
+  struct LogCoreHeader *ring = (struct LogCoreHeader *)map;
+  ring->Capacity = LOGCORE_CAPACITY;
+  ring->Length = 0;
+  __atomic_store_n(&ring->Magic, LOGCORE_MAGIC, __ATOMIC_RELEASE);
+  return ring;
+}
+
+static inline int logcore_trylock(struct LogCoreHeader *ring) {
+  return !__atomic_exchange_n(&ring->Lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void logcore_lock(struct LogCoreHeader *ring) {
+  while (!logcore_trylock(ring)) {
+    while (__atomic_load_n(&ring->Lock, __ATOMIC_RELAXED)) {
+    }
+  }
+}
+
+static inline void logcore_unlock(struct LogCoreHeader *ring) {
+  __atomic_store_n(&ring->Lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write the events of a locked ring to its log and empty it.
+ */
+static inline void logcore_drain_locked(struct logcore *log,
+                                        struct LogCoreHeader *ring) {
+  logcore_write_file(log->log_path, (const char *)(ring + 1), ring->Length);
+  __atomic_store_n(&ring->Length, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Append an event to a log.
+ */
+static inline void logcore_append(struct logcore *log, const char *data,
+                                  size_t len) {
+  if (log->fd != -1) {
+    logcore_write_fd(log->fd, data, len);
+    return;
+  }
+  struct LogCoreHeader *ring = __atomic_load_n(&log->ring, __ATOMIC_ACQUIRE);
+  if (ring == NULL) {
+    struct LogCoreHeader *expected = NULL;
+    ring = logcore_map(log);
+    if (ring == NULL) {
+      // Without a ring, fall back to unbuffered appends.
+      logcore_write_file(log->log_path, data, len);
+      return;
+    }
+    if (!__atomic_compare_exchange_n(&log->ring, &expected, ring, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      munmap(ring, sizeof(struct LogCoreHeader) + LOGCORE_CAPACITY);
+      ring = expected;
+    }
+  }
+
+  logcore_lock(ring);
+  if (ring->Length + len > ring->Capacity) {
+    logcore_drain_locked(log, ring);
+  }
+  if (len > ring->Capacity) {
+    logcore_write_file(log->log_path, data, len);
+  } else {
+    memcpy((char *)(ring + 1) + ring->Length, data, len);
+    // The header only covers complete events.
+    __atomic_store_n(&ring->Length, ring->Length + len, __ATOMIC_RELEASE);
+  }
+  logcore_unlock(ring);
+}
+
+/**
+ * Drain a log from a signal handler. Gives up if the ring is locked, the
+ * events then stay in the ring file for logcore_recover.
+ * Only uses async-signal-safe functions.
+ */
+static inline void logcore_drain_signal(struct logcore *log) {
+  struct LogCoreHeader *ring = __atomic_load_n(&log->ring, __ATOMIC_ACQUIRE);
+  if (ring == NULL || !logcore_trylock(ring)) {
+    return;
+  }
+  logcore_drain_locked(log, ring);
+  // The ring file is empty, the process is about to die.
+  unlink(log->ring_path);
+  logcore_unlock(ring);
+}
+
+/**
+ * Drain a log and remove its ring file, at exit.
+ */
+static inline void logcore_close(struct logcore *log) {
+  struct LogCoreHeader *ring =
+      __atomic_exchange_n(&log->ring, NULL, __ATOMIC_ACQ_REL);
+  if (ring == NULL) {
+    return;
+  }
+  logcore_lock(ring);
+  logcore_drain_locked(log, ring);
+  unlink(log->ring_path);
+  logcore_unlock(ring);
+  munmap(ring, sizeof(struct LogCoreHeader) + LOGCORE_CAPACITY);
+}
+
+/**
+ * Forget the ring of the parent in a forked child, whose events go to a
+ * ring of its own.
+ */
+static inline void logcore_after_fork(struct logcore *log) {
+  struct LogCoreHeader *ring = log->ring;
+  log->ring = NULL;
+  if (ring != NULL) {
+    munmap(ring, sizeof(struct LogCoreHeader) + LOGCORE_CAPACITY);
+  }
+}
+
+/**
+ * Append the events left in the ring files of dead processes to the log at
+ * log_path and remove those ring files.
+ *
+ * @return the number of recovered bytes.
+ */
+static inline size_t logcore_recover(const char *log_path) {
+  char dir[LOGCORE_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", log_path);
+  const char *base = log_path;
+  char *slash = strrchr(dir, '/');
+  if (slash != NULL) {
+    base = log_path + (slash - dir) + 1;
+    slash[slash == dir] = 0;
+  } else {
+    snprintf(dir, sizeof(dir), ".");
+  }
+  size_t base_len = strlen(base);
+
+  DIR *directory = opendir(dir);
+  if (directory == NULL) {
+    return 0;
+  }
+  size_t recovered = 0;
+  struct dirent *ent;
+  while ((ent = readdir(directory)) != NULL) {
+    // Ring files are named <log>.<pid>.ring.
+    const char *name = ent->d_name;
+    size_t len = strlen(name);
+    if (len <= base_len + 6 || strncmp(name, base, base_len) != 0 ||
+        name[base_len] != '.' || strcmp(name + len - 5, ".ring") != 0) {
+      continue;
+    }
+    int pid = atoi(name + base_len + 1);
+    if (pid <= 0 ||
+        (pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM))) {
+      // The ring of a running process.
+      continue;
+    }
+
+    char ring_path[2 * LOGCORE_PATH_MAX];
+    snprintf(ring_path, sizeof(ring_path), "%s/%s", dir, name);
+    int fd = open(ring_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(struct LogCoreHeader)) {
+      if (fd != -1) {
+        close(fd);
+      }
+      unlink(ring_path);
+      continue;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map != MAP_FAILED) {
+      const struct LogCoreHeader *ring = (const struct LogCoreHeader *)map;
+      size_t available = st.st_size - sizeof(struct LogCoreHeader);
+      // A truncated file only holds part of the recorded events.
+      size_t length = ring->Length < available ? ring->Length : available;
+      if (ring->Magic == LOGCORE_MAGIC) {
+        logcore_write_file(log_path, (const char *)(ring + 1), length);
+        recovered += length;
+      }
+      munmap(map, st.st_size);
+    }
+    unlink(ring_path);
+  }
+  closedir(directory);
+  return recovered;
+}
+
+#endif // LOG_CORE_H
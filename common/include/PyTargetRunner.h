@@ -0,0 +1,28 @@
+#ifndef PY_TARGET_RUNNER_H
+#define PY_TARGET_RUNNER_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Python binding of TargetRunner.h, the TargetRunner type of the extension
+ * modules of lab4 and lab5, which both build src/PyTargetRunner.cpp.
+ */
+
+/**
+ * @brief Read a sequence of inputs, bytes or str encoded as UTF-8 as
+ * run_target does.
+ */
+bool readInputs(PyObject *Sequence, std::vector<std::string> &Inputs);
+
+/**
+ * @brief Add the TargetRunner type to Module.
+ *
+ * @param Name Qualified name of the type, e.g. "cbi._aggregate.TargetRunner".
+ */
+bool addTargetRunnerType(PyObject *Module, const char *Name);
+
+#endif // PY_TARGET_RUNNER_H
@@ -0,0 +1,358 @@
+#ifndef TARGET_RUNNER_H
+#define TARGET_RUNNER_H
+
+#include "ForkServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Runs of an instrumented target with inputs on its stdin, as run_target of
+ * the delta debugger and of cbi do. The extension modules of lab4 and lab5
+ * share this header.
+ *
+ * Every TargetRunner delivers its inputs through a memfd of its own. When
+ * the target has a fork server, see ForkServer.h, the runner keeps one with
+ * the memfd on its stdin and requests a run per input, which skips the exec
+ * and the dynamic linking of the target. Other targets are spawned for every
+ * input. runBatch runs many inputs on parallel runners.
+ */
+
+extern char **environ;
+
+inline bool writeFull(int Fd, const void *Data, size_t Size) {
+  auto *Pos = static_cast<const char *>(Data);
+  while (Size > 0) {
+    ssize_t Ret = write(Fd, Pos, Size);
+    if (Ret == -1 && errno == EINTR)
+      continue;
+    if (Ret <= 0)
+      return false;
+    Pos += Ret;
+    Size -= Ret;
+  }
+  return true;
+}
+
+inline bool readFull(int Fd, void *Data, size_t Size) {
+  auto *Pos = static_cast<char *>(Data);
+  while (Size > 0) {
+    ssize_t Ret = read(Fd, Pos, Size);
+    if (Ret == -1 && errno == EINTR)
+      continue;
+    if (Ret <= 0)
+      return false;
+    Pos += Ret;
+    Size -= Ret;
+  }
+  return true;
+}
+
+/**
+ * Get the exit code of a waitpid status, 128 + signal number for a process
+ * killed by a signal, as runTarget of the fuzzer does.
+ */
+inline int exitCode(int Status) {
+  if (WIFEXITED(Status))
+    return WEXITSTATUS(Status);
+  if (WIFSIGNALED(Status))
+    return 128 + WTERMSIG(Status);
+  return 127;
+}
+
+/**
+ * Escape a path for INSTR_LOG, whose % start patterns.
+ */
+inline std::string logPattern(const std::string &Path) {
+  std::string Pattern;
+  for (char C : Path) {
+    Pattern += C;
+    if (C == '%')
+      Pattern += '%';
+  }
+  return Pattern;
+}
+
+inline bool hasPrefix(const std::string &Var, const char *Prefix) {
+  return Var.compare(0, strlen(Prefix), Prefix) == 0;
+}
+
+/**
+ * Get the environment of the runs: ours, without the fork server of a
+ * target that runs us.
+ */
+inline std::vector<std::string> getTargetEnv() {
+  std::vector<std::string> Env;
+  for (char **Var = environ; *Var != NULL; ++Var) {
+    if (!hasPrefix(*Var, FORKSRV_ENV "="))
+      Env.push_back(*Var);
+  }
+  return Env;
+}
+
+/**
+ * Get Env with the logs of the runtime under Pattern, see INSTR_LOG.
+ */
+inline std::vector<std::string> withLog(const std::vector<std::string> &Env,
+                                        const std::string &Pattern) {
+  std::vector<std::string> LogEnv;
+  for (auto &Var : Env) {
+    if (!hasPrefix(Var, "INSTR_LOG=") && !hasPrefix(Var, "INSTR_LOG_FD="))
+      LogEnv.push_back(Var);
+  }
+  LogEnv.push_back("INSTR_LOG=" + Pattern);
+  return LogEnv;
+}
+
+inline std::vector<char *> toArgv(std::vector<std::string> &Strings) {
+  std::vector<char *> Argv;
+  for (auto &String : Strings)
+    Argv.push_back(const_cast<char *>(String.c_str()));
+  Argv.push_back(NULL);
+  return Argv;
+}
+
+/**
+ * Runs the target for one thread.
+ */
+class TargetRunner {
+public:
+  TargetRunner(const std::string &Target, const std::vector<std::string> &Env)
+      : Target(Target), Env(Env) {}
+
+  TargetRunner(const TargetRunner &) = delete;
+  TargetRunner &operator=(const TargetRunner &) = delete;
+
+  ~TargetRunner() {
+    stopServer();
+    if (InputFd != -1)
+      close(InputFd);
+  }
+
+  /**
+   * Start a fork server of the target.
+   *
+   * @param LogDir If set, directory for the logs of the target if it runs
+   *        main instead, which happens when it has no fork server, and for
+   *        the runs that do not set their own.
+   * @return false if the target has no fork server.
+   */
+  bool startServer(const std::string &LogDir = "") {
+    int CtlPipe[2], StatusPipe[2];
+    if (!openInput() || pipe2(CtlPipe, O_CLOEXEC) == -1)
+      return false;
+    if (pipe2(StatusPipe, O_CLOEXEC) == -1) {
+      close(CtlPipe[0]);
+      close(CtlPipe[1]);
+      return false;
+    }
+
+    std::vector<std::string> ServerEnv =
+        LogDir.empty() ? Env : withLog(Env, logPattern(LogDir));
+    ServerEnv.push_back(FORKSRV_ENV "=" + std::to_string(FORKSRV_FD));
+    posix_spawn_file_actions_t Actions;
+    posix_spawn_file_actions_init(&Actions);
+    posix_spawn_file_actions_adddup2(&Actions, CtlPipe[0], FORKSRV_FD);
+    posix_spawn_file_actions_adddup2(&Actions, StatusPipe[1], FORKSRV_FD + 1);
+    ServerPid = spawn(Actions, ServerEnv);
+    posix_spawn_file_actions_destroy(&Actions);
+    close(CtlPipe[0]);
+    close(StatusPipe[1]);
+    CtlFd = CtlPipe[1];
+    StatusFd = StatusPipe[0];
+
+    uint32_t Hello;
+    if (ServerPid == -1 || !readFull(StatusFd, &Hello, sizeof(Hello)) ||
+        Hello != FORKSRV_HELLO) {
+      stopServer();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Stop the fork server, which exits once its requests are closed.
+   */
+  void stopServer() {
+    if (CtlFd != -1)
+      close(CtlFd);
+    if (StatusFd != -1)
+      close(StatusFd);
+    CtlFd = StatusFd = -1;
+    if (ServerPid != -1) {
+      int Status;
+      while (waitpid(ServerPid, &Status, 0) == -1 && errno == EINTR) {
+      }
+      ServerPid = -1;
+    }
+  }
+
+  bool hasServer() const { return CtlFd != -1; }
+
+  /**
+   * Run the target with Input on its stdin.
+   *
+   * @param LogPrefix If set, the runtime writes its logs to LogPrefix
+   *        followed by their extension.
+   * @return exit code of the target, 128 + signal number if it was killed
+   * by a signal, or 127 if it could not be executed.
+   */
+  int run(const std::string &Input, const std::string &LogPrefix = "") {
+    if (!openInput() || !writeInput(Input))
+      return 127;
+    std::string Pattern = logPattern(LogPrefix);
+    if (CtlFd != -1) {
+      ForkServerRequest Request = {(uint32_t)Pattern.size()};
+      int32_t Pid, Status;
+      if (writeFull(CtlFd, &Request, sizeof(Request)) &&
+          writeFull(CtlFd, Pattern.data(), Pattern.size()) &&
+          readFull(StatusFd, &Pid, sizeof(Pid)) &&
+          readFull(StatusFd, &Status, sizeof(Status)))
+        return exitCode(Status);
+      // The server is gone, spawn the remaining runs.
+      stopServer();
+      if (!writeInput(Input))
+        return 127;
+    }
+
+    std::vector<std::string> RunEnv =
+        LogPrefix.empty() ? Env : withLog(Env, Pattern);
+    posix_spawn_file_actions_t Actions;
+    posix_spawn_file_actions_init(&Actions);
+    pid_t Pid = spawn(Actions, RunEnv);
+    posix_spawn_file_actions_destroy(&Actions);
+    if (Pid == -1)
+      return 127;
+    int Status;
+    while (waitpid(Pid, &Status, 0) == -1) {
+      if (errno != EINTR)
+        return 127;
+    }
+    return exitCode(Status);
+  }
+
+private:
+  const std::string Target;
+  const std::vector<std::string> Env;
+  int InputFd = -1;
+  pid_t ServerPid = -1;
+  int CtlFd = -1;
+  int StatusFd = -1;
+
+  bool openInput() {
+    if (InputFd == -1)
+      InputFd = memfd_create("target_input", MFD_CLOEXEC);
+    return InputFd != -1;
+  }
+
+  /**
+   * Replace the input and rewind the file offset shared with the target.
+   */
+  bool writeInput(const std::string &Input) {
+    if (ftruncate(InputFd, 0) == -1)
+      return false;
+    size_t Written = 0;
+    while (Written < Input.size()) {
+      ssize_t Ret = pwrite(InputFd, Input.data() + Written,
+                           Input.size() - Written, Written);
+      if (Ret <= 0)
+        return false;
+      Written += Ret;
+    }
+    return lseek(InputFd, 0, SEEK_SET) == 0;
+  }
+
+  /**
+   * Spawn the target with the input on its stdin and without output, on top
+   * of the file actions of the caller.
+   */
+  pid_t spawn(posix_spawn_file_actions_t &Actions,
+              std::vector<std::string> &RunEnv) {
+    posix_spawn_file_actions_adddup2(&Actions, InputFd, STDIN_FILENO);
+    posix_spawn_file_actions_addopen(&Actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&Actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    std::vector<std::string> Args = {Target};
+    auto Argv = toArgv(Args);
+    auto Envp = toArgv(RunEnv);
+    pid_t Pid;
+    if (posix_spawn(&Pid, Target.c_str(), &Actions, NULL, Argv.data(),
+                    Envp.data()) != 0)
+      return -1;
+    return Pid;
+  }
+};
+
+/**
+ * Remove a directory and the files in it.
+ */
+inline void removeDir(const std::string &Dir) {
+  DIR *Handle = opendir(Dir.c_str());
+  if (Handle != NULL) {
+    while (struct dirent *Entry = readdir(Handle)) {
+      if (strcmp(Entry->d_name, ".") && strcmp(Entry->d_name, ".."))
+        unlink((Dir + "/" + Entry->d_name).c_str());
+    }
+    closedir(Handle);
+  }
+  rmdir(Dir.c_str());
+}
+
+/**
+ * Check if the target has a fork server, by starting one.
+ */
+inline bool hasForkServer(const std::string &Target,
+                          const std::vector<std::string> &Env) {
+  char LogDir[] = "/tmp/target_probe.XXXXXX";
+  if (mkdtemp(LogDir) == NULL)
+    return false;
+  bool Found;
+  {
+    TargetRunner Probe(Target, Env);
+    Found = Probe.startServer(LogDir);
+  }
+  removeDir(LogDir);
+  return Found;
+}
+
+/**
+ * Run the target with every input on Jobs parallel runners, through fork
+ * servers if ForkServer is set, and store the exit codes in Codes.
+ */
+inline void runBatch(const std::string &Target,
+                     const std::vector<std::string> &Env,
+                     const std::vector<std::string> &Inputs, bool ForkServer,
+                     int Jobs, std::vector<int> &Codes) {
+  Codes.assign(Inputs.size(), 127);
+  if (Jobs <= 0)
+    Jobs = std::max(1u, std::thread::hardware_concurrency());
+  Jobs = std::max<size_t>(1, std::min<size_t>(Jobs, Inputs.size()));
+  std::atomic<size_t> Next{0};
+  auto Work = [&] {
+    TargetRunner Runner(Target, Env);
+    if (ForkServer)
+      Runner.startServer();
+    for (size_t Index; (Index = Next++) < Inputs.size();)
+      Codes[Index] = Runner.run(Inputs[Index]);
+  };
+  std::vector<std::thread> Workers;
+  for (int Index = 1; Index < Jobs; ++Index)
+    Workers.emplace_back(Work);
+  Work();
+  for (auto &Worker : Workers)
+    Worker.join();
+}
+
+#endif // TARGET_RUNNER_H
@@ -0,0 +1,235 @@
+/**
+ * TargetRunner(target) runs the target with inputs on its stdin, see
+ * include/TargetRunner.h. It checks once whether the target has a fork
+ * server.
+ *
+ * run(input, log_prefix=None) runs one input, through a fork server kept
+ * across calls, and returns its exit code as run_target does.
+ * run_batch(inputs, jobs=0) runs every input on parallel runners, one per
+ * hardware thread by default, and returns their exit codes in order.
+ *
+ * The extension modules of lab4 and lab5 both build this file.
+ */
+
+#include "PyTargetRunner.h"
+#include "TargetRunner.h"
+
+#include <memory>
+#include <mutex>
+
+struct TargetRunnerState {
+  std::string Target;
+  std::vector<std::string> Env;
+  bool ForkServer = false;
+  // Runner of run(), started on the first call.
+  std::unique_ptr<TargetRunner> Runner;
+  std::mutex RunnerLock;
+};
+
+struct TargetRunnerObject {
+  PyObject_HEAD
+  TargetRunnerState *State;
+};
+
+bool readInputs(PyObject *Sequence, std::vector<std::string> &Inputs) {
+  PyObject *Fast = PySequence_Fast(Sequence, "inputs must be a sequence");
+  if (Fast == NULL)
+    return false;
+  Py_ssize_t Size = PySequence_Fast_GET_SIZE(Fast);
+  for (Py_ssize_t Index = 0; Index < Size; ++Index) {
+    PyObject *Item = PySequence_Fast_GET_ITEM(Fast, Index);
+    const char *Data;
+    Py_ssize_t Length;
+    if (PyBytes_Check(Item)) {
+      Data = PyBytes_AS_STRING(Item);
+      Length = PyBytes_GET_SIZE(Item);
+    } else if (PyUnicode_Check(Item)) {
+      Data = PyUnicode_AsUTF8AndSize(Item, &Length);
+      if (Data == NULL) {
+        Py_DECREF(Fast);
+        return false;
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "inputs must be bytes or str");
+      Py_DECREF(Fast);
+      return false;
+    }
+    Inputs.emplace_back(Data, Length);
+  }
+  Py_DECREF(Fast);
+  return true;
+}
+
+static bool readPath(PyObject *Path, std::string &String) {
+  PyObject *Bytes = NULL;
+  if (!PyUnicode_FSConverter(Path, &Bytes))
+    return false;
+  String.assign(PyBytes_AS_STRING(Bytes), PyBytes_GET_SIZE(Bytes));
+  Py_DECREF(Bytes);
+  return true;
+}
+
+static TargetRunnerState *getState(TargetRunnerObject *Self) {
+  if (Self->State == NULL)
+    PyErr_SetString(PyExc_RuntimeError, "TargetRunner is not initialized");
+  return Self->State;
+}
+
+static int targetRunnerInit(TargetRunnerObject *Self, PyObject *Args,
+                            PyObject *Kwargs) {
+  static const char *Keywords[] = {"target", NULL};
+  PyObject *TargetPath;
+  std::string Target;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "O:TargetRunner",
+                                   const_cast<char **>(Keywords),
+                                   &TargetPath) ||
+      !readPath(TargetPath, Target))
+    return -1;
+  // Runs release the GIL while they use the state, so it cannot be replaced.
+  if (Self->State != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "TargetRunner is already initialized");
+    return -1;
+  }
+  std::unique_ptr<TargetRunnerState> State(new TargetRunnerState());
+  State->Target = Target;
+  State->Env = getTargetEnv();
+  Py_BEGIN_ALLOW_THREADS;
+  State->ForkServer = hasForkServer(State->Target, State->Env);
+  Py_END_ALLOW_THREADS;
+  // Another thread may have initialized it while the probe ran.
+  if (Self->State != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "TargetRunner is already initialized");
+    return -1;
+  }
+  Self->State = State.release();
+  return 0;
+}
+
+static void targetRunnerDealloc(TargetRunnerObject *Self) {
+  PyTypeObject *Type = Py_TYPE(Self);
+  delete Self->State;
+  Type->tp_free(reinterpret_cast<PyObject *>(Self));
+#if PY_VERSION_HEX >= 0x03080000
+  // Instances of heap types hold a reference to their type since 3.8.
+  Py_DECREF(Type);
+#endif
+}
+
+static PyObject *targetRunnerRun(TargetRunnerObject *Self, PyObject *Args,
+                                 PyObject *Kwargs) {
+  static const char *Keywords[] = {"input", "log_prefix", NULL};
+  PyObject *Input, *LogPrefixPath = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "O|O:run",
+                                   const_cast<char **>(Keywords), &Input,
+                                   &LogPrefixPath))
+    return NULL;
+  TargetRunnerState *State = getState(Self);
+  std::vector<std::string> Inputs;
+  std::string LogPrefix;
+  PyObject *InputList = PyTuple_Pack(1, Input);
+  bool Parsed = InputList != NULL && readInputs(InputList, Inputs);
+  Py_XDECREF(InputList);
+  if (State == NULL || !Parsed ||
+      (LogPrefixPath != Py_None && !readPath(LogPrefixPath, LogPrefix)))
+    return NULL;
+
+  int Code;
+  Py_BEGIN_ALLOW_THREADS;
+  {
+    std::lock_guard<std::mutex> Guard(State->RunnerLock);
+    if (!State->Runner) {
+      State->Runner.reset(new TargetRunner(State->Target, State->Env));
+      if (State->ForkServer)
+        State->Runner->startServer();
+    }
+    Code = State->Runner->run(Inputs[0], LogPrefix);
+  }
+  Py_END_ALLOW_THREADS;
+  return PyLong_FromLong(Code);
+}
+
+static PyObject *targetRunnerRunBatch(TargetRunnerObject *Self, PyObject *Args,
+                                      PyObject *Kwargs) {
+  static const char *Keywords[] = {"inputs", "jobs", NULL};
+  PyObject *Sequence;
+  int Jobs = 0;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "O|i:run_batch",
+                                   const_cast<char **>(Keywords), &Sequence,
+                                   &Jobs))
+    return NULL;
+  TargetRunnerState *State = getState(Self);
+  std::vector<std::string> Inputs;
+  if (State == NULL || !readInputs(Sequence, Inputs))
+    return NULL;
+
+  std::vector<int> Codes;
+  Py_BEGIN_ALLOW_THREADS;
+  runBatch(State->Target, State->Env, Inputs, State->ForkServer, Jobs, Codes);
+  Py_END_ALLOW_THREADS;
+
+  PyObject *Result = PyList_New(Codes.size());
+  if (Result == NULL)
+    return NULL;
+  for (size_t Index = 0; Index < Codes.size(); ++Index) {
+    PyObject *Code = PyLong_FromLong(Codes[Index]);
+    if (Code == NULL) {
+      Py_DECREF(Result);
+      return NULL;
+    }
+    PyList_SET_ITEM(Result, Index, Code);
+  }
+  return Result;
+}
+
+static PyObject *targetRunnerGetForkServer(TargetRunnerObject *Self,
+                                           void *Closure) {
+  TargetRunnerState *State = getState(Self);
+  if (State == NULL)
+    return NULL;
+  return PyBool_FromLong(State->ForkServer);
+}
+
+static PyMethodDef TargetRunnerMethods[] = {
+    {"run", (PyCFunction)(void (*)(void))targetRunnerRun,
+     METH_VARARGS | METH_KEYWORDS,
+     "run(input, log_prefix=None)\n--\n\n"
+     "Run the target with input on its stdin, logging to log_prefix\n"
+     "followed by the extension of the log if set. Returns its exit code,\n"
+     "128 + signal number if it was killed by a signal."},
+    {"run_batch", (PyCFunction)(void (*)(void))targetRunnerRunBatch,
+     METH_VARARGS | METH_KEYWORDS,
+     "run_batch(inputs, jobs=0)\n--\n\n"
+     "Run the target with every input on parallel runners. Returns the\n"
+     "exit codes of the inputs."},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyGetSetDef TargetRunnerGetSet[] = {
+    {"fork_server", (getter)targetRunnerGetForkServer, NULL,
+     "Whether the target has a fork server.", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyType_Slot TargetRunnerSlots[] = {
+    {Py_tp_doc, const_cast<char *>(
+                    "TargetRunner(target)\n--\n\n"
+                    "Runs the target with inputs on its stdin, through a "
+                    "fork server if it has one.")},
+    {Py_tp_new, reinterpret_cast<void *>(PyType_GenericNew)},
+    {Py_tp_init, reinterpret_cast<void *>(targetRunnerInit)},
+    {Py_tp_dealloc, reinterpret_cast<void *>(targetRunnerDealloc)},
+    {Py_tp_methods, TargetRunnerMethods},
+    {Py_tp_getset, TargetRunnerGetSet},
+    {0, NULL},
+};
+
+bool addTargetRunnerType(PyObject *Module, const char *Name) {
+  PyType_Spec Spec = {Name, sizeof(TargetRunnerObject), 0, Py_TPFLAGS_DEFAULT,
+                      TargetRunnerSlots};
+  PyObject *Type = PyType_FromSpec(&Spec);
+  if (Type == NULL || PyModule_AddObject(Module, "TargetRunner", Type) < 0) {
+    Py_XDECREF(Type);
+    return false;
+  }
+  return true;
+}
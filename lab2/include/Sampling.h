@@ -0,0 +1,33 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include "llvm/IR/Function.h"
+
+#include <set>
+
+using namespace llvm;
+
+/**
+ * @brief Split every block of F into an uninstrumented fast path and a slow
+ * path copy to be instrumented, chosen at block entry by a countdown.
+ *
+ * Values live across blocks are first demoted to stack slots in a new entry
+ * block, so that control can switch between the two copies at any block
+ * boundary. Every other block B then gets a copy B' and a check block that
+ * all edges into B are redirected to. The check block decrements Countdown
+ * and enters B' once it drops to zero or below, B otherwise. B' starts with a
+ * call to OnSample, which draws the next countdown. Both copies branch to the
+ * check blocks of their successors.
+ *
+ * Functions with exception handling pads are left unchanged.
+ *
+ * @param F Function to transform.
+ * @param Countdown Thread-local i32 countdown.
+ * @param OnSample Function called when entering a slow path block.
+ * @param SlowBlocks Set to store the slow path copies.
+ * @return true if F was transformed.
+ */
+bool createSamplingPaths(Function &F, GlobalVariable *Countdown,
+                         Function *OnSample, std::set<BasicBlock *> &SlowBlocks);
+
+#endif // SAMPLING_H
@@ -0,0 +1,30 @@
+#ifndef SITE_TABLE_H
+#define SITE_TABLE_H
+
+/**
+ * Entry of the site table DynamicAnalysisPass emits with -site-table.
+ *
+ * Every instrumented instruction gets a dense site id and the runtime hooks
+ * only receive that id, the rest is looked up in the table at report time.
+ * The pass builds the matching LLVM type { i8, i32, i32, i8* }.
+ *
+ * Symbol is the binary operator symbol (see getBinOpSymbol), or 0 for
+ * coverage sites.
+ */
+struct SiteInfo {
+  char Symbol;
+  int Line;
+  int Col;
+  const char *Function;
+};
+
+/**
+ * Location of a coverage counter DynamicAnalysisPass emits with
+ * -inline-coverage, as the LLVM type { i32, i32 }.
+ */
+struct CoverageSite {
+  int Line;
+  int Col;
+};
+
+#endif // SITE_TABLE_H
@@ -0,0 +1,49 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+
+/**
+ * Binary trace format written by the runtime when LAB2_TRACE_FORMAT=binary.
+ *
+ * A trace is a sequence of blocks. Each block holds the events one thread
+ * buffered between two flushes and starts with a TraceBlockHeader followed by
+ * StoredSize payload bytes, zlib-compressed if TRACE_BLOCK_COMPRESSED is set.
+ * Blocks of the same (Pid, Tid) stream are decoded in file order and share
+ * their site definitions and operand deltas.
+ *
+ * The uncompressed payload is a sequence of records. All integers are LEB128
+ * varints and operand deltas are zigzag-encoded:
+ *
+ *   TRACE_RECORD_SITE   site, kind, opcode symbol (one byte), line, column
+ *   TRACE_RECORD_COV    site
+ *   TRACE_RECORD_BINOP  site, op1 - previous op1, op2 - previous op2
+ *
+ * A site is defined once per stream before its first event. Previous operands
+ * of a site start at zero.
+ */
+
+#define TRACE_BLOCK_MAGIC 0x4254324cu /* "L2TB" */
+#define TRACE_BLOCK_COMPRESSED 1u
+
+enum TraceRecord {
+  TRACE_RECORD_SITE = 0,
+  TRACE_RECORD_COV = 1,
+  TRACE_RECORD_BINOP = 2,
+};
+
+enum TraceSiteKind {
+  TRACE_SITE_COV = 0,
+  TRACE_SITE_BINOP = 1,
+};
+
+struct TraceBlockHeader {
+  uint32_t Magic;
+  uint32_t Pid;
+  uint32_t Tid;
+  uint32_t Flags;
+  uint32_t RawSize;
+  uint32_t StoredSize;
+};
+
+#endif // TRACE_FORMAT_H
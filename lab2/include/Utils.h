@@ -1,7 +1,12 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+
+#include <string>
+#include <unordered_map>
 
 using namespace llvm;
 
@@ -26,4 +31,27 @@ const std::string getBinOpName(const char symbol);
  */
 std::string variable(Value *V);
 
+/**
+ * Names the operands of one function like variable() does, without printing
+ * the whole value. Slot numbers of unnamed values are computed once for the
+ * function and names are cached, so naming an operand is cheap.
+ *
+ * A namer only reads the IR, namers of different functions can be used from
+ * different threads.
+ */
+class OperandNamer {
+public:
+  OperandNamer(Function &F);
+
+  /**
+   * Get the same name as variable(V). The reference stays valid as long as
+   * the namer.
+   */
+  const std::string &name(Value *V);
+
+private:
+  ModuleSlotTracker Slots;
+  std::unordered_map<Value *, std::string> Names;
+};
+
 #endif // UTILS_H
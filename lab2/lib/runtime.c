@@ -1,10 +1,155 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "SiteTable.h"
+#include "TraceFormat.h"
 
 const int STR_MAX_SIZE = 1024;
 
+/**
+ * Events are formatted into per-thread buffers and written to the log files
+ * in large appends: when a buffer fills up, when its thread exits, at exit
+ * for the exiting thread, and from a signal handler if the program crashes.
+ * The log format is the same as writing every event directly.
+ *
+ * With LAB2_TRACE_FORMAT=binary, events are instead encoded into <exe>.trace
+ * using the block format described in TraceFormat.h, and every full buffer is
+ * compressed into one block. Use trace-decode to turn a trace back into the
+ * .cov and .binops text.
+ *
+ * With LAB2_BINOP_MODE=profile, binary operators are not logged one line per
+ * execution. Every operator site instead aggregates the min, max, number of
+ * zeros and a log2 histogram of both operands, and a summary of all sites is
+ * written to <exe>.binprof once the program exits or crashes. A histogram
+ * entry 2^k:n counts n operands with 2^k <= |operand| < 2^(k+1).
+ *
+ * Logs are written next to the executable unless INSTR_LOG or INSTR_LOG_FD
+ * say otherwise, see get_logfile and get_logfd. Their paths are resolved
+ * once per process, and again in forked children.
+ *
+ * Modules built with -inline-coverage count coverage in their own counter
+ * arrays. Each covered (line, column) is written to the .cov file once, at
+ * exit or from the crash handler, instead of once per execution.
+ *
+ * Modules built with -sample only run the instrumented copy of a block when
+ * the thread's __sample_countdown runs out, which happens for every block
+ * execution with probability LAB2_SAMPLE_RATE (default 0.01). Countdowns are
+ * drawn from the matching geometric distribution, so the fast path costs one
+ * decrement and branch per block. The first block executed by a thread is
+ * always sampled, as it draws the thread's first countdown.
+ */
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+// Upper bound on the encoded size of a site definition plus one event.
+#define TRACE_MAX_RECORD 64
+
+// Number of operator sites the profile can hold, a power of two.
+#define PROFILE_SITES 4096
+
+// Histogram bucket 0 counts zeros, bucket k counts 2^(k-1) <= |v| < 2^k.
+#define PROFILE_BUCKETS 33
+
+enum log_channel { LOG_COV, LOG_BINOPS, LOG_TRACE, LOG_CHANNELS };
+
+static const char *LOG_EXTENSIONS[LOG_CHANNELS] = {".cov", ".binops",
+                                                   ".trace"};
+
+/**
+ * Aggregate of one operand. Zero-initialized counters are neutral: min and
+ * max are stored as order-preserving unsigned keys, min inverted, so both
+ * are updated by an atomic maximum.
+ */
+struct operand_profile {
+  unsigned int min_key;
+  unsigned int max_key;
+  unsigned long long buckets[PROFILE_BUCKETS];
+};
+
+struct binop_profile {
+  unsigned long long key; /* 0 for an empty slot */
+  unsigned long long count;
+  struct operand_profile operands[2];
+};
+
+struct trace_site {
+  unsigned long long key; /* 0 for an empty slot */
+  unsigned int id;
+  int op1;
+  int op2;
+};
+
+/**
+ * Per-thread encoder state: sites defined in the stream so far and the
+ * previous operands of every binary operator site.
+ */
+struct trace_encoder {
+  unsigned int tid;
+  struct trace_site *sites;
+  size_t capacity;
+  size_t count;
+};
+
+struct log_buffers {
+  size_t len[LOG_CHANNELS];
+  char data[LOG_CHANNELS][LOG_BUFFER_SIZE];
+  struct trace_encoder encoder;
+  int finished; /* set once its thread has exited */
+  struct log_buffers *next;
+};
+
+static char logfiles[LOG_CHANNELS][1024];
+static int logfds[LOG_CHANNELS] = {-1, -1, -1};
+static int binary_trace = 0;
+static int binop_profile = 0;
+static char profile_file[1024];
+static struct binop_profile *profiles = NULL;
+static unsigned long long dropped_profile_events = 0;
+static int profile_dumped = 0;
+static unsigned int next_tid = 0;
+static struct log_buffers *all_buffers = NULL;
+static __thread struct log_buffers *thread_buffers = NULL;
+static pthread_key_t thread_key;
+
+// Site tables registered by modules built with -site-table, indexed by the
+// global site id. Replaced, never freed, when it grows, so that hooks can
+// read it without taking site_lock.
+static const struct SiteInfo **site_index = NULL;
+static int site_count = 0;
+static int site_capacity = 0;
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counter arrays registered by functions instrumented with -inline-coverage.
+struct coverage_counters {
+  unsigned long long *counters;
+  const struct CoverageSite *sites;
+  int count;
+  struct coverage_counters *next;
+};
+static struct coverage_counters *all_counters = NULL;
+static int counters_dumped = 0;
+
+__thread int __sample_countdown __attribute__((tls_model("initial-exec"))) = 0;
+static double sample_log = 0; /* log(1 - rate), 0 to sample every block */
+static pthread_once_t sample_once = PTHREAD_ONCE_INIT;
+static __thread unsigned long long sample_state = 0;
+
+static const int CRASH_SIGNALS[] = {SIGSEGV, SIGFPE, SIGBUS, SIGILL, SIGABRT};
+#define NUM_CRASH_SIGNALS (sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]))
+static struct sigaction old_actions[NUM_CRASH_SIGNALS];
+
 const char *getBinOpName(char symbol) {
   switch (symbol) {
   case '+':
@@ -22,6 +167,19 @@ const char *getBinOpName(char symbol) {
   }
 }
 
+static void append_path(char *buf, int buf_size, int *len, const char *str) {
+  int ret = snprintf(buf + *len, buf_size - *len, "%s", str);
+  *len = ret < buf_size - *len ? *len + ret : buf_size - 1;
+}
+
+/**
+ * Get the log file of the given extension, <exe><ext> by default.
+ *
+ * INSTR_LOG overrides it with a directory, the log then is
+ * <dir>/<exe name><ext>, or with a pattern in which %p is replaced by the
+ * pid, %e by the executable name, %x by ext and %% by %. ext is appended to
+ * patterns without %x, so that the logs of a run don't collide.
+ */
 void get_logfile(char *buf, const int buf_size, const char *ext) {
   char exe[STR_MAX_SIZE];
   int ret = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
@@ -30,30 +188,637 @@ void get_logfile(char *buf, const int buf_size, const char *ext) {
     exit(1);
   }
   exe[ret] = 0;
+  const char *name = strrchr(exe, '/');
+  name = name != NULL ? name + 1 : exe;
+
+  const char *pattern = getenv("INSTR_LOG");
+  struct stat st;
+  if (pattern == NULL || *pattern == 0) {
+    snprintf(buf, buf_size, "%s%s", exe, ext);
+    return;
+  }
+  if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode)) {
+    snprintf(buf, buf_size, "%s/%s%s", pattern, name, ext);
+    return;
+  }
+
+  char pid[16];
+  snprintf(pid, sizeof(pid), "%d", (int)getpid());
+  int len = 0;
+  int has_ext = 0;
+  buf[0] = 0;
+  for (const char *c = pattern; *c != 0; ++c) {
+    char literal[2] = {*c, 0};
+    const char *part = literal;
+    if (*c == '%' && c[1] != 0) {
+      literal[0] = *++c;
+      if (*c == 'p') {
+        part = pid;
+      } else if (*c == 'e') {
+        part = name;
+      } else if (*c == 'x') {
+        part = ext;
+        has_ext = 1;
+      }
+    }
+    append_path(buf, buf_size, &len, part);
+  }
+  if (!has_ext) {
+    append_path(buf, buf_size, &len, ext);
+  }
+}
+
+/**
+ * Get the fd inherited for the log of the given extension, -1 if none.
+ * INSTR_LOG_FD lists them as <ext>=<fd> separated by commas, with ext
+ * without its dot, e.g. cov=3,binops=4. It takes precedence over INSTR_LOG.
+ */
+static int get_logfd(const char *ext) {
+  const char *list = getenv("INSTR_LOG_FD");
+  if (*ext == '.') {
+    ++ext;
+  }
+  size_t ext_len = strlen(ext);
+  while (list != NULL && *list != 0) {
+    if (strncmp(list, ext, ext_len) == 0 && list[ext_len] == '=') {
+      int fd = atoi(list + ext_len + 1);
+      return fcntl(fd, F_GETFD) != -1 ? fd : -1;
+    }
+    list = strchr(list, ',');
+    if (list != NULL) {
+      ++list;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Open the log file of a channel on first use, so that runs without events
+ * of that kind don't create the file.
+ * Only uses async-signal-safe functions.
+ */
+static int log_fd(enum log_channel channel) {
+  int fd = __atomic_load_n(&logfds[channel], __ATOMIC_ACQUIRE);
+  if (fd != -1) {
+    return fd;
+  }
+  fd = open(logfiles[channel], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+            0666);
+  int expected = -1;
+  if (fd != -1 &&
+      !__atomic_compare_exchange_n(&logfds[channel], &expected, fd, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    close(fd);
+    fd = expected;
+  }
+  return fd;
+}
+
+static void write_all(int fd, struct iovec *iov, int iovcnt) {
+  while (fd != -1 && iovcnt > 0) {
+    ssize_t ret = writev(fd, iov, iovcnt);
+    if (ret <= 0) {
+      return;
+    }
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
+
+/**
+ * Write the buffered trace records as one block, compressed unless called
+ * from a signal handler.
+ */
+static void flush_trace(struct log_buffers *buffers, int in_signal) {
+  size_t len = buffers->len[LOG_TRACE];
+  struct TraceBlockHeader header = {TRACE_BLOCK_MAGIC, (uint32_t)getpid(),
+                                    buffers->encoder.tid, 0, (uint32_t)len,
+                                    (uint32_t)len};
+  struct iovec iov[2] = {{&header, sizeof(header)},
+                         {buffers->data[LOG_TRACE], len}};
+  unsigned char *compressed = NULL;
+#ifdef HAVE_ZLIB
+  uLongf compressed_len = compressBound(len);
+  if (!in_signal && (compressed = malloc(compressed_len)) != NULL &&
+      compress2(compressed, &compressed_len,
+                (const Bytef *)buffers->data[LOG_TRACE], len,
+                Z_BEST_SPEED) == Z_OK &&
+      compressed_len < len) {
+    header.Flags |= TRACE_BLOCK_COMPRESSED;
+    header.StoredSize = compressed_len;
+    iov[1].iov_base = compressed;
+    iov[1].iov_len = compressed_len;
+  }
+#endif
+  write_all(log_fd(LOG_TRACE), iov, 2);
+  free(compressed);
+}
+
+/**
+ * Write the buffered events of one channel.
+ * Only uses async-signal-safe functions if in_signal is set.
+ */
+static void flush_channel(struct log_buffers *buffers,
+                          enum log_channel channel, int in_signal) {
+  size_t len = buffers->len[channel];
+  if (len == 0) {
+    return;
+  }
+  if (channel == LOG_TRACE) {
+    flush_trace(buffers, in_signal);
+  } else {
+    struct iovec iov = {buffers->data[channel], len};
+    write_all(log_fd(channel), &iov, 1);
+  }
+  buffers->len[channel] = 0;
+}
+
+static void flush_buffers(struct log_buffers *buffers, int in_signal) {
+  for (int channel = 0; channel < LOG_CHANNELS; ++channel) {
+    flush_channel(buffers, channel, in_signal);
+  }
+}
+
+/**
+ * Write the buffered events of every thread from the crash handler. Other
+ * threads may be appending to their buffers meanwhile, so this is best
+ * effort, but the crashing process is about to die anyway.
+ */
+static void flush_all_buffers(void) {
+  struct log_buffers *buffers = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE);
+  for (; buffers != NULL; buffers = buffers->next) {
+    flush_buffers(buffers, 1);
+  }
+}
+
+/**
+ * Write the buffered events of the exiting thread and of the threads that
+ * have exited before it. Threads still running own their buffers, so the
+ * events they buffered since their last flush are not written, as if the
+ * process had been killed.
+ */
+static void flush_exit_buffers(void) {
+  struct log_buffers *buffers = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE);
+  for (; buffers != NULL; buffers = buffers->next) {
+    if (buffers == thread_buffers ||
+        __atomic_load_n(&buffers->finished, __ATOMIC_ACQUIRE)) {
+      flush_buffers(buffers, 0);
+    }
+  }
+}
+
+/**
+ * Format a decimal integer, async-signal-safe unlike snprintf.
+ * Returns the number of characters written, at most 11.
+ */
+static int format_int(char *buf, int value) {
+  char digits[12];
+  int len = 0;
+  unsigned int magnitude =
+      value < 0 ? -(unsigned int)value : (unsigned int)value;
+  do {
+    digits[len++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  int out = 0;
+  if (value < 0) {
+    buf[out++] = '-';
+  }
+  while (len > 0) {
+    buf[out++] = digits[--len];
+  }
+  return out;
+}
+
+static unsigned int key_to_int(unsigned int key) { return key ^ 0x80000000u; }
+
+static int profile_min(struct operand_profile *operand) {
+  return (int)key_to_int(~operand->min_key);
+}
+
+static int profile_max(struct operand_profile *operand) {
+  return (int)key_to_int(operand->max_key);
+}
+
+static int format_operand(char *buf, size_t size, const char *name,
+                          struct operand_profile *operand) {
+  int len = snprintf(buf, size, "  %s operand: min=%d max=%d zeros=%llu",
+                     name, profile_min(operand), profile_max(operand),
+                     operand->buckets[0]);
+  for (int bucket = 1; bucket < PROFILE_BUCKETS; ++bucket) {
+    if (operand->buckets[bucket] != 0 && len < (int)size) {
+      len += snprintf(buf + len, size - len, " 2^%d:%llu", bucket - 1,
+                      operand->buckets[bucket]);
+    }
+  }
+  if (len < (int)size) {
+    len += snprintf(buf + len, size - len, "\n");
+  }
+  return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * Write the summary of every profiled operator site. Only done once, at exit
+ * or from the crash handler; formatting with snprintf is not
+ * async-signal-safe, but the crashing process is about to die anyway.
+ */
+static void dump_profile(void) {
+  if (profiles == NULL ||
+      __atomic_exchange_n(&profile_dumped, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  int fd = open(profile_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    return;
+  }
+  char buf[3 * STR_MAX_SIZE];
+  for (int slot = 0; slot < PROFILE_SITES; ++slot) {
+    struct binop_profile *profile = &profiles[slot];
+    unsigned long long key = __atomic_load_n(&profile->key, __ATOMIC_ACQUIRE);
+    if (key == 0) {
+      continue;
+    }
+    int len = snprintf(buf, sizeof(buf),
+                       "%s on Line %d, Column %d executed %llu times\n",
+                       getBinOpName((char)(key & 0xff)),
+                       (int)((key >> 32) & 0x7fffffff),
+                       (int)((key >> 8) & 0xffffff), profile->count);
+    len += format_operand(buf + len, sizeof(buf) - len, "first",
+                          &profile->operands[0]);
+    len += format_operand(buf + len, sizeof(buf) - len, "second",
+                          &profile->operands[1]);
+    struct iovec iov = {buf, len};
+    write_all(fd, &iov, 1);
+  }
+  if (dropped_profile_events != 0) {
+    int len = snprintf(buf, sizeof(buf),
+                       "Dropped %llu events of sites beyond the first %d\n",
+                       dropped_profile_events, PROFILE_SITES);
+    struct iovec iov = {buf, len};
+    write_all(fd, &iov, 1);
+  }
+  close(fd);
+}
+
+/**
+ * Write every covered counter site to the .cov file.
+ * Only uses async-signal-safe functions.
+ */
+static void dump_counters(void) {
+  if (__atomic_exchange_n(&counters_dumped, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  struct coverage_counters *module =
+      __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+  if (module == NULL) {
+    return;
+  }
+  int fd = log_fd(LOG_COV);
+  char buf[4096];
+  size_t len = 0;
+  for (; module != NULL; module = module->next) {
+    for (int i = 0; i < module->count; ++i) {
+      if (__atomic_load_n(&module->counters[i], __ATOMIC_RELAXED) == 0) {
+        continue;
+      }
+      if (len + 32 > sizeof(buf)) {
+        struct iovec iov = {buf, len};
+        write_all(fd, &iov, 1);
+        len = 0;
+      }
+      len += format_int(buf + len, module->sites[i].Line);
+      buf[len++] = ',';
+      buf[len++] = ' ';
+      len += format_int(buf + len, module->sites[i].Col);
+      buf[len++] = '\n';
+    }
+  }
+  struct iovec iov = {buf, len};
+  write_all(fd, &iov, 1);
+}
+
+static void flush_all(void) {
+  dump_counters();
+  flush_exit_buffers();
+  dump_profile();
+}
+
+static void flush_thread(void *arg) {
+  struct log_buffers *buffers = arg;
+  flush_buffers(buffers, 0);
+  __atomic_store_n(&buffers->finished, 1, __ATOMIC_RELEASE);
+}
 
-  int len = strlen(exe);
-  strncpy(buf, exe, len);
-  buf[len] = 0;
-  for (int i = 0; i <= strlen(ext); ++i) {
-    buf[buf_size-(i+1)] = 0;
+static void crash_handler(int sig) {
+  dump_counters();
+  flush_all_buffers();
+  dump_profile();
+  for (int i = 0; i < NUM_CRASH_SIGNALS; ++i) {
+    if (CRASH_SIGNALS[i] == sig) {
+      sigaction(sig, &old_actions[i], NULL);
+    }
   }
-  strncat(buf, ext, strlen(ext));
+  raise(sig);
+}
+
+/**
+ * Buffered events belong to the parent, drop them in a forked child.
+ * The child starts new trace streams, so its site definitions start over.
+ */
+static void reset_after_fork(void) {
+  // Don't draw the same samples as the parent.
+  sample_state = 0;
+  // Logs named after the pid move to files of the child.
+  for (int channel = 0; channel < LOG_CHANNELS; ++channel) {
+    char logfile[sizeof(logfiles[channel])];
+    get_logfile(logfile, sizeof(logfile), LOG_EXTENSIONS[channel]);
+    if (strcmp(logfile, logfiles[channel]) != 0 &&
+        get_logfd(LOG_EXTENSIONS[channel]) == -1) {
+      strcpy(logfiles[channel], logfile);
+      if (logfds[channel] != -1) {
+        close(logfds[channel]);
+        logfds[channel] = -1;
+      }
+    }
+  }
+  if (binop_profile) {
+    get_logfile(profile_file, sizeof(profile_file), ".binprof");
+  }
+  struct log_buffers *buffers = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE);
+  for (; buffers != NULL; buffers = buffers->next) {
+    memset(buffers->len, 0, sizeof(buffers->len));
+    if (buffers->encoder.sites != NULL) {
+      memset(buffers->encoder.sites, 0,
+             buffers->encoder.capacity * sizeof(struct trace_site));
+    }
+    buffers->encoder.count = 0;
+  }
+  // The child reports its own coverage and profile only.
+  struct coverage_counters *module =
+      __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+  for (; module != NULL; module = module->next) {
+    memset(module->counters, 0, module->count * sizeof(*module->counters));
+  }
+  if (profiles != NULL) {
+    memset(profiles, 0, PROFILE_SITES * sizeof(struct binop_profile));
+    dropped_profile_events = 0;
+  }
+}
+
+__attribute__((constructor)) static void init_runtime(void) {
+  const char *format = getenv("LAB2_TRACE_FORMAT");
+  binary_trace = format != NULL && strcmp(format, "binary") == 0;
+  const char *binop_mode = getenv("LAB2_BINOP_MODE");
+  binop_profile = binop_mode != NULL && strcmp(binop_mode, "profile") == 0;
+  if (binop_profile) {
+    get_logfile(profile_file, sizeof(profile_file), ".binprof");
+    profiles = calloc(PROFILE_SITES, sizeof(struct binop_profile));
+    if (profiles == NULL) {
+      fprintf(stderr, "Error: Cannot allocate binop profile\n");
+      exit(1);
+    }
+  }
+  for (int channel = 0; channel < LOG_CHANNELS; ++channel) {
+    get_logfile(logfiles[channel], sizeof(logfiles[channel]),
+                LOG_EXTENSIONS[channel]);
+    logfds[channel] = get_logfd(LOG_EXTENSIONS[channel]);
+  }
+  pthread_key_create(&thread_key, flush_thread);
+  pthread_atfork(NULL, NULL, reset_after_fork);
+  atexit(flush_all);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crash_handler;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < NUM_CRASH_SIGNALS; ++i) {
+    sigaction(CRASH_SIGNALS[i], &action, &old_actions[i]);
+  }
+}
+
+static struct log_buffers *get_buffers(void) {
+  struct log_buffers *buffers = thread_buffers;
+  if (buffers != NULL) {
+    return buffers;
+  }
+  buffers = calloc(1, sizeof(struct log_buffers));
+  if (buffers == NULL) {
+    fprintf(stderr, "Error: Cannot allocate log buffers\n");
+    exit(1);
+  }
+  // Buffers are never freed, so the list can be walked from signal handlers.
+  buffers->next = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&all_buffers, &buffers->next, buffers, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+  }
+  buffers->encoder.tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+  pthread_setspecific(thread_key, buffers);
+  thread_buffers = buffers;
+  return buffers;
+}
+
+static void log_event(enum log_channel channel, const char *line, int len) {
+  struct log_buffers *buffers = get_buffers();
+  if (buffers->len[channel] + len > LOG_BUFFER_SIZE) {
+    flush_channel(buffers, channel, 0);
+  }
+  memcpy(buffers->data[channel] + buffers->len[channel], line, len);
+  // Publish the event only once it is complete.
+  __atomic_store_n(&buffers->len[channel], buffers->len[channel] + len,
+                   __ATOMIC_RELEASE);
+}
+
+static char *put_varint(char *out, unsigned long long value) {
+  while (value >= 0x80) {
+    *out++ = (char)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (char)value;
+  return out;
+}
+
+static unsigned long long zigzag(long long value) {
+  return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static unsigned long long site_hash(unsigned long long key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+/**
+ * Key of a site in the hash tables, never 0.
+ */
+static unsigned long long site_key(char symbol, int line, int col) {
+  return (1ULL << 63) | ((unsigned long long)(line & 0x7fffffff) << 32) |
+         ((unsigned long long)(col & 0xffffff) << 8) | (unsigned char)symbol;
+}
+
+/**
+ * Find the slot of a site, inserting it if needed.
+ * Sets *is_new if the site was not defined in this stream yet.
+ */
+static struct trace_site *trace_site(struct trace_encoder *encoder,
+                                     unsigned long long key, int *is_new) {
+  if (2 * (encoder->count + 1) > encoder->capacity) {
+    size_t old_capacity = encoder->capacity;
+    struct trace_site *old_sites = encoder->sites;
+    encoder->capacity = old_capacity ? 2 * old_capacity : 1024;
+    encoder->sites = calloc(encoder->capacity, sizeof(struct trace_site));
+    if (encoder->sites == NULL) {
+      fprintf(stderr, "Error: Cannot allocate trace sites\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_sites[i].key == 0) {
+        continue;
+      }
+      size_t slot = site_hash(old_sites[i].key) & (encoder->capacity - 1);
+      while (encoder->sites[slot].key != 0) {
+        slot = (slot + 1) & (encoder->capacity - 1);
+      }
+      encoder->sites[slot] = old_sites[i];
+    }
+    free(old_sites);
+  }
+
+  size_t slot = site_hash(key) & (encoder->capacity - 1);
+  while (encoder->sites[slot].key != 0 && encoder->sites[slot].key != key) {
+    slot = (slot + 1) & (encoder->capacity - 1);
+  }
+  struct trace_site *site = &encoder->sites[slot];
+  *is_new = site->key == 0;
+  if (*is_new) {
+    site->key = key;
+    site->id = encoder->count++;
+    site->op1 = 0;
+    site->op2 = 0;
+  }
+  return site;
+}
+
+static void trace_event(char symbol, int line, int col, int is_binop, int op1,
+                        int op2) {
+  struct log_buffers *buffers = get_buffers();
+  if (buffers->len[LOG_TRACE] + TRACE_MAX_RECORD > LOG_BUFFER_SIZE) {
+    flush_channel(buffers, LOG_TRACE, 0);
+  }
+
+  int is_new;
+  struct trace_site *site =
+      trace_site(&buffers->encoder, site_key(symbol, line, col), &is_new);
+
+  char *start = buffers->data[LOG_TRACE] + buffers->len[LOG_TRACE];
+  char *out = start;
+  if (is_new) {
+    *out++ = TRACE_RECORD_SITE;
+    out = put_varint(out, site->id);
+    *out++ = is_binop ? TRACE_SITE_BINOP : TRACE_SITE_COV;
+    *out++ = symbol;
+    out = put_varint(out, (unsigned int)line);
+    out = put_varint(out, (unsigned int)col);
+  }
+  if (is_binop) {
+    *out++ = TRACE_RECORD_BINOP;
+    out = put_varint(out, site->id);
+    out = put_varint(out, zigzag((long long)op1 - site->op1));
+    out = put_varint(out, zigzag((long long)op2 - site->op2));
+    site->op1 = op1;
+    site->op2 = op2;
+  } else {
+    *out++ = TRACE_RECORD_COV;
+    out = put_varint(out, site->id);
+  }
+  // Publish the records only once they are complete.
+  __atomic_store_n(&buffers->len[LOG_TRACE],
+                   buffers->len[LOG_TRACE] + (out - start), __ATOMIC_RELEASE);
+}
+
+static void atomic_max(unsigned int *target, unsigned int value) {
+  unsigned int current = __atomic_load_n(target, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(target, &current, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void profile_operand(struct operand_profile *operand, int value) {
+  unsigned int key = key_to_int((unsigned int)value);
+  atomic_max(&operand->min_key, ~key);
+  atomic_max(&operand->max_key, key);
+  unsigned int magnitude =
+      value < 0 ? -(unsigned int)value : (unsigned int)value;
+  int bucket = magnitude == 0 ? 0 : 32 - __builtin_clz(magnitude);
+  __atomic_fetch_add(&operand->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Find the profile of an operator site, claiming a free slot if needed.
+ * Returns NULL once all slots are taken by other sites.
+ */
+static struct binop_profile *find_profile(unsigned long long key) {
+  size_t slot = site_hash(key) & (PROFILE_SITES - 1);
+  for (int probe = 0; probe < PROFILE_SITES; ++probe) {
+    struct binop_profile *profile = &profiles[slot];
+    unsigned long long current =
+        __atomic_load_n(&profile->key, __ATOMIC_ACQUIRE);
+    // A failed exchange loads the key of the site that won the slot.
+    if (current == 0 &&
+        __atomic_compare_exchange_n(&profile->key, &current, key, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return profile;
+    }
+    if (current == key) {
+      return profile;
+    }
+    slot = (slot + 1) & (PROFILE_SITES - 1);
+  }
+  return NULL;
+}
+
+static void profile_event(char symbol, int line, int col, int op1, int op2) {
+  struct binop_profile *profile = find_profile(site_key(symbol, line, col));
+  if (profile == NULL) {
+    __atomic_fetch_add(&dropped_profile_events, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&profile->count, 1, __ATOMIC_RELAXED);
+  profile_operand(&profile->operands[0], op1);
+  profile_operand(&profile->operands[1], op2);
 }
 
 void __coverage__(int line, int col) {
-  char logfile[STR_MAX_SIZE];
-  get_logfile(logfile, sizeof(logfile), ".cov");
-  FILE *f = fopen(logfile, "a");
-  fprintf(f, "%d, %d\n", line, col);
-  fclose(f);
+  if (binary_trace) {
+    trace_event(0, line, col, 0, 0, 0);
+    return;
+  }
+  char event[STR_MAX_SIZE];
+  int len = snprintf(event, sizeof(event), "%d, %d\n", line, col);
+  log_event(LOG_COV, event, len);
 }
 
 void __binop_op__(char c, int line, int col, int op1, int op2) {
-  char logfile[STR_MAX_SIZE];
-  get_logfile(logfile, sizeof(logfile), ".binops");
-  FILE *f = fopen(logfile, "a");
-  fprintf(
-    f,
+  if (binop_profile) {
+    profile_event(c, line, col, op1, op2);
+    return;
+  }
+  if (binary_trace) {
+    trace_event(c, line, col, 1, op1, op2);
+    return;
+  }
+  char event[STR_MAX_SIZE];
+  int len = snprintf(
+    event,
+    sizeof(event),
     "%s on Line %d, Column %d with first operand=%d and second operand=%d\n",
     getBinOpName(c),
     line,
@@ -61,5 +826,124 @@ void __binop_op__(char c, int line, int col, int op1, int op2) {
     op1,
     op2
   );
-  fclose(f);
+  log_event(LOG_BINOPS, event, len);
+}
+
+/**
+ * Register the site table of a function and return the global id of its first
+ * site. Called from the constructor DynamicAnalysisPass emits with
+ * -site-table, before any of its site hooks can run.
+ */
+int __register_sites__(const struct SiteInfo *table, int count) {
+  pthread_mutex_lock(&site_lock);
+  int base = site_count;
+  if (base + count > site_capacity) {
+    int capacity = site_capacity ? site_capacity : 1024;
+    while (capacity < base + count) {
+      capacity *= 2;
+    }
+    const struct SiteInfo **index = malloc(capacity * sizeof(*index));
+    if (index == NULL) {
+      fprintf(stderr, "Error: Cannot allocate site index\n");
+      exit(1);
+    }
+    if (base > 0) {
+      memcpy(index, site_index, base * sizeof(*index));
+    }
+    __atomic_store_n(&site_index, index, __ATOMIC_RELEASE);
+    site_capacity = capacity;
+  }
+  for (int i = 0; i < count; ++i) {
+    site_index[base + i] = &table[i];
+  }
+  site_count = base + count;
+  pthread_mutex_unlock(&site_lock);
+  return base;
+}
+
+static const struct SiteInfo *get_site(int id) {
+  return __atomic_load_n(&site_index, __ATOMIC_ACQUIRE)[id];
+}
+
+void __coverage_site__(int id) {
+  const struct SiteInfo *site = get_site(id);
+  __coverage__(site->Line, site->Col);
+}
+
+void __binop_site__(int id, int op1, int op2) {
+  const struct SiteInfo *site = get_site(id);
+  __binop_op__(site->Symbol, site->Line, site->Col, op1, op2);
+}
+
+/**
+ * Register the coverage counters of a function. Called from the constructor
+ * DynamicAnalysisPass emits with -inline-coverage.
+ */
+void __register_counters__(unsigned long long *counters,
+                           const struct CoverageSite *sites, int count) {
+  struct coverage_counters *module = malloc(sizeof(struct coverage_counters));
+  if (module == NULL) {
+    fprintf(stderr, "Error: Cannot allocate coverage counters\n");
+    exit(1);
+  }
+  module->counters = counters;
+  module->sites = sites;
+  module->count = count;
+  module->next = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&all_counters, &module->next, module, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+static unsigned long long next_random(void) {
+  if (sample_state == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample_state = (unsigned long long)now.tv_nsec ^
+                   ((unsigned long long)getpid() << 32) ^
+                   (unsigned long long)(size_t)&sample_state;
+    sample_state = site_hash(sample_state) | 1;
+  }
+  // xorshift64*
+  sample_state ^= sample_state >> 12;
+  sample_state ^= sample_state << 25;
+  sample_state ^= sample_state >> 27;
+  return sample_state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Read LAB2_SAMPLE_RATE, on the first sampled block so that a bad value
+ * does not affect programs built without -sample. A bad value falls back to
+ * the default rate with a warning.
+ */
+static void init_sampling(void) {
+  const char *sample_rate = getenv("LAB2_SAMPLE_RATE");
+  double rate = 0.01;
+  if (sample_rate != NULL && *sample_rate != 0) {
+    char *end;
+    double value = strtod(sample_rate, &end);
+    if (*end == 0 && value > 0 && value <= 1) {
+      rate = value;
+    } else {
+      fprintf(stderr, "Warning: LAB2_SAMPLE_RATE must be in (0, 1], "
+                      "using 0.01\n");
+    }
+  }
+  sample_log = rate < 1 ? log1p(-rate) : 0;
+}
+
+/**
+ * Called on entry of every sampled block, draws the number of block
+ * executions until the next sample.
+ */
+void __sample__(void) {
+  pthread_once(&sample_once, init_sampling);
+  if (sample_log == 0) {
+    __sample_countdown = 1;
+    return;
+  }
+  // Uniform in (0, 1].
+  double u = ((next_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+  double countdown = floor(log(u) / sample_log) + 1;
+  __sample_countdown = countdown < INT_MAX ? (int)countdown : INT_MAX;
 }
@@ -1,6 +1,13 @@
 #include "Instrument.h"
+#include "Sampling.h"
 #include "Utils.h"
 
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <map>
+#include <set>
+
 using namespace llvm;
 
 namespace instrument {
@@ -9,10 +16,73 @@ const auto PASS_NAME = "DynamicAnalysisPass";
 const auto PASS_DESC = "Dynamic Analysis Pass";
 const auto COVERAGE_FUNCTION_NAME = "__coverage__";
 const auto BINOP_OPERANDS_FUNCTION_NAME = "__binop_op__";
+const auto COVERAGE_SITE_FUNCTION_NAME = "__coverage_site__";
+const auto BINOP_SITE_FUNCTION_NAME = "__binop_site__";
+const auto REGISTER_SITES_FUNCTION_NAME = "__register_sites__";
+const auto SITE_TABLE_NAME = "__site_table";
+const auto SITE_BASE_NAME = "__site_base";
+const auto REGISTER_COUNTERS_FUNCTION_NAME = "__register_counters__";
+const auto COVERAGE_COUNTERS_NAME = "__coverage_counters";
+const auto COVERAGE_SITES_NAME = "__coverage_sites";
+const auto SAMPLE_FUNCTION_NAME = "__sample__";
+const auto SAMPLE_COUNTDOWN_NAME = "__sample_countdown";
+
+static cl::opt<bool>
+    UseSiteTable("site-table",
+                 cl::desc("Pass dense site ids to the runtime and emit a "
+                          "table with the opcode, line, column and function "
+                          "of every site"));
+
+static cl::opt<bool> InlineCoverage(
+    "inline-coverage",
+    cl::desc("Count line coverage in a global counter array instead of "
+             "calling the runtime for every instruction"));
+
+static cl::opt<bool>
+    AtomicCounters("inline-coverage-atomic",
+                   cl::desc("Increment the coverage counters with atomicrmw "
+                            "so that counts are exact in threaded programs"));
+
+static cl::opt<bool>
+    Sample("sample",
+           cl::desc("Only instrument a random sample of block executions, "
+                    "at the rate set by LAB2_SAMPLE_RATE at runtime"));
+
+/**
+ * Coverage counters of the function being instrumented with -inline-coverage,
+ * one per (line, column) of the function.
+ */
+struct CoverageCounters {
+  GlobalVariable *Counters = nullptr;
+  std::map<std::pair<int, int>, unsigned> Slots;
+};
+
+/**
+ * Sites of the function being instrumented with -site-table, see SiteInfo in
+ * SiteTable.h. Every function registers its own table at startup and the
+ * runtime returns the id of its first site, which is stored in Base.
+ */
+struct SiteTable {
+  struct Site {
+    char Symbol;
+    int Line;
+    int Col;
+  };
+  GlobalVariable *Base = nullptr;
+  std::vector<Site> Sites;
+};
 
 void instrumentCoverage(Module *M, Instruction &I, int Line, int Col);
 void instrumentBinOpOperands(Module *M, BinaryOperator *BinOp, int Line,
                              int Col);
+void instrumentCoverageSite(Module *M, SiteTable &Table, Instruction &I,
+                            int Line, int Col);
+void instrumentBinOpSite(Module *M, SiteTable &Table, BinaryOperator *BinOp,
+                         int Line, int Col);
+void emitSiteTable(Function &F, SiteTable &Table);
+CoverageCounters createCoverageCounters(Function &F);
+void instrumentCoverageCounter(Module *M, CoverageCounters &Counters,
+                               Instruction &I, int Line, int Col);
 
 bool Instrument::runOnFunction(Function &F) {
   auto FunctionName = F.getName().str();
@@ -32,8 +102,42 @@ bool Instrument::runOnFunction(Function &F) {
   M->getOrInsertFunction(BINOP_OPERANDS_FUNCTION_NAME, VoidType, Int8Type,
                          Int32Type, Int32Type, Int32Type, Int32Type);
 
+  if (UseSiteTable) {
+    M->getOrInsertFunction(COVERAGE_SITE_FUNCTION_NAME, VoidType, Int32Type);
+    M->getOrInsertFunction(BINOP_SITE_FUNCTION_NAME, VoidType, Int32Type,
+                           Int32Type, Int32Type);
+  }
+  SiteTable Table;
+  CoverageCounters Counters;
+  if (InlineCoverage) {
+    Counters = createCoverageCounters(F);
+  }
+
+  // With -sample, only the slow path copies of the blocks are instrumented.
+  std::set<BasicBlock *> SlowBlocks;
+  bool Sampled = false;
+  if (Sample) {
+    auto *Countdown = M->getNamedGlobal(SAMPLE_COUNTDOWN_NAME);
+    if (!Countdown) {
+      Countdown = new GlobalVariable(
+          *M, Int32Type, false, GlobalValue::ExternalLinkage, nullptr,
+          SAMPLE_COUNTDOWN_NAME, nullptr, GlobalValue::InitialExecTLSModel);
+    }
+    M->getOrInsertFunction(SAMPLE_FUNCTION_NAME, VoidType);
+    Sampled = createSamplingPaths(
+        F, Countdown, M->getFunction(SAMPLE_FUNCTION_NAME), SlowBlocks);
+  }
+
+  // Sites already counted in the current block, a counter only needs to be
+  // incremented once per execution of a block.
+  std::set<std::pair<int, int>> CountedInBlock;
+  BasicBlock *CurrentBlock = nullptr;
+
   for (inst_iterator Iter = inst_begin(F), E = inst_end(F); Iter != E; ++Iter) {
     Instruction &Inst = (*Iter);
+    if (Sampled && !SlowBlocks.count(Inst.getParent())) {
+      continue;
+    }
     llvm::DebugLoc DebugLoc = Inst.getDebugLoc();
     if (!DebugLoc) {
       // Skip Instruction if it doesn't have debug information.
@@ -42,20 +146,208 @@ bool Instrument::runOnFunction(Function &F) {
 
     int Line = DebugLoc.getLine();
     int Col = DebugLoc.getCol();
-    instrumentCoverage(M, Inst, Line, Col);
+    if (InlineCoverage) {
+      if (Inst.getParent() != CurrentBlock) {
+        CurrentBlock = Inst.getParent();
+        CountedInBlock.clear();
+      }
+      if (CountedInBlock.insert({Line, Col}).second) {
+        instrumentCoverageCounter(M, Counters, Inst, Line, Col);
+      }
+    } else if (UseSiteTable) {
+      instrumentCoverageSite(M, Table, Inst, Line, Col);
+    } else {
+      instrumentCoverage(M, Inst, Line, Col);
+    }
 
     /**
      * TODO: Add code to check if the instruction is a BinaryOperator and if so,
      * instrument the instruction as specified in the Lab document.
      */
     if (auto *BinOp = dyn_cast<BinaryOperator>(&Inst)) {
-      instrumentBinOpOperands(M, BinOp, Line, Col);
+      if (UseSiteTable) {
+        instrumentBinOpSite(M, Table, BinOp, Line, Col);
+      } else {
+        instrumentBinOpOperands(M, BinOp, Line, Col);
+      }
     }
   }
 
+  if (!Table.Sites.empty()) {
+    emitSiteTable(F, Table);
+  }
+
   return true;
 }
 
+/**
+ * Emit the site table of a function and a constructor that registers it with
+ * the runtime before any of the runtime's own constructors run.
+ */
+void emitSiteTable(Function &F, SiteTable &Table) {
+  Module &M = *F.getParent();
+  auto &Context = M.getContext();
+  auto *VoidType = Type::getVoidTy(Context);
+  auto *Int8Type = Type::getInt8Ty(Context);
+  auto *Int32Type = Type::getInt32Ty(Context);
+  auto *Int8PtrType = Type::getInt8PtrTy(Context);
+  auto *SiteType = StructType::get(Int8Type, Int32Type, Int32Type, Int8PtrType);
+
+  auto *NameStr = ConstantDataArray::getString(Context, F.getName());
+  auto *Name = ConstantExpr::getPointerCast(
+      new GlobalVariable(M, NameStr->getType(), true,
+                         GlobalValue::PrivateLinkage, NameStr),
+      Int8PtrType);
+  std::vector<Constant *> Entries;
+  for (auto &S : Table.Sites) {
+    std::vector<Constant *> Fields = {ConstantInt::get(Int8Type, S.Symbol),
+                                      ConstantInt::get(Int32Type, S.Line),
+                                      ConstantInt::get(Int32Type, S.Col), Name};
+    Entries.push_back(ConstantStruct::get(SiteType, Fields));
+  }
+  auto *TableType = ArrayType::get(SiteType, Entries.size());
+  auto *TableVar = new GlobalVariable(M, TableType, true,
+                                      GlobalValue::InternalLinkage,
+                                      ConstantArray::get(TableType, Entries),
+                                      SITE_TABLE_NAME);
+
+  M.getOrInsertFunction(REGISTER_SITES_FUNCTION_NAME, Int32Type, Int8PtrType,
+                        Int32Type);
+  auto *Ctor = Function::Create(FunctionType::get(VoidType, false),
+                                GlobalValue::InternalLinkage,
+                                "__site_table_init", &M);
+  IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Ctor));
+  auto *Base = Builder.CreateCall(
+      M.getFunction(REGISTER_SITES_FUNCTION_NAME),
+      {ConstantExpr::getPointerCast(TableVar, Int8PtrType),
+       ConstantInt::get(Int32Type, Entries.size())});
+  Builder.CreateStore(Base, Table.Base);
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+/**
+ * Create the counter array of a function, with a slot per (line, column) of
+ * its instructions, and a constructor that registers the counters and their
+ * locations with the runtime, which writes the covered ones to the .cov file
+ * at exit.
+ */
+CoverageCounters createCoverageCounters(Function &F) {
+  CoverageCounters Counters;
+  for (auto &I : instructions(F)) {
+    if (auto &DebugLoc = I.getDebugLoc()) {
+      Counters.Slots.emplace(std::make_pair(DebugLoc.getLine(),
+                                            DebugLoc.getCol()),
+                             Counters.Slots.size());
+    }
+  }
+  if (Counters.Slots.empty()) {
+    return Counters;
+  }
+
+  Module &M = *F.getParent();
+  auto &Context = M.getContext();
+  auto *VoidType = Type::getVoidTy(Context);
+  auto *Int32Type = Type::getInt32Ty(Context);
+  auto *Int64Type = Type::getInt64Ty(Context);
+  auto *Int8PtrType = Type::getInt8PtrTy(Context);
+  auto *Int64PtrType = Type::getInt64PtrTy(Context);
+  auto *SiteType = StructType::get(Int32Type, Int32Type);
+
+  std::vector<Constant *> Entries(Counters.Slots.size());
+  for (auto &Slot : Counters.Slots) {
+    Entries[Slot.second] = ConstantStruct::get(
+        SiteType, ConstantInt::get(Int32Type, Slot.first.first),
+        ConstantInt::get(Int32Type, Slot.first.second));
+  }
+  auto *SitesType = ArrayType::get(SiteType, Entries.size());
+  auto *Sites = new GlobalVariable(M, SitesType, true,
+                                   GlobalValue::InternalLinkage,
+                                   ConstantArray::get(SitesType, Entries),
+                                   COVERAGE_SITES_NAME);
+  auto *CountersType = ArrayType::get(Int64Type, Entries.size());
+  Counters.Counters = new GlobalVariable(
+      M, CountersType, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(CountersType), COVERAGE_COUNTERS_NAME);
+
+  M.getOrInsertFunction(REGISTER_COUNTERS_FUNCTION_NAME, VoidType,
+                        Int64PtrType, Int8PtrType, Int32Type);
+  auto *Ctor = Function::Create(FunctionType::get(VoidType, false),
+                                GlobalValue::InternalLinkage,
+                                "__coverage_counters_init", &M);
+  IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Ctor));
+  Builder.CreateCall(
+      M.getFunction(REGISTER_COUNTERS_FUNCTION_NAME),
+      {ConstantExpr::getPointerCast(Counters.Counters, Int64PtrType),
+       ConstantExpr::getPointerCast(Sites, Int8PtrType),
+       ConstantInt::get(Int32Type, Entries.size())});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+  return Counters;
+}
+
+/**
+ * Increment the counter of a (line, column) before I.
+ */
+void instrumentCoverageCounter(Module *M, CoverageCounters &Counters,
+                               Instruction &I, int Line, int Col) {
+  auto *Int64Type = Type::getInt64Ty(M->getContext());
+  unsigned Slot = Counters.Slots[{Line, Col}];
+
+  IRBuilder<> Builder(&I);
+  auto *Counter = Builder.CreateConstInBoundsGEP2_64(
+      Counters.Counters->getValueType(), Counters.Counters, 0, Slot);
+  auto *One = ConstantInt::get(Int64Type, 1);
+  if (AtomicCounters) {
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Counter, One,
+                            AtomicOrdering::Monotonic);
+  } else {
+    // Racing increments may lose counts, but never reset a counter to zero.
+    auto *Count = Builder.CreateLoad(Int64Type, Counter);
+    Builder.CreateStore(Builder.CreateAdd(Count, One), Counter);
+  }
+}
+
+/**
+ * Get the runtime id of a new site: its index in the table of the function
+ * plus the base the runtime assigned to that table.
+ */
+Value *getSiteId(Module *M, SiteTable &Table, Instruction &I, char Symbol,
+                 int Line, int Col) {
+  auto *Int32Type = Type::getInt32Ty(M->getContext());
+  if (!Table.Base) {
+    Table.Base = new GlobalVariable(*M, Int32Type, false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantInt::get(Int32Type, 0),
+                                    SITE_BASE_NAME);
+  }
+  Table.Sites.push_back({Symbol, Line, Col});
+
+  IRBuilder<> Builder(&I);
+  auto *Base = Builder.CreateLoad(Int32Type, Table.Base);
+  return Builder.CreateAdd(
+      Base, ConstantInt::get(Int32Type, Table.Sites.size() - 1));
+}
+
+void instrumentCoverageSite(Module *M, SiteTable &Table, Instruction &I,
+                            int Line, int Col) {
+  std::vector<Value *> Args = {getSiteId(M, Table, I, 0, Line, Col)};
+
+  auto *CoverageFunction = M->getFunction(COVERAGE_SITE_FUNCTION_NAME);
+  CallInst::Create(CoverageFunction, Args, "", &I);
+}
+
+void instrumentBinOpSite(Module *M, SiteTable &Table, BinaryOperator *BinOp,
+                         int Line, int Col) {
+  auto *SiteId = getSiteId(M, Table, *BinOp,
+                           getBinOpSymbol(BinOp->getOpcode()), Line, Col);
+  std::vector<Value *> Args = {SiteId, BinOp->getOperand(0),
+                               BinOp->getOperand(1)};
+
+  auto *BinOpFunction = M->getFunction(BINOP_SITE_FUNCTION_NAME);
+  CallInst::Create(BinOpFunction, Args, "", BinOp);
+}
+
 void instrumentCoverage(Module *M, Instruction &I, int Line, int Col) {
   auto &Context = M->getContext();
   auto *Int32Type = Type::getInt32Ty(Context);
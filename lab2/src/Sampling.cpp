@@ -0,0 +1,114 @@
+#include "Sampling.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <vector>
+
+/**
+ * Check if the value of I is used outside of its block, or by a phi node.
+ */
+static bool valueEscapes(Instruction &I) {
+  for (auto *U : I.users()) {
+    auto *UI = cast<Instruction>(U);
+    if (UI->getParent() != I.getParent() || isa<PHINode>(UI)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Demote every value live across blocks to a stack slot, as reg2mem does.
+ * Afterwards, blocks only share values through the allocas of the entry.
+ */
+static void demoteToStack(Function &F) {
+  BasicBlock &Entry = F.getEntryBlock();
+  auto *AllocaPoint = Entry.getTerminator();
+
+  // Phis first: their reloads may be used in other blocks and escape too.
+  std::vector<PHINode *> Phis;
+  for (auto &BB : F) {
+    for (auto &Phi : BB.phis()) {
+      Phis.push_back(&Phi);
+    }
+  }
+  for (auto *Phi : Phis) {
+    DemotePHIToStack(Phi, AllocaPoint);
+  }
+
+  std::vector<Instruction *> Escaping;
+  for (auto &BB : F) {
+    if (&BB == &Entry) {
+      continue;
+    }
+    for (auto &I : BB) {
+      if (valueEscapes(I)) {
+        Escaping.push_back(&I);
+      }
+    }
+  }
+  for (auto *I : Escaping) {
+    DemoteRegToStack(*I, false, AllocaPoint);
+  }
+}
+
+bool createSamplingPaths(Function &F, GlobalVariable *Countdown,
+                         Function *OnSample,
+                         std::set<BasicBlock *> &SlowBlocks) {
+  for (auto &BB : F) {
+    if (BB.isEHPad()) {
+      return false;
+    }
+  }
+
+  // Keep the static allocas in an entry block of their own, which is never
+  // sampled and holds the slots of the demoted values.
+  BasicBlock &Entry = F.getEntryBlock();
+  auto FirstInst = Entry.begin();
+  while (isa<AllocaInst>(FirstInst)) {
+    ++FirstInst;
+  }
+  Entry.splitBasicBlock(FirstInst);
+  demoteToStack(F);
+
+  std::vector<BasicBlock *> Blocks;
+  for (auto &BB : F) {
+    if (&BB != &Entry) {
+      Blocks.push_back(&BB);
+    }
+  }
+
+  auto &Context = F.getContext();
+  std::vector<BasicBlock *> Checks;
+  for (auto *BB : Blocks) {
+    auto *Check = BasicBlock::Create(Context, "", &F, BB);
+    BB->replaceAllUsesWith(Check);
+    Checks.push_back(Check);
+  }
+
+  auto *Int32Type = Type::getInt32Ty(Context);
+  for (size_t Index = 0; Index < Blocks.size(); ++Index) {
+    auto *BB = Blocks[Index];
+    ValueToValueMapTy VMap;
+    auto *Slow = CloneBasicBlock(BB, VMap, ".sampled", &F);
+    for (auto &I : *Slow) {
+      RemapInstruction(&I, VMap,
+                       RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+    }
+    CallInst::Create(OnSample, {}, "", &*Slow->getFirstInsertionPt());
+    SlowBlocks.insert(Slow);
+
+    IRBuilder<> Builder(Checks[Index]);
+    auto *Count = Builder.CreateLoad(Int32Type, Countdown);
+    auto *Next = Builder.CreateSub(Count, ConstantInt::get(Int32Type, 1));
+    Builder.CreateStore(Next, Countdown);
+    auto *Sample = Builder.CreateICmpSLE(Next, ConstantInt::get(Int32Type, 0));
+    Builder.CreateCondBr(Sample, Slow, BB);
+  }
+  return true;
+}
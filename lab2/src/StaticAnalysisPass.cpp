@@ -1,18 +1,38 @@
 #include "Instrument.h"
 #include "Utils.h"
 
+#include "llvm/Support/ThreadPool.h"
+
 using namespace llvm;
 
 namespace instrument {
 
 const auto PASS_NAME = "StaticAnalysisPass";
 const auto PASS_DESC = "Static Analysis Pass";
+const auto PARALLEL_PASS_NAME = "ParallelStaticAnalysisPass";
 
-bool Instrument::runOnFunction(Function &F) {
+/**
+ * Module-level variant of StaticAnalysisPass. Functions are analyzed in
+ * parallel into their own buffers and the report, identical to the one of
+ * StaticAnalysisPass, is printed in function order with a single write.
+ */
+struct ParallelInstrument : public ModulePass {
+  static char ID;
+
+  ParallelInstrument() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+};
+
+/**
+ * Print the report of a function.
+ */
+void analyzeFunction(Function &F, raw_ostream &OS) {
   auto FunctionName = F.getName().str();
-  outs() << "Running " << PASS_DESC << " on function " << FunctionName << "\n";
+  OS << "Running " << PASS_DESC << " on function " << FunctionName << "\n";
 
-  outs() << "Locating Instructions\n";
+  OS << "Locating Instructions\n";
+  OperandNamer Namer(F);
   for (inst_iterator Iter = inst_begin(F), E = inst_end(F); Iter != E; ++Iter) {
     Instruction &Inst = (*Iter);
     llvm::DebugLoc DebugLoc = Inst.getDebugLoc();
@@ -23,7 +43,7 @@ bool Instrument::runOnFunction(Function &F) {
 
     int Line = DebugLoc.getLine();
     int Col = DebugLoc.getCol();
-    outs() << Line << ", " << Col << "\n";
+    OS << Line << ", " << Col << "\n";
 
     /**
      * TODO: Add code to check if the instruction is a BinaryOperator and if so,
@@ -33,18 +53,58 @@ bool Instrument::runOnFunction(Function &F) {
     if (auto *BinOp = dyn_cast<BinaryOperator>(&Inst)) {
       Value *Op1 = BinOp->getOperand(0);
       Value *Op2 = BinOp->getOperand(1);
-      std::string Op1Str = variable(Op1);
-      std::string Op2Str = variable(Op2);
+      const std::string &Op1Str = Namer.name(Op1);
+      const std::string &Op2Str = Namer.name(Op2);
       std::string OpStr = getBinOpName(getBinOpSymbol(BinOp->getOpcode()));
-      outs() << OpStr << " on Line " << Line << ", Column " << Col
-             << " with first operand " << Op1Str << " and second operand "
-             << Op2Str << "\n";
+      OS << OpStr << " on Line " << Line << ", Column " << Col
+         << " with first operand " << Op1Str << " and second operand "
+         << Op2Str << "\n";
     }
   }
+}
+
+bool Instrument::runOnFunction(Function &F) {
+  analyzeFunction(F, outs());
+  return false;
+}
+
+bool ParallelInstrument::runOnModule(Module &M) {
+  std::vector<Function *> Functions;
+  for (auto &F : M) {
+    if (!F.isDeclaration()) {
+      Functions.push_back(&F);
+    }
+  }
+
+  std::vector<std::string> Reports(Functions.size());
+  ThreadPool Pool;
+  for (size_t Index = 0; Index < Functions.size(); ++Index) {
+    Pool.async([&Functions, &Reports, Index] {
+      raw_string_ostream OS(Reports[Index]);
+      analyzeFunction(*Functions[Index], OS);
+    });
+  }
+  Pool.wait();
+
+  size_t Size = 0;
+  for (auto &Report : Reports) {
+    Size += Report.size();
+  }
+  std::string Output;
+  Output.reserve(Size);
+  for (auto &Report : Reports) {
+    Output += Report;
+  }
+  outs() << Output;
+  outs().flush();
   return false;
 }
 
 char Instrument::ID = 1;
 static RegisterPass<Instrument> X(PASS_NAME, PASS_NAME, false, false);
 
+char ParallelInstrument::ID = 2;
+static RegisterPass<ParallelInstrument> Y(PARALLEL_PASS_NAME,
+                                          PARALLEL_PASS_NAME, false, false);
+
 }  // namespace instrument
@@ -0,0 +1,210 @@
+/**
+ * Decoder for the binary traces written with LAB2_TRACE_FORMAT=binary.
+ *
+ * Usage:
+ * ./trace-decode [trace file] [cov|binops|summary]
+ *
+ * cov and binops print the events in the .cov and .binops text format,
+ * summary prints the number of events of every site.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "TraceFormat.h"
+
+struct Site {
+  uint8_t Kind;
+  char Symbol;
+  uint32_t Line;
+  uint32_t Col;
+  int32_t Op1 = 0;
+  int32_t Op2 = 0;
+  uint64_t Count = 0;
+};
+
+/**
+ * Decoder state of one (Pid, Tid) stream.
+ */
+struct Stream {
+  std::vector<Site> Sites;
+};
+
+enum class Mode { Cov, BinOps, Summary };
+
+static const char *getBinOpName(char Symbol) {
+  switch (Symbol) {
+  case '+':
+    return "Addition";
+  case '-':
+    return "Subtraction";
+  case '*':
+    return "Multiplication";
+  case '/':
+    return "Division";
+  case '%':
+    return "Modulo";
+  default:
+    return "Unknown operation";
+  }
+}
+
+static bool getVarint(const uint8_t *&Pos, const uint8_t *End,
+                      uint64_t &Value) {
+  Value = 0;
+  for (int Shift = 0; Pos < End && Shift < 64; Shift += 7) {
+    uint8_t Byte = *Pos++;
+    Value |= (uint64_t)(Byte & 0x7f) << Shift;
+    if (!(Byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static int64_t unzigzag(uint64_t Value) {
+  return (int64_t)(Value >> 1) ^ -(int64_t)(Value & 1);
+}
+
+/**
+ * Decode the records of one block, printing events according to M.
+ *
+ * @return false if the block is malformed.
+ */
+static bool decodeBlock(Stream &S, const uint8_t *Pos, const uint8_t *End,
+                        Mode M) {
+  while (Pos < End) {
+    uint8_t Record = *Pos++;
+    uint64_t Id, A, B, C;
+    switch (Record) {
+    case TRACE_RECORD_SITE: {
+      if (!getVarint(Pos, End, Id) || End - Pos < 2)
+        return false;
+      Site NewSite;
+      NewSite.Kind = *Pos++;
+      NewSite.Symbol = (char)*Pos++;
+      if (!getVarint(Pos, End, A) || !getVarint(Pos, End, B))
+        return false;
+      NewSite.Line = A;
+      NewSite.Col = B;
+      if (Id >= S.Sites.size())
+        S.Sites.resize(Id + 1);
+      S.Sites[Id] = NewSite;
+      break;
+    }
+    case TRACE_RECORD_COV:
+      if (!getVarint(Pos, End, Id) || Id >= S.Sites.size())
+        return false;
+      ++S.Sites[Id].Count;
+      if (M == Mode::Cov)
+        printf("%u, %u\n", S.Sites[Id].Line, S.Sites[Id].Col);
+      break;
+    case TRACE_RECORD_BINOP: {
+      if (!getVarint(Pos, End, Id) || Id >= S.Sites.size() ||
+          !getVarint(Pos, End, B) || !getVarint(Pos, End, C))
+        return false;
+      Site &BinOp = S.Sites[Id];
+      BinOp.Op1 = (int32_t)(BinOp.Op1 + unzigzag(B));
+      BinOp.Op2 = (int32_t)(BinOp.Op2 + unzigzag(C));
+      ++BinOp.Count;
+      if (M == Mode::BinOps)
+        printf("%s on Line %u, Column %u with first operand=%d and second "
+               "operand=%d\n",
+               getBinOpName(BinOp.Symbol), BinOp.Line, BinOp.Col, BinOp.Op1,
+               BinOp.Op2);
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage %s [trace file] [cov|binops|summary]\n", argv[0]);
+    return 1;
+  }
+  Mode M;
+  if (!strcmp(argv[2], "cov")) {
+    M = Mode::Cov;
+  } else if (!strcmp(argv[2], "binops")) {
+    M = Mode::BinOps;
+  } else if (!strcmp(argv[2], "summary")) {
+    M = Mode::Summary;
+  } else {
+    fprintf(stderr, "Unknown mode %s\n", argv[2]);
+    return 1;
+  }
+
+  std::ifstream In(argv[1], std::ios::binary);
+  if (!In) {
+    fprintf(stderr, "%s not found\n", argv[1]);
+    return 1;
+  }
+
+  std::map<std::pair<uint32_t, uint32_t>, Stream> Streams;
+  std::vector<uint8_t> Stored, Raw;
+  TraceBlockHeader Header;
+  while (In.read(reinterpret_cast<char *>(&Header), sizeof(Header))) {
+    if (Header.Magic != TRACE_BLOCK_MAGIC) {
+      fprintf(stderr, "Corrupt block header\n");
+      return 1;
+    }
+    Stored.resize(Header.StoredSize);
+    if (!In.read(reinterpret_cast<char *>(Stored.data()), Stored.size())) {
+      // The last block of a killed process may be incomplete.
+      fprintf(stderr, "Truncated block\n");
+      break;
+    }
+    const uint8_t *Payload = Stored.data();
+    if (Header.Flags & TRACE_BLOCK_COMPRESSED) {
+#ifdef HAVE_ZLIB
+      Raw.resize(Header.RawSize);
+      uLongf RawSize = Raw.size();
+      if (uncompress(Raw.data(), &RawSize, Stored.data(), Stored.size()) !=
+              Z_OK ||
+          RawSize != Header.RawSize) {
+        fprintf(stderr, "Corrupt compressed block\n");
+        return 1;
+      }
+      Payload = Raw.data();
+#else
+      fprintf(stderr, "Compressed traces need trace-decode built with zlib\n");
+      return 1;
+#endif
+    } else if (Header.RawSize != Header.StoredSize) {
+      fprintf(stderr, "Corrupt block header\n");
+      return 1;
+    }
+    Stream &S = Streams[{Header.Pid, Header.Tid}];
+    if (!decodeBlock(S, Payload, Payload + Header.RawSize, M)) {
+      fprintf(stderr, "Corrupt block records\n");
+      return 1;
+    }
+  }
+
+  if (M == Mode::Summary) {
+    std::map<std::tuple<uint32_t, uint32_t, char>, uint64_t> Counts;
+    for (auto &Entry : Streams)
+      for (auto &S : Entry.second.Sites)
+        Counts[std::make_tuple(S.Line, S.Col, S.Symbol)] += S.Count;
+    for (auto &Entry : Counts) {
+      char Symbol = std::get<2>(Entry.first);
+      printf("%s on Line %u, Column %u: %llu\n",
+             Symbol ? getBinOpName(Symbol) : "Coverage",
+             std::get<0>(Entry.first), std::get<1>(Entry.first),
+             (unsigned long long)Entry.second);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,284 @@
+/**
+ * Aggregate large .binops and .cov logs without loading them in memory.
+ *
+ * Usage:
+ * ./trace-stats [log file] [profile|zero-divisors]
+ *
+ * The log is mapped in memory and split into one chunk per hardware thread at
+ * line boundaries. Every thread splits its chunk into lines with memchr, which
+ * glibc vectorizes, and aggregates the sites of its lines in its own map. The
+ * maps are merged once all threads are done.
+ *
+ * For .binops logs, profile prints the execution count, min, max, number of
+ * zeros and log2 histogram of both operands of every site, in the .binprof
+ * format of the runtime. zero-divisors only prints the divisions and modulos
+ * whose second operand was ever zero, with the number of such executions.
+ * For .cov logs, both modes print the execution count of every line and
+ * column.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Chunks are at least that large, so that small logs use few threads.
+static const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+// Histogram bucket 0 counts zeros, bucket k counts 2^(k-1) <= |v| < 2^k.
+static const int BUCKETS = 33;
+
+struct OperandStats {
+  int Min = INT_MAX;
+  int Max = INT_MIN;
+  uint64_t Buckets[BUCKETS] = {};
+
+  void add(int Value) {
+    Min = std::min(Min, Value);
+    Max = std::max(Max, Value);
+    unsigned Magnitude = Value < 0 ? -(unsigned)Value : (unsigned)Value;
+    ++Buckets[Magnitude == 0 ? 0 : 32 - __builtin_clz(Magnitude)];
+  }
+
+  void merge(const OperandStats &Other) {
+    Min = std::min(Min, Other.Min);
+    Max = std::max(Max, Other.Max);
+    for (int Bucket = 0; Bucket < BUCKETS; ++Bucket)
+      Buckets[Bucket] += Other.Buckets[Bucket];
+  }
+};
+
+struct SiteStats {
+  uint64_t Count = 0;
+  OperandStats Operands[2];
+
+  void merge(const SiteStats &Other) {
+    Count += Other.Count;
+    Operands[0].merge(Other.Operands[0]);
+    Operands[1].merge(Other.Operands[1]);
+  }
+};
+
+/**
+ * Key of a site: opcode symbol (0 for coverage), line and column.
+ */
+static uint64_t siteKey(char Symbol, unsigned Line, unsigned Col) {
+  return ((uint64_t)(Line & 0x7fffffff) << 32) |
+         ((uint64_t)(Col & 0xffffff) << 8) | (unsigned char)Symbol;
+}
+
+static std::tuple<char, unsigned, unsigned> siteOfKey(uint64_t Key) {
+  return std::make_tuple((char)(Key & 0xff), (unsigned)(Key >> 32),
+                         (unsigned)((Key >> 8) & 0xffffff));
+}
+
+using SiteMap = std::unordered_map<uint64_t, SiteStats>;
+
+static const char *getBinOpName(char Symbol) {
+  switch (Symbol) {
+  case '+':
+    return "Addition";
+  case '-':
+    return "Subtraction";
+  case '*':
+    return "Multiplication";
+  case '/':
+    return "Division";
+  case '%':
+    return "Modulo";
+  default:
+    return "Unknown operation";
+  }
+}
+
+/**
+ * Get the symbol of an operation from the start of a .binops line.
+ */
+static char getBinOpSymbol(const char *Line, const char *End) {
+  if (End - Line < 2)
+    return '?';
+  switch (Line[0]) {
+  case 'A':
+    return '+';
+  case 'S':
+    return '-';
+  case 'D':
+    return '/';
+  case 'M':
+    return Line[1] == 'u' ? '*' : '%';
+  default:
+    return '?';
+  }
+}
+
+/**
+ * Parse the next integer of a line, skipping everything before it.
+ * Only a '-' right before the digits makes the integer negative.
+ *
+ * @return false if the line has no integer left.
+ */
+static bool nextInt(const char *&Pos, const char *End, int &Value) {
+  bool Negative = false;
+  while (Pos < End && (*Pos < '0' || *Pos > '9'))
+    Negative = *Pos++ == '-';
+  if (Pos == End)
+    return false;
+  unsigned Magnitude = 0;
+  while (Pos < End && *Pos >= '0' && *Pos <= '9')
+    Magnitude = Magnitude * 10 + (*Pos++ - '0');
+  Value = Negative ? -(int)Magnitude : (int)Magnitude;
+  return true;
+}
+
+/**
+ * Aggregate the lines between Begin and End, which start and end at line
+ * boundaries.
+ *
+ * @return the number of malformed lines.
+ */
+static uint64_t parseChunk(const char *Begin, const char *End, bool BinOps,
+                           SiteMap &Sites) {
+  uint64_t Malformed = 0;
+  while (Begin < End) {
+    auto *LineEnd =
+        static_cast<const char *>(memchr(Begin, '\n', End - Begin));
+    if (LineEnd == NULL)
+      LineEnd = End;
+    const char *Pos = Begin;
+    int Line, Col, Op1, Op2;
+    if (BinOps) {
+      char Symbol = getBinOpSymbol(Begin, LineEnd);
+      if (nextInt(Pos, LineEnd, Line) && nextInt(Pos, LineEnd, Col) &&
+          nextInt(Pos, LineEnd, Op1) && nextInt(Pos, LineEnd, Op2)) {
+        SiteStats &Site = Sites[siteKey(Symbol, Line, Col)];
+        ++Site.Count;
+        Site.Operands[0].add(Op1);
+        Site.Operands[1].add(Op2);
+      } else if (LineEnd != Begin) {
+        ++Malformed;
+      }
+    } else {
+      if (nextInt(Pos, LineEnd, Line) && nextInt(Pos, LineEnd, Col)) {
+        ++Sites[siteKey(0, Line, Col)].Count;
+      } else if (LineEnd != Begin) {
+        ++Malformed;
+      }
+    }
+    Begin = LineEnd + 1;
+  }
+  return Malformed;
+}
+
+static void printOperand(const char *Name, const OperandStats &Operand) {
+  printf("  %s operand: min=%d max=%d zeros=%llu", Name, Operand.Min,
+         Operand.Max, (unsigned long long)Operand.Buckets[0]);
+  for (int Bucket = 1; Bucket < BUCKETS; ++Bucket) {
+    if (Operand.Buckets[Bucket] != 0)
+      printf(" 2^%d:%llu", Bucket - 1,
+             (unsigned long long)Operand.Buckets[Bucket]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage %s [log file] [profile|zero-divisors]\n", argv[0]);
+    return 1;
+  }
+  bool ZeroDivisors;
+  if (!strcmp(argv[2], "profile")) {
+    ZeroDivisors = false;
+  } else if (!strcmp(argv[2], "zero-divisors")) {
+    ZeroDivisors = true;
+  } else {
+    fprintf(stderr, "Unknown mode %s\n", argv[2]);
+    return 1;
+  }
+
+  int Fd = open(argv[1], O_RDONLY);
+  struct stat Stat;
+  if (Fd == -1 || fstat(Fd, &Stat) == -1) {
+    fprintf(stderr, "%s not found\n", argv[1]);
+    return 1;
+  }
+  size_t Size = Stat.st_size;
+  const char *Data = "";
+  if (Size > 0) {
+    void *Map = mmap(NULL, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    if (Map == MAP_FAILED) {
+      fprintf(stderr, "Cannot map %s\n", argv[1]);
+      return 1;
+    }
+    madvise(Map, Size, MADV_SEQUENTIAL);
+    Data = static_cast<const char *>(Map);
+  }
+  close(Fd);
+
+  // .cov lines start with the line number, .binops lines with the operation.
+  bool BinOps = Size > 0 && (Data[0] < '0' || Data[0] > '9');
+
+  size_t Threads = std::max(1u, std::thread::hardware_concurrency());
+  Threads = std::max<size_t>(1, std::min(Threads, Size / MIN_CHUNK_SIZE));
+  std::vector<const char *> Bounds = {Data};
+  for (size_t Index = 1; Index < Threads; ++Index) {
+    const char *Bound = std::max(Bounds.back(), Data + Size * Index / Threads);
+    auto *Newline =
+        static_cast<const char *>(memchr(Bound, '\n', Data + Size - Bound));
+    Bounds.push_back(Newline ? Newline + 1 : Data + Size);
+  }
+  Bounds.push_back(Data + Size);
+
+  std::vector<SiteMap> Maps(Threads);
+  std::vector<uint64_t> Malformed(Threads);
+  std::vector<std::thread> Workers;
+  for (size_t Index = 0; Index < Threads; ++Index) {
+    Workers.emplace_back([&, Index] {
+      Malformed[Index] =
+          parseChunk(Bounds[Index], Bounds[Index + 1], BinOps, Maps[Index]);
+    });
+  }
+  for (auto &Worker : Workers)
+    Worker.join();
+
+  std::map<uint64_t, SiteStats> Sites;
+  uint64_t TotalMalformed = 0;
+  for (size_t Index = 0; Index < Threads; ++Index) {
+    for (auto &Entry : Maps[Index])
+      Sites[Entry.first].merge(Entry.second);
+    TotalMalformed += Malformed[Index];
+  }
+
+  for (auto &Entry : Sites) {
+    char Symbol;
+    unsigned Line, Col;
+    std::tie(Symbol, Line, Col) = siteOfKey(Entry.first);
+    const SiteStats &Site = Entry.second;
+    if (!BinOps) {
+      printf("%u, %u: %llu\n", Line, Col, (unsigned long long)Site.Count);
+    } else if (!ZeroDivisors) {
+      printf("%s on Line %u, Column %u executed %llu times\n",
+             getBinOpName(Symbol), Line, Col, (unsigned long long)Site.Count);
+      printOperand("first", Site.Operands[0]);
+      printOperand("second", Site.Operands[1]);
+    } else if ((Symbol == '/' || Symbol == '%') &&
+               Site.Operands[1].Buckets[0] != 0) {
+      printf("%s on Line %u, Column %u divided by zero %llu times\n",
+             getBinOpName(Symbol), Line, Col,
+             (unsigned long long)Site.Operands[1].Buckets[0]);
+    }
+  }
+  if (TotalMalformed != 0)
+    fprintf(stderr, "Skipped %llu malformed lines\n",
+            (unsigned long long)TotalMalformed);
+  return 0;
+}
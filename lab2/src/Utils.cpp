@@ -58,3 +58,36 @@ std::string variable(Value *V) {
   }
   return RetVal;
 }
+
+OperandNamer::OperandNamer(Function &F) : Slots(F.getParent(), false) {
+  Slots.incorporateFunction(F);
+}
+
+const std::string &OperandNamer::name(Value *V) {
+  auto Found = Names.find(V);
+  if (Found != Names.end()) {
+    return Found->second;
+  }
+  std::string Name;
+  if (isa<Function>(V) || !(isa<Instruction>(V) || isa<GlobalValue>(V) ||
+                            isa<Argument>(V) || isa<Constant>(V))) {
+    // Printed as a full definition, or not an operand variable() expects.
+    Name = variable(V);
+  } else {
+    raw_string_ostream SS(Name);
+    // variable() takes the first word of what print() writes. That is the
+    // operand of instructions and globals, and the type of arguments and
+    // constants, which are printed as "<type> <operand>", unless the type is
+    // i32.
+    bool PrintType = !isa<Instruction>(V) && !isa<GlobalValue>(V);
+    V->printAsOperand(SS, PrintType, Slots);
+    SS.flush();
+    auto WordEnd = Name.find_first_of(WHITESPACES);
+    if (PrintType && Name.compare(0, WordEnd, "i32") == 0) {
+      Name.erase(0, WordEnd + 1);
+    } else if (WordEnd != std::string::npos) {
+      Name.erase(WordEnd);
+    }
+  }
+  return Names[V] = std::move(Name);
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include <cstdint>
+
+/**
+ * @brief xoshiro256** pseudo random number generator.
+ *
+ * Every fuzzing worker owns one generator. Streams of different workers are
+ * derived deterministically from the same seed and never overlap, so a run
+ * is reproducible from the seed, the worker id and the number of draws.
+ */
+class Random {
+public:
+  /**
+   * @brief Create the stream of worker WorkerId for the given seed.
+   *
+   * @param Seed seed value, as stored in randomSeed.txt.
+   * @param WorkerId index of the worker owning this stream.
+   */
+  Random(uint64_t Seed, unsigned WorkerId = 0);
+
+  /**
+   * @brief Draw the next 64 random bits.
+   */
+  uint64_t next();
+
+  /**
+   * @brief Draw a number uniformly distributed in [0, Bound).
+   *
+   * @param Bound exclusive upper bound, must be positive.
+   */
+  uint64_t below(uint64_t Bound);
+
+  /**
+   * @brief Skip ahead by Count draws.
+   *
+   * @param Count number of draws to skip.
+   */
+  void discard(uint64_t Count);
+
+  /**
+   * @brief Number of draws made from this stream so far.
+   */
+  uint64_t offset() const { return Offset; }
+
+private:
+  /**
+   * @brief Advance the state by 2^128 draws.
+   */
+  void jump();
+
+  uint64_t State[4];
+  uint64_t Offset = 0;
+};
@@ -0,0 +1,52 @@
+#include <string>
+#include <vector>
+
+/**
+ * Multi-instance sync mode.
+ *
+ * Several fuzzer processes share one sync directory that contains the output
+ * directory of every instance. Each instance stores its interesting inputs in
+ * OutDir/queue and periodically imports the entries its peers queued since the
+ * last sync. The main instance imports from every peer, secondary instances
+ * only from the main instance.
+ */
+
+/**
+ * @brief Enable sync mode if FUZZ_SYNC_DIR is set.
+ *
+ * Environment:
+ * FUZZ_SYNC_DIR   directory holding the output directory of every instance.
+ * FUZZ_SYNC_MAIN  if set, this instance is the main instance.
+ *
+ * @param OutDir Path to the output directory of this instance.
+ * @return true if sync mode is enabled.
+ */
+bool initSync(std::string &OutDir);
+
+/**
+ * @brief Get the path of queue entry Id in OutDir.
+ *
+ * @param OutDir Path to an output directory.
+ * @param Id Index of the queued input.
+ * @return std::string path of the queue entry.
+ */
+std::string queueInputPath(const std::string &OutDir, int Id);
+
+/**
+ * @brief Store an input queued as Id so that peers can import it.
+ *
+ * @param Input Input string.
+ * @param OutDir Path to output directory.
+ * @param Id Index of the input in the queue.
+ */
+void storeQueueInput(std::string &Input, std::string &OutDir, int Id);
+
+/**
+ * @brief Read the inputs peers queued since the last sync.
+ * Peers are only scanned when inotify reported changes to their queue
+ * directories, or on every call where inotify is unavailable.
+ *
+ * @param OutDir Path to the output directory of this instance.
+ * @param Inputs Vector to store the new peer inputs.
+ */
+void readPeerInputs(std::string &OutDir, std::vector<std::string> &Inputs);
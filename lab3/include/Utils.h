@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <dirent.h>
 #include <fstream>
 #include <iostream>
@@ -36,6 +37,23 @@ std::string readOneFile(std::string &Path);
 int readSeedInputs(std::vector<std::string> &SeedInputs,
                    std::string &SeedInputDir);
 
+/**
+ * @brief Make the runs of the target log to OutDir/target.<ext> through
+ * INSTR_LOG, so that instances fuzzing the same binary don't share logs.
+ *
+ * @param OutDir Path to output directory.
+ */
+void initLogPaths(std::string &OutDir);
+
+/**
+ * @brief Get the path of the log with extension Ext of a run of Target.
+ *
+ * @param Target name of target binary
+ * @param Ext extension of the log, with its dot.
+ * @return std::string path of the log.
+ */
+std::string getLogPath(std::string &Target, const char *Ext);
+
 /**
  * @brief Read the coverage file generated by running Target
  *
@@ -45,6 +63,19 @@ int readSeedInputs(std::vector<std::string> &SeedInputs,
 void readCoverageFile(std::string &Target,
                       std::vector<std::string> &CoverageData);
 
+/**
+ * @brief Read the value profile file generated by running Target.
+ * Each entry maps a site ("kind, line, col") to its profiled value:
+ * the minimum |divisor| for division sites ('d') and the maximum number of
+ * leading equal bits between the operands for compare sites ('c').
+ *
+ * @param Target name of target binary
+ * @param ValueProfile map to store the value profile.
+ */
+void readValueProfileFile(
+    std::string &Target,
+    std::map<std::string, unsigned long long> &ValueProfile);
+
 /**
  * @brief Save rondom number generator seed to OutDir/randomseed.txt
  *
@@ -72,8 +103,14 @@ void storeCrashingInput(std::string &Input, std::string &OutDir);
 /**
  * @brief Run the Target binary with Input on its stdin.
  *
+ * The input is written byte-exact to an in-memory file (memfd, or an unlinked
+ * temporary file where memfd is unavailable) that is rewound and handed to
+ * the target as stdin on every run. Extra target arguments are read from
+ * FUZZ_TARGET_ARGS, where @@ is replaced by a path to the input file.
+ *
  * @param Target path to target binary.
  * @param Input input to provide to the target.
- * @return int return code on running target.
+ * @return int exit code of the target, 128 + signal number if it was killed
+ * by a signal, or 127 if it could not be executed.
  */
 int runTarget(std::string &Target, std::string &Input);
\ No newline at end of file
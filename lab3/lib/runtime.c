@@ -1,10 +1,49 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "ForkServer.h"
+#include "LogCore.h"
 
 const int STR_MAX_SIZE = 1024;
 
+/**
+ * Value profile: per-site extremes that give the fuzzer a gradient towards a
+ * crash. Division sites ('d') keep the minimum |divisor| observed and compare
+ * sites ('c') keep the maximum number of leading bits on which both operands
+ * agree. The table is dumped once at exit to <exe>.vprof.
+ */
+#define VPROF_MAX_SITES 4096
+
+struct vprof_site {
+  int used;
+  char kind;
+  int line;
+  int col;
+  unsigned long long value;
+};
+
+static struct vprof_site vprof_sites[VPROF_MAX_SITES];
+
+static void append_path(char *buf, int buf_size, int *len, const char *str) {
+  int ret = snprintf(buf + *len, buf_size - *len, "%s", str);
+  *len = ret < buf_size - *len ? *len + ret : buf_size - 1;
+}
+
+/**
+ * Get the log file of the given extension, <exe><ext> by default.
+ *
+ * INSTR_LOG overrides it with a directory, the log then is
+ * <dir>/<exe name><ext>, or with a pattern in which %p is replaced by the
+ * pid, %e by the executable name, %x by ext and %% by %. ext is appended to
+ * patterns without %x, so that the logs of a run don't collide.
+ */
 void get_logfile(char *buf, const int buf_size, const char *ext) {
   char exe[STR_MAX_SIZE];
   int ret = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
@@ -13,17 +52,250 @@ void get_logfile(char *buf, const int buf_size, const char *ext) {
     exit(1);
   }
   exe[ret] = 0;
+  const char *name = strrchr(exe, '/');
+  name = name != NULL ? name + 1 : exe;
 
-  int len = strlen(exe);
-  strncpy(buf, exe, len);
-  buf[len] = 0;
-  for (int i = 0; i <= strlen(ext); ++i) {
-    buf[buf_size-(i+1)] = 0;
+  const char *pattern = getenv("INSTR_LOG");
+  struct stat st;
+  if (pattern == NULL || *pattern == 0) {
+    snprintf(buf, buf_size, "%s%s", exe, ext);
+    return;
+  }
+  if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode)) {
+    snprintf(buf, buf_size, "%s/%s%s", pattern, name, ext);
+    return;
+  }
+
+  char pid[16];
+  snprintf(pid, sizeof(pid), "%d", (int)getpid());
+  int len = 0;
+  int has_ext = 0;
+  buf[0] = 0;
+  for (const char *c = pattern; *c != 0; ++c) {
+    char literal[2] = {*c, 0};
+    const char *part = literal;
+    if (*c == '%' && c[1] != 0) {
+      literal[0] = *++c;
+      if (*c == 'p') {
+        part = pid;
+      } else if (*c == 'e') {
+        part = name;
+      } else if (*c == 'x') {
+        part = ext;
+        has_ext = 1;
+      }
+    }
+    append_path(buf, buf_size, &len, part);
+  }
+  if (!has_ext) {
+    append_path(buf, buf_size, &len, ext);
+  }
+}
+
+/**
+ * Get the fd inherited for the log of the given extension, -1 if none.
+ * INSTR_LOG_FD lists them as <ext>=<fd> separated by commas, with ext
+ * without its dot, e.g. cov=3,binops=4. It takes precedence over INSTR_LOG.
+ */
+static int get_logfd(const char *ext) {
+  const char *list = getenv("INSTR_LOG_FD");
+  if (*ext == '.') {
+    ++ext;
+  }
+  size_t ext_len = strlen(ext);
+  while (list != NULL && *list != 0) {
+    if (strncmp(list, ext, ext_len) == 0 && list[ext_len] == '=') {
+      int fd = atoi(list + ext_len + 1);
+      return fcntl(fd, F_GETFD) != -1 ? fd : -1;
+    }
+    list = strchr(list, ',');
+    if (list != NULL) {
+      ++list;
+    }
+  }
+  return -1;
+}
+
+static struct vprof_site *vprof_lookup(char kind, int line, int col) {
+  unsigned int hash = ((unsigned int)line * 31u + (unsigned int)col) * 2u +
+                      (kind == 'c');
+  for (int i = 0; i < VPROF_MAX_SITES; ++i) {
+    struct vprof_site *site = &vprof_sites[(hash + i) % VPROF_MAX_SITES];
+    if (!site->used) {
+      site->used = 1;
+      site->kind = kind;
+      site->line = line;
+      site->col = col;
+      site->value = kind == 'd' ? ~0ULL : 0;
+      return site;
+    }
+    if (site->kind == kind && site->line == line && site->col == col) {
+      return site;
+    }
+  }
+  return NULL;
+}
+
+static void vprof_dump(void) {
+  char logfile[STR_MAX_SIZE];
+  get_logfile(logfile, sizeof(logfile), ".vprof");
+  FILE *f = NULL;
+  for (int i = 0; i < VPROF_MAX_SITES; ++i) {
+    struct vprof_site *site = &vprof_sites[i];
+    if (!site->used) {
+      continue;
+    }
+    if (f == NULL && (f = fopen(logfile, "w")) == NULL) {
+      return;
+    }
+    fprintf(f, "%c, %d, %d, %llu\n", site->kind, site->line, site->col,
+            site->value);
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+}
+
+/**
+ * Coverage events go through a ring file that is drained at exit and on
+ * crashes, see LogCore.h. Events of a process that is killed are recovered
+ * from the ring file by the fuzzer.
+ */
+static struct logcore cov_log;
+
+static const int crash_signals[] = {SIGSEGV, SIGFPE, SIGBUS, SIGILL, SIGABRT};
+static struct sigaction old_actions[sizeof(crash_signals) / sizeof(int)];
+
+static void crash_handler(int sig) {
+  logcore_drain_signal(&cov_log);
+  for (int i = 0; i < sizeof(crash_signals) / sizeof(int); ++i) {
+    if (crash_signals[i] == sig) {
+      sigaction(sig, &old_actions[i], NULL);
+    }
+  }
+  raise(sig);
+}
+
+static void close_logs(void) {
+  logcore_close(&cov_log);
+  vprof_dump();
+}
+
+/**
+ * Forget the rings of the parent in a forked child, and move logs named
+ * after the pid to files of the child.
+ */
+static void reset_after_fork(void) {
+  char logfile[STR_MAX_SIZE];
+  logcore_after_fork(&cov_log);
+  get_logfile(logfile, sizeof(logfile), ".cov");
+  logcore_init(&cov_log, logfile, cov_log.fd);
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *pos = buf;
+  while (len > 0) {
+    ssize_t ret = read(fd, pos, len);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return -1;
+    }
+    pos += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/**
+ * Serve the runs requested on INSTR_FORKSRV_FD, see ForkServer.h.
+ * Only returns in the children, and in targets run without a fork server.
+ */
+static void run_fork_server(void) {
+  const char *env = getenv(FORKSRV_ENV);
+  if (env == NULL || *env == 0) {
+    return;
+  }
+  int ctl_fd = atoi(env);
+  int status_fd = ctl_fd + 1;
+  uint32_t hello = FORKSRV_HELLO;
+  if (write(status_fd, &hello, sizeof(hello)) != sizeof(hello)) {
+    return;
+  }
+
+  char logfile[STR_MAX_SIZE];
+  for (;;) {
+    struct ForkServerRequest request;
+    if (read_full(ctl_fd, &request, sizeof(request)) == -1) {
+      _exit(0);
+    }
+    if (request.LogLength >= sizeof(logfile) ||
+        read_full(ctl_fd, logfile, request.LogLength) == -1) {
+      _exit(1);
+    }
+    logfile[request.LogLength] = 0;
+
+    int32_t reply[2] = {fork(), 0};
+    if (reply[0] == 0) {
+      close(ctl_fd);
+      close(status_fd);
+      unsetenv(FORKSRV_ENV);
+      if (request.LogLength > 0) {
+        setenv("INSTR_LOG", logfile, 1);
+      }
+      return;
+    }
+    if (write(status_fd, &reply[0], sizeof(reply[0])) != sizeof(reply[0])) {
+      _exit(1);
+    }
+    if (reply[0] == -1) {
+      // Reported like a shell that cannot run the command.
+      reply[1] = 127 << 8;
+    } else {
+      while (waitpid(reply[0], &reply[1], 0) == -1 && errno == EINTR) {
+      }
+    }
+    if (write(status_fd, &reply[1], sizeof(reply[1])) != sizeof(reply[1])) {
+      _exit(1);
+    }
+  }
+}
+
+__attribute__((constructor)) static void runtime_init(void) {
+  // Every run of a fork server opens its own logs as if it was exec'd.
+  run_fork_server();
+
+  char logfile[STR_MAX_SIZE];
+  get_logfile(logfile, sizeof(logfile), ".cov");
+  logcore_init(&cov_log, logfile, get_logfd(".cov"));
+  atexit(close_logs);
+  pthread_atfork(NULL, NULL, reset_after_fork);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crash_handler;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < sizeof(crash_signals) / sizeof(int); ++i) {
+    sigaction(crash_signals[i], &action, &old_actions[i]);
+  }
+}
+
+void __cmp_profile__(long long op1, long long op2, int line, int col) {
+  unsigned long long diff = (unsigned long long)op1 ^ (unsigned long long)op2;
+  unsigned long long equal_bits = diff ? __builtin_clzll(diff) : 64;
+  struct vprof_site *site = vprof_lookup('c', line, col);
+  if (site != NULL && equal_bits > site->value) {
+    site->value = equal_bits;
   }
-  strncat(buf, ext, strlen(ext));
 }
 
 void __sanitize__(int divisor, int line, int col) {
+  long long magnitude = divisor < 0 ? -(long long)divisor : divisor;
+  struct vprof_site *site = vprof_lookup('d', line, col);
+  if (site != NULL && (unsigned long long)magnitude < site->value) {
+    site->value = magnitude;
+  }
   if (divisor == 0) {
     printf("Divide-by-zero detected at line %d and col %d\n", line, col);
     exit(1);
@@ -31,9 +303,7 @@ void __sanitize__(int divisor, int line, int col) {
 }
 
 void __coverage__(int line, int col) {
-  char logfile[STR_MAX_SIZE];
-  get_logfile(logfile, sizeof(logfile), ".cov");
-  FILE *f = fopen(logfile, "a");
-  fprintf(f, "%d, %d\n", line, col);
-  fclose(f);
+  char event[32];
+  int len = snprintf(event, sizeof(event), "%d, %d\n", line, col);
+  logcore_append(&cov_log, event, len);
 }
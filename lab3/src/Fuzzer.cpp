@@ -15,10 +15,14 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <functional>
 #include <string>
 
+#include "Random.h"
+#include "Sync.h"
 #include "Utils.h"
 
 #define ARG_EXIST_CHECK(Name, Arg)                                             \
@@ -47,13 +51,19 @@ typedef std::string MutationFn(std::string);
  * one run of the program.
  *
  * @param Passed       did the program run without crashing?
+ * @param Interesting  did the run reach new coverage or a better value profile?
  * @param Mutation     mutation function used for this run.
+ * @param Parent       index of the parent input in SeedInputs.
+ * @param RngOffset    number of random draws made before mutating.
  * @param Input        parent input used for generating input for this run.
  * @param MutatedInput input string for this run.
  */
 struct RunInfo {
-  bool Passed;
+  bool Passed = false;
+  bool Interesting = false;
   MutationFn *Mutation;
+  int Parent = 0;
+  uint64_t RngOffset = 0;
   std::string Input, MutatedInput;
 };
 
@@ -73,6 +83,27 @@ std::vector<std::string> CoverageState;
 // Coverage related information from previous step.
 std::vector<std::string> PrevCoverageState;
 
+// Every coverage line observed across all runs so far.
+std::set<std::string> SeenCoverage;
+
+// Best value observed so far for every value-profile site.
+std::map<std::string, unsigned long long> ValueProfileState;
+
+// Random stream of this worker, seeded in main.
+Random Rng(0);
+
+// Optional log of how every stored input was derived, see logReplay.
+std::ofstream ReplayLog;
+
+// Is this instance sharing its queue with peers, see Sync.h?
+bool Syncing = false;
+
+// Number of executions between two imports from peers.
+int SyncInterval = 1000;
+
+// Mutations never grow inputs beyond this many bytes.
+size_t MaxLength = 4096;
+
 /**
  * @brief Variable to keep track of some Mutation related state.
  * Feel free to change/ignore this if you want to.
@@ -90,19 +121,23 @@ int StrategyState = 0;
 /************************************************/
 
 /**
- * @brief Select a string that will be mutated to generate a new input.
- * Sample code picks the first input string from SeedInputs.
+ * @brief Select the input that will be mutated to generate a new input.
+ * Draws two inputs among the seeds and every interesting input found so far
+ * and keeps the shorter one, so that short inputs, which run faster and
+ * mutate more effectively, are scheduled more often.
  *
  * TODO: Implement your logic for selecting a input to mutate.
  * If you require, you can use the Info variable to help make a
  * decision while selecting a Seed but it is not necessary for the lab.
  *
  * @param RunInfo struct with information about the previous run.
- * @return Pointer to a string.
+ * @return Index of the selected input in SeedInputs.
  */
-std::string selectInput(RunInfo Info) {
-  int Index = 0;
-  return SeedInputs[Index];
+int selectInput(RunInfo Info) {
+  int First = Rng.below(SeedInputs.size());
+  int Second = Rng.below(SeedInputs.size());
+  return SeedInputs[Second].length() < SeedInputs[First].length() ? Second
+                                                                   : First;
 }
 
 /*********************************************/
@@ -128,16 +163,17 @@ std::string mutationA(std::string Original) { return Original; }
 /**
  * @brief Mutation Strategy that inserts a random
  * alpha numeric char at a random location in Original.
+ * Inputs that already reached MaxLength are returned unchanged.
  *
  * @param Original Original input string.
  * @return std::string mutated string.
  */
 std::string mutationB(std::string Original) {
-  if (Original.length() <= 0)
+  if (Original.length() <= 0 || Original.length() >= MaxLength)
     return Original;
 
-  int Index = rand() % Original.length();
-  return Original.insert(Index, 1, ALPHA[rand() % LENGTH_ALPHA]);
+  int Index = Rng.below(Original.length());
+  return Original.insert(Index, 1, ALPHA[Rng.below(LENGTH_ALPHA)]);
 }
 
 /**
@@ -170,7 +206,7 @@ std::vector<MutationFn *> MutationFns = {mutationA, mutationB};
  * @returns a pointer to a MutationFn
  */
 MutationFn *selectMutationFn(RunInfo &Info) {
-  int Strat = rand() % MutationFns.size();
+  int Strat = Rng.below(MutationFns.size());
 
   return MutationFns[Strat];
 }
@@ -178,13 +214,144 @@ MutationFn *selectMutationFn(RunInfo &Info) {
 /*********************************************/
 /*     Implement your feedback algorithm     */
 /*********************************************/
+/**
+ * Check if Value is better than Best for a value-profile site.
+ * Division sites improve when the divisor gets closer to zero and compare
+ * sites improve when more leading bits of the operands agree.
+ */
+bool improvesOn(const std::string &Site, unsigned long long Value,
+                unsigned long long Best) {
+  return Site[0] == 'd' ? Value < Best : Value > Best;
+}
+
+/**
+ * Merge the value profile of the last run into ValueProfileState.
+ *
+ * @param Target name of target binary
+ * @param ValueProfile map to store the value profile of the last run.
+ * @return true if any site improved on the best value seen so far.
+ */
+bool updateValueProfile(
+    std::string &Target,
+    std::map<std::string, unsigned long long> &ValueProfile) {
+  readValueProfileFile(Target, ValueProfile);
+
+  bool Improved = false;
+  for (auto &Entry : ValueProfile) {
+    auto Best = ValueProfileState.find(Entry.first);
+    if (Best == ValueProfileState.end() ||
+        improvesOn(Entry.first, Entry.second, Best->second)) {
+      ValueProfileState[Entry.first] = Entry.second;
+      Improved = true;
+    }
+  }
+  return Improved;
+}
+
+/**
+ * Run Input after cleaning up the coverage and value profile files of the
+ * previous run.
+ *
+ * @param Target name of target binary
+ * @param Input input to run.
+ * @return int exit code of the target, see runTarget.
+ */
+int execute(std::string &Target, std::string &Input) {
+  std::string CoveragePath = getLogPath(Target, ".cov");
+  std::string ProfilePath = getLogPath(Target, ".vprof");
+  std::remove(CoveragePath.c_str());
+  std::remove(ProfilePath.c_str());
+  return runTarget(Target, Input);
+}
+
+/**
+ * Checksum of the set of coverage lines of a run.
+ *
+ * @param Coverage coverage data of the run.
+ * @return uint64_t FNV-1a hash of the distinct coverage lines.
+ */
+uint64_t coverageChecksum(std::vector<std::string> &Coverage) {
+  std::set<std::string> Lines(Coverage.begin(), Coverage.end());
+  uint64_t Hash = 0xcbf29ce484222325ULL;
+  for (auto &Line : Lines) {
+    for (unsigned char C : Line)
+      Hash = (Hash ^ C) * 0x100000001b3ULL;
+    Hash = (Hash ^ '\n') * 0x100000001b3ULL;
+  }
+  return Hash;
+}
+
+/**
+ * Run Input and check that it passes with the given coverage checksum and a
+ * value profile at least as good as the given one.
+ *
+ * @param Target name of target binary
+ * @param Input input to run.
+ * @param Checksum expected coverage checksum.
+ * @param ValueProfile value profile that no site may fall behind.
+ * @return true if the run passed, covered exactly the same lines and
+ * reached every site of ValueProfile with the same or a better value.
+ */
+bool sameCoverage(std::string &Target, std::string &Input, uint64_t Checksum,
+                  std::map<std::string, unsigned long long> &ValueProfile) {
+  if (execute(Target, Input) != 0)
+    return false;
+  std::vector<std::string> Coverage;
+  readCoverageFile(Target, Coverage);
+  if (coverageChecksum(Coverage) != Checksum)
+    return false;
+  std::map<std::string, unsigned long long> Profile;
+  readValueProfileFile(Target, Profile);
+  for (auto &Entry : ValueProfile) {
+    auto Value = Profile.find(Entry.first);
+    if (Value == Profile.end() ||
+        improvesOn(Entry.first, Entry.second, Value->second))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Trim an input before it is queued.
+ * Chunks of decreasing size, from 1/16th down to 1/1024th of the input, are
+ * removed as long as the input still passes with the same coverage checksum
+ * and without losing value-profile progress, see sameCoverage.
+ *
+ * @param Target name of target binary
+ * @param Input input to trim.
+ * @param Checksum coverage checksum of Input.
+ * @param ValueProfile value profile of Input.
+ * @return std::string trimmed input.
+ */
+std::string trimInput(std::string &Target, std::string Input, uint64_t Checksum,
+                      std::map<std::string, unsigned long long> &ValueProfile) {
+  size_t MinChunk = std::max<size_t>(1, Input.length() / 1024);
+  for (size_t Chunk = std::max<size_t>(1, Input.length() / 16);
+       Chunk >= MinChunk; Chunk /= 2) {
+    size_t Pos = 0;
+    while (Pos < Input.length() && Input.length() > 1) {
+      std::string Candidate = Input;
+      Candidate.erase(Pos, Chunk);
+      if (!Candidate.empty() &&
+          sameCoverage(Target, Candidate, Checksum, ValueProfile))
+        Input = Candidate;
+      else
+        Pos += Chunk;
+    }
+    if (Chunk == 1)
+      break;
+  }
+  return Input;
+}
+
 /**
  * Update the internal state of the fuzzer using coverage feedback.
  *
  * @param Target name of target binary
+ * @param OutDir Directory to store fuzzing results.
  * @param Info RunInfo
  */
-void feedBack(std::string &Target, RunInfo &Info) {
+void feedBack(std::string &Target, std::string &OutDir, RunInfo &Info) {
   std::vector<std::string> RawCoverageData;
   readCoverageFile(Target, RawCoverageData);
 
@@ -206,6 +373,24 @@ void feedBack(std::string &Target, RunInfo &Info) {
   CoverageState.assign(RawCoverageData.begin(),
                        RawCoverageData.end()); // No extra processing
 
+  bool NewCoverage = false;
+  for (auto &Line : CoverageState) {
+    NewCoverage |= SeenCoverage.insert(Line).second;
+  }
+  std::map<std::string, unsigned long long> ValueProfile;
+  bool NewValueProfile = updateValueProfile(Target, ValueProfile);
+
+  // Keep inputs that make progress so that later runs mutate them further.
+  Info.Interesting = NewCoverage || NewValueProfile;
+  if (Info.Passed && Info.Interesting) {
+    std::string Trimmed = trimInput(Target, Info.MutatedInput,
+                                    coverageChecksum(CoverageState),
+                                    ValueProfile);
+    SeedInputs.push_back(Trimmed);
+    // Trimmed inputs can't be rebuilt from the replay log alone.
+    if (Syncing || ReplayLog.is_open())
+      storeQueueInput(Trimmed, OutDir, SeedInputs.size() - 1);
+  }
 }
 
 int Freq = 1000;
@@ -213,12 +398,8 @@ int Count = 0;
 int PassCount = 0;
 
 bool test(std::string &Target, std::string &Input, std::string &OutDir) {
-  // Clean up old coverage file before running
-  std::string CoveragePath = Target + ".cov";
-  std::remove(CoveragePath.c_str());
-
   ++Count;
-  int ReturnCode = runTarget(Target, Input);
+  int ReturnCode = execute(Target, Input);
   if (ReturnCode == 127) {
     fprintf(stderr, "%s not found\n", Target.c_str());
     exit(1);
@@ -235,6 +416,48 @@ bool test(std::string &Target, std::string &Input, std::string &OutDir) {
   }
 }
 
+/**
+ * @brief Record how the input stored as Name was derived.
+ * An entry lists the parent index in SeedInputs, the mutation index in
+ * MutationFns and the random stream offset right before mutating, which is
+ * enough to regenerate the input with replay.
+ *
+ * @param Name name of the stored input, e.g. failure/input3 or queue/12.
+ * @param Info RunInfo of the run that produced the input.
+ */
+void logReplay(const std::string &Name, RunInfo &Info) {
+  if (!ReplayLog.is_open())
+    return;
+  auto Op = std::find(MutationFns.begin(), MutationFns.end(), Info.Mutation) -
+            MutationFns.begin();
+  ReplayLog << Name << " " << Info.Parent << " " << Op << " "
+            << Info.RngOffset << "\n";
+  ReplayLog.flush();
+}
+
+/**
+ * @brief Import the inputs peers queued since the last sync.
+ * Every input is re-executed for its coverage only, and queued if it is
+ * interesting here too. success/ and failure/ only hold inputs this
+ * instance generated, so collecting runs over all instances counts every
+ * input once.
+ *
+ * @param Target Target (instrumented) program binary.
+ * @param OutDir Directory to store fuzzing results.
+ */
+void importPeerInputs(std::string &Target, std::string &OutDir) {
+  std::vector<std::string> Inputs;
+  readPeerInputs(OutDir, Inputs);
+  for (auto &Input : Inputs) {
+    RunInfo Info;
+    Info.Mutation = mutationA;
+    Info.Input = Input;
+    Info.MutatedInput = Input;
+    Info.Passed = execute(Target, Info.MutatedInput) == 0;
+    feedBack(Target, OutDir, Info);
+  }
+}
+
 /**
  * @brief Fuzz the Target program and store the results to OutDir
  *
@@ -244,21 +467,125 @@ bool test(std::string &Target, std::string &Input, std::string &OutDir) {
 void fuzz(std::string Target, std::string OutDir) {
   struct RunInfo Info;
   while (true) {
-    std::string Input = selectInput(Info);
+    int Parent = selectInput(Info);
     Info = RunInfo();
-    Info.Input = Input;
+    Info.Parent = Parent;
+    Info.Input = SeedInputs[Parent];
     Info.Mutation = selectMutationFn(Info);
+    Info.RngOffset = Rng.offset();
     Info.MutatedInput = Info.Mutation(Info.Input);
+
+    int StoredSuccess = successCount, StoredFailure = failureCount;
+    size_t Queued = SeedInputs.size();
     Info.Passed = test(Target, Info.MutatedInput, OutDir);
-    feedBack(Target, Info);
+    feedBack(Target, OutDir, Info);
+
+    if (successCount != StoredSuccess)
+      logReplay("success/input" + std::to_string(StoredSuccess), Info);
+    if (failureCount != StoredFailure)
+      logReplay("failure/input" + std::to_string(StoredFailure), Info);
+    if (SeedInputs.size() != Queued)
+      logReplay("queue/" + std::to_string(Queued), Info);
+
+    if (Syncing && Count % SyncInterval == 0)
+      importPeerInputs(Target, OutDir);
+  }
+}
+
+/**
+ * @brief Regenerate a stored input from OutDir/replay.log.
+ * Inputs are rebuilt from their parents, down to the seed inputs, by
+ * re-applying the logged mutation at the logged random stream offset, with
+ * the logged MaxLength.
+ *
+ * @param SeedInputDir Path to the seed directory used for fuzzing.
+ * @param OutDir Output directory of the fuzzing run.
+ * @param Name name of the stored input, e.g. failure/input3.
+ * @param Input string to store the regenerated input.
+ * @return int exit status.
+ */
+int replay(std::string &SeedInputDir, std::string &OutDir,
+           const std::string &Name, std::string &Input) {
+  if (readSeedInputs(SeedInputs, SeedInputDir))
+    return 1;
+  std::string SeedPath = OutDir + "/randomSeed.txt";
+  uint64_t Seed = strtoll(readOneFile(SeedPath).c_str(), NULL, 10);
+
+  std::ifstream Log(OutDir + "/replay.log");
+  std::string Key;
+  unsigned WorkerId = 0;
+  std::map<std::string, std::vector<uint64_t>> Entries;
+  while (Log >> Key) {
+    if (Key == "worker") {
+      Log >> WorkerId;
+      continue;
+    }
+    if (Key == "max_len") {
+      Log >> MaxLength;
+      continue;
+    }
+    uint64_t Parent, Op, Offset;
+    Log >> Parent >> Op >> Offset;
+    Entries[Key] = {Parent, Op, Offset};
   }
+
+  std::function<bool(const std::string &, std::string &)> Regenerate =
+      [&](const std::string &Entry, std::string &Out) {
+        auto It = Entries.find(Entry);
+        if (It == Entries.end() || It->second[1] >= MutationFns.size())
+          return false;
+        // Indices below the number of seeds refer to seed inputs, all
+        // others to inputs queued while fuzzing.
+        std::string ParentInput;
+        uint64_t Parent = It->second[0];
+        std::string QueuePath = queueInputPath(OutDir, Parent);
+        if (Parent < SeedInputs.size()) {
+          ParentInput = SeedInputs[Parent];
+        } else if (access(QueuePath.c_str(), R_OK) == 0) {
+          // Queued inputs stored in sync mode, including imported ones.
+          ParentInput = readOneFile(QueuePath);
+        } else if (!Regenerate("queue/" + std::to_string(Parent),
+                               ParentInput)) {
+          return false;
+        }
+        Rng = Random(Seed, WorkerId);
+        Rng.discard(It->second[2]);
+        Out = MutationFns[It->second[1]](ParentInput);
+        return true;
+      };
+  return Regenerate(Name, Input) ? 0 : 1;
 }
 
 /**
  * Usage:
  * ./fuzzer [target] [seed input dir] [output dir] [frequency] [random seed]
+ * ./fuzzer --replay [seed input dir] [output dir] [stored input name]
+ *
+ * Environment:
+ * FUZZ_WORKER_ID   index of the random stream to use (default 0).
+ * FUZZ_REPLAY_LOG  if set, log how stored inputs were derived to
+ *                  [output dir]/replay.log so that --replay can rebuild them.
+ * FUZZ_SYNC_DIR    if set, share queued inputs with the other instances whose
+ *                  output directories live in this directory, see Sync.h.
+ * FUZZ_SYNC_MAIN   if set, this instance is the main sync instance.
+ * FUZZ_SYNC_INTERVAL number of executions between two syncs (default 1000).
+ * FUZZ_MAX_LEN     length cap for mutated inputs in bytes (default 4096).
+ *
+ * The target's logs are kept in [output dir], INSTR_LOG is overridden.
  */
 int main(int argc, char **argv) {
+  if (argc == 5 && std::string(argv[1]) == "--replay") {
+    ARG_EXIST_CHECK(SeedInputDir, argv[2]);
+    ARG_EXIST_CHECK(OutDir, argv[3]);
+    std::string Input;
+    if (replay(SeedInputDir, OutDir, argv[4], Input)) {
+      fprintf(stderr, "Cannot replay %s\n", argv[4]);
+      return 1;
+    }
+    fwrite(Input.data(), 1, Input.size(), stdout);
+    return 0;
+  }
+
   if (argc < 4) {
     printf("usage %s [target] [seed input dir] [output dir] [frequency "
            "(optional)] [seed (optional arg)]\n",
@@ -275,14 +602,33 @@ int main(int argc, char **argv) {
 
   int RandomSeed = argc > 5 ? strtol(argv[5], NULL, 10) : (int)time(NULL);
 
-  srand(RandomSeed);
+  const char *WorkerEnv = getenv("FUZZ_WORKER_ID");
+  unsigned WorkerId = WorkerEnv ? strtoul(WorkerEnv, NULL, 10) : 0;
+
+  Rng = Random(RandomSeed, WorkerId);
   storeSeed(OutDir, RandomSeed);
   initialize(OutDir);
+  initLogPaths(OutDir);
+
+  if (const char *Length = getenv("FUZZ_MAX_LEN"))
+    MaxLength = strtoul(Length, NULL, 10);
+
+  if (getenv("FUZZ_REPLAY_LOG")) {
+    mkdir((OutDir + "/queue").c_str(), 0755);
+    ReplayLog.open(OutDir + "/replay.log", std::ios_base::trunc);
+    ReplayLog << "worker " << WorkerId << "\n";
+    ReplayLog << "max_len " << MaxLength << "\n";
+  }
 
   if (readSeedInputs(SeedInputs, SeedInputDir)) {
     fprintf(stderr, "Cannot read seed input directory\n");
     return 1;
   }
+
+  Syncing = initSync(OutDir);
+  if (const char *Interval = getenv("FUZZ_SYNC_INTERVAL"))
+    SyncInterval = std::max(1L, strtol(Interval, NULL, 10));
+
   fprintf(stderr, "Fuzzing %s...\n\n", Target.c_str());
   fuzz(Target, OutDir);
   return 0;
@@ -6,6 +6,7 @@ namespace instrument {
 
 static const char *SANITIZE_FUNCTION_NAME = "__sanitize__";
 static const char *COVERAGE_FUNCTION_NAME = "__coverage__";
+static const char *CMP_PROFILE_FUNCTION_NAME = "__cmp_profile__";
 
 void instrumentCoverage(Module *M, Instruction &I, int Line, int Col) {
   auto &Context = M->getContext();
@@ -32,17 +33,44 @@ void instrumentSanitize(Module *M, Instruction &I, int Line, int Col) {
   CallInst::Create(Fun, Args, "", &I);
 }
 
+/**
+ * Record both operands of an integer comparison so that the runtime can
+ * profile how many leading bits they already agree on. The operands are
+ * widened to 64 bits according to the signedness of the predicate.
+ */
+void instrumentCmpProfile(Module *M, ICmpInst &Cmp, int Line, int Col) {
+  LLVMContext &Context = M->getContext();
+  Type *Int32Type = Type::getInt32Ty(Context);
+  Type *Int64Type = Type::getInt64Ty(Context);
+
+  IRBuilder<> Builder(&Cmp);
+  auto *Op1 = Cmp.getOperand(0);
+  auto *Op2 = Cmp.getOperand(1);
+  bool IsSigned = !Cmp.isUnsigned();
+  auto *Op1Val = Builder.CreateIntCast(Op1, Int64Type, IsSigned);
+  auto *Op2Val = Builder.CreateIntCast(Op2, Int64Type, IsSigned);
+  auto *LineVal = llvm::ConstantInt::get(Int32Type, Line);
+  auto *ColVal = llvm::ConstantInt::get(Int32Type, Col);
+  std::vector<Value *> Args = {Op1Val, Op2Val, LineVal, ColVal};
+
+  auto *Fun = M->getFunction(CMP_PROFILE_FUNCTION_NAME);
+  Builder.CreateCall(Fun, Args);
+}
+
 bool Instrument::runOnFunction(Function &F) {
   LLVMContext &Context = F.getContext();
   Module *M = F.getParent();
 
   Type *VoidType = Type::getVoidTy(Context);
   Type *Int32Type = Type::getInt32Ty(Context);
+  Type *Int64Type = Type::getInt64Ty(Context);
 
   M->getOrInsertFunction(COVERAGE_FUNCTION_NAME, VoidType, Int32Type,
                          Int32Type);
   M->getOrInsertFunction(SANITIZE_FUNCTION_NAME, VoidType, Int32Type, Int32Type,
                          Int32Type);
+  M->getOrInsertFunction(CMP_PROFILE_FUNCTION_NAME, VoidType, Int64Type,
+                         Int64Type, Int32Type, Int32Type);
 
   for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
     if (I->getOpcode() == Instruction::PHI) {
@@ -58,6 +86,11 @@ bool Instrument::runOnFunction(Function &F) {
         I->getOpcode() == Instruction::UDiv) {
       instrumentSanitize(M, *I, Line, Col);
     }
+    if (auto *Cmp = dyn_cast<ICmpInst>(&*I)) {
+      if (Cmp->getOperand(0)->getType()->isIntegerTy()) {
+        instrumentCmpProfile(M, *Cmp, Line, Col);
+      }
+    }
     instrumentCoverage(M, *I, Line, Col);
   }
   return true;
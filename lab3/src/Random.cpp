@@ -0,0 +1,64 @@
+#include "Random.h"
+
+static inline uint64_t rotl(const uint64_t X, int K) {
+  return (X << K) | (X >> (64 - K));
+}
+
+static uint64_t splitMix64(uint64_t &X) {
+  uint64_t Z = (X += 0x9e3779b97f4a7c15ULL);
+  Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  Z = (Z ^ (Z >> 27)) * 0x94d049bb133111ebULL;
+  return Z ^ (Z >> 31);
+}
+
+Random::Random(uint64_t Seed, unsigned WorkerId) {
+  for (auto &Word : State) {
+    Word = splitMix64(Seed);
+  }
+  for (unsigned I = 0; I < WorkerId; ++I) {
+    jump();
+  }
+}
+
+uint64_t Random::next() {
+  const uint64_t Result = rotl(State[1] * 5, 7) * 9;
+  const uint64_t T = State[1] << 17;
+
+  State[2] ^= State[0];
+  State[3] ^= State[1];
+  State[1] ^= State[2];
+  State[0] ^= State[3];
+  State[2] ^= T;
+  State[3] = rotl(State[3], 45);
+
+  ++Offset;
+  return Result;
+}
+
+uint64_t Random::below(uint64_t Bound) { return next() % Bound; }
+
+void Random::discard(uint64_t Count) {
+  while (Count--) {
+    next();
+  }
+}
+
+void Random::jump() {
+  static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                  0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+  uint64_t S[4] = {0, 0, 0, 0};
+  for (uint64_t Word : JUMP) {
+    for (int B = 0; B < 64; ++B) {
+      if (Word & (1ULL << B)) {
+        for (int I = 0; I < 4; ++I) {
+          S[I] ^= State[I];
+        }
+      }
+      next();
+    }
+  }
+  for (int I = 0; I < 4; ++I) {
+    State[I] = S[I];
+  }
+  Offset = 0;
+}
@@ -0,0 +1,183 @@
+#include "Sync.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "Utils.h"
+
+// Force a full scan every FULL_SCAN_PERIOD syncs to catch peers whose queue
+// directory appeared after the last scan.
+static const int FULL_SCAN_PERIOD = 16;
+
+static std::string SyncDir;
+static std::string SelfName;
+static bool IsMain = false;
+static int InotifyFd = -1;
+static int SyncCount = 0;
+
+// Last imported queue index of every peer.
+static std::map<std::string, int> LastSynced;
+
+// Peer queue directories currently watched by inotify.
+static std::map<std::string, int> Watches;
+
+static std::string baseName(const std::string &Path) {
+  auto End = Path.find_last_not_of('/');
+  if (End == std::string::npos)
+    return Path;
+  auto Begin = Path.find_last_of('/', End);
+  Begin = Begin == std::string::npos ? 0 : Begin + 1;
+  return Path.substr(Begin, End - Begin + 1);
+}
+
+static bool isDirectory(const std::string &Path) {
+  struct stat Buffer;
+  return stat(Path.c_str(), &Buffer) == 0 && S_ISDIR(Buffer.st_mode);
+}
+
+static void storeLastSynced(std::string &OutDir, const std::string &Peer) {
+  std::ofstream File(OutDir + "/.synced/" + Peer, std::ios_base::trunc);
+  File << LastSynced[Peer];
+}
+
+bool initSync(std::string &OutDir) {
+  const char *Dir = getenv("FUZZ_SYNC_DIR");
+  if (!Dir)
+    return false;
+  SyncDir = Dir;
+  SelfName = baseName(OutDir);
+  IsMain = getenv("FUZZ_SYNC_MAIN") != NULL;
+
+  mkdir((OutDir + "/queue").c_str(), 0755);
+  mkdir((OutDir + "/.synced").c_str(), 0755);
+  if (IsMain) {
+    std::ofstream Marker(OutDir + "/is_main");
+  }
+
+  // Resume from the last synced indices of a previous session.
+  DIR *Directory = opendir((OutDir + "/.synced").c_str());
+  if (Directory != NULL) {
+    struct dirent *Ent;
+    while ((Ent = readdir(Directory)) != NULL) {
+      if (Ent->d_type != DT_REG)
+        continue;
+      std::string Path = OutDir + "/.synced/" + Ent->d_name;
+      LastSynced[Ent->d_name] = strtol(readOneFile(Path).c_str(), NULL, 10);
+    }
+    closedir(Directory);
+  }
+
+#ifdef __linux__
+  InotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (InotifyFd != -1)
+    inotify_add_watch(InotifyFd, SyncDir.c_str(), IN_CREATE | IN_MOVED_TO);
+#endif
+  return true;
+}
+
+std::string queueInputPath(const std::string &OutDir, int Id) {
+  char Name[32];
+  snprintf(Name, sizeof(Name), "/queue/id:%06d", Id);
+  return OutDir + Name;
+}
+
+void storeQueueInput(std::string &Input, std::string &OutDir, int Id) {
+  // Write to a temporary name first so that peers never see partial entries.
+  std::string Path = queueInputPath(OutDir, Id);
+  std::string TmpPath = OutDir + "/queue/.tmp";
+  std::ofstream OutFile(TmpPath);
+  OutFile << Input;
+  OutFile.close();
+  rename(TmpPath.c_str(), Path.c_str());
+}
+
+/**
+ * Drain pending inotify events.
+ * Returns true if a watched directory changed, or if changes can't be tracked.
+ */
+static bool peersChanged() {
+  if (InotifyFd == -1)
+    return true;
+#ifdef __linux__
+  bool Changed = false;
+  char Buffer[4096];
+  while (read(InotifyFd, Buffer, sizeof(Buffer)) > 0)
+    Changed = true;
+  return Changed;
+#else
+  return true;
+#endif
+}
+
+static void watchQueue(const std::string &QueueDir) {
+#ifdef __linux__
+  if (InotifyFd == -1 || Watches.count(QueueDir))
+    return;
+  Watches[QueueDir] =
+      inotify_add_watch(InotifyFd, QueueDir.c_str(), IN_MOVED_TO);
+#endif
+}
+
+static void readPeerQueue(std::string &OutDir, const std::string &Peer,
+                          std::vector<std::string> &Inputs) {
+  std::string QueueDir = SyncDir + "/" + Peer + "/queue";
+  DIR *Directory = opendir(QueueDir.c_str());
+  if (Directory == NULL)
+    return;
+  watchQueue(QueueDir);
+
+  std::map<int, std::string> Entries;
+  struct dirent *Ent;
+  auto Last = LastSynced.find(Peer);
+  int After = Last == LastSynced.end() ? -1 : Last->second;
+  while ((Ent = readdir(Directory)) != NULL) {
+    if (strncmp(Ent->d_name, "id:", 3) != 0)
+      continue;
+    int Id = strtol(Ent->d_name + 3, NULL, 10);
+    if (Id > After)
+      Entries[Id] = QueueDir + "/" + Ent->d_name;
+  }
+  closedir(Directory);
+
+  if (Entries.empty())
+    return;
+  for (auto &Entry : Entries) {
+    Inputs.push_back(readOneFile(Entry.second));
+  }
+  LastSynced[Peer] = Entries.rbegin()->first;
+  storeLastSynced(OutDir, Peer);
+}
+
+void readPeerInputs(std::string &OutDir, std::vector<std::string> &Inputs) {
+  bool FullScan = SyncCount++ % FULL_SCAN_PERIOD == 0;
+  if (!peersChanged() && !FullScan)
+    return;
+
+  DIR *Directory = opendir(SyncDir.c_str());
+  if (Directory == NULL)
+    return;
+  struct dirent *Ent;
+  while ((Ent = readdir(Directory)) != NULL) {
+    std::string Peer = Ent->d_name;
+    if (Peer == "." || Peer == ".." || Peer == SelfName)
+      continue;
+    std::string PeerDir = SyncDir + "/" + Peer;
+    if (!isDirectory(PeerDir))
+      continue;
+    // Secondary instances only exchange inputs through the main instance.
+    struct stat Buffer;
+    if (!IsMain && stat((PeerDir + "/is_main").c_str(), &Buffer) != 0)
+      continue;
+    readPeerQueue(OutDir, Peer, Inputs);
+  }
+  closedir(Directory);
+}
@@ -1,5 +1,15 @@
 #include <Utils.h>
 
+#include "LogCore.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 int successCount = 0;
 int failureCount = 0;
 
@@ -22,24 +32,49 @@ int readSeedInputs(std::vector<std::string> &SeedInputs,
                    std::string &SeedInputDir) {
   DIR *Directory;
   struct dirent *Ent;
+  std::set<std::string> Names;
   if ((Directory = opendir(SeedInputDir.c_str())) != NULL) {
     while ((Ent = readdir(Directory)) != NULL) {
       if (!(Ent->d_type == DT_REG))
         continue;
-      std::string Path = SeedInputDir + "/" + std::string(Ent->d_name);
+      Names.insert(Ent->d_name);
+    }
+    closedir(Directory);
+    // Read seeds in name order so that seed indices are reproducible.
+    for (auto &Name : Names) {
+      std::string Path = SeedInputDir + "/" + Name;
       std::string Line = readOneFile(Path);
       SeedInputs.push_back(Line);
     }
-    closedir(Directory);
     return 0;
   } else {
     return 1;
   }
 }
 
+static std::string LogBase;
+
+void initLogPaths(std::string &OutDir) {
+  LogBase = OutDir + "/target";
+  std::string Pattern;
+  for (char C : LogBase) {
+    if (C == '%')
+      Pattern += '%';
+    Pattern += C;
+  }
+  setenv("INSTR_LOG", Pattern.c_str(), 1);
+  unsetenv("INSTR_LOG_FD");
+}
+
+std::string getLogPath(std::string &Target, const char *Ext) {
+  return (LogBase.empty() ? Target : LogBase) + Ext;
+}
+
 void readCoverageFile(std::string &Target,
                       std::vector<std::string> &CoverageData) {
-  std::string CoveragePath = Target + ".cov";
+  std::string CoveragePath = getLogPath(Target, ".cov");
+  // Events of a target killed before draining its ring, e.g. on timeout.
+  logcore_recover(CoveragePath.c_str());
   std::ifstream InFile(CoveragePath);
   std::string Line;
   while (std::getline(InFile, Line)) {
@@ -47,6 +82,21 @@ void readCoverageFile(std::string &Target,
   }
 }
 
+void readValueProfileFile(
+    std::string &Target,
+    std::map<std::string, unsigned long long> &ValueProfile) {
+  std::string ProfilePath = getLogPath(Target, ".vprof");
+  std::ifstream InFile(ProfilePath);
+  std::string Line;
+  while (std::getline(InFile, Line)) {
+    auto Pos = Line.find_last_of(',');
+    if (Pos == std::string::npos)
+      continue;
+    ValueProfile[Line.substr(0, Pos)] =
+        strtoull(Line.c_str() + Pos + 1, NULL, 10);
+  }
+}
+
 void storeSeed(std::string &OutDir, int randomSeed) {
   std::string Path = OutDir + "/randomSeed.txt";
   std::fstream File(Path, std::fstream::out | std::ios_base::trunc);
@@ -68,9 +118,89 @@ void storeCrashingInput(std::string &Input, std::string &OutDir) {
   OutFile.close();
 }
 
+/**
+ * Create the file used to deliver inputs to the target.
+ */
+static int createInputFile() {
+#ifdef MFD_CLOEXEC
+  int Fd = memfd_create("fuzz_input", 0);
+  if (Fd != -1)
+    return Fd;
+#endif
+  char Path[] = "/dev/shm/fuzz_input.XXXXXX";
+  int Fd2 = mkstemp(Path);
+  if (Fd2 == -1) {
+    strcpy(Path, "/tmp/fuzz_input.XXXXXX");
+    Fd2 = mkstemp(Path);
+  }
+  if (Fd2 != -1)
+    unlink(Path);
+  return Fd2;
+}
+
+/**
+ * Split FUZZ_TARGET_ARGS on whitespace.
+ */
+static std::vector<std::string> readTargetArgs() {
+  std::vector<std::string> Args;
+  const char *Env = getenv("FUZZ_TARGET_ARGS");
+  if (!Env)
+    return Args;
+  std::istringstream Stream(Env);
+  std::string Arg;
+  while (Stream >> Arg)
+    Args.push_back(Arg);
+  return Args;
+}
+
 int runTarget(std::string &Target, std::string &Input) {
-  std::string Cmd = Target + " > /dev/null 2>&1";
-  FILE *F = popen(Cmd.c_str(), "w");
-  fprintf(F, "%s", Input.c_str());
-  return pclose(F);
+  static int InputFd = createInputFile();
+  static std::vector<std::string> TargetArgs = readTargetArgs();
+  if (InputFd == -1) {
+    fprintf(stderr, "Cannot create input file\n");
+    exit(1);
+  }
+
+  // Replace the previous input and rewind the shared file offset.
+  if (ftruncate(InputFd, 0) == -1)
+    return 127;
+  size_t Written = 0;
+  while (Written < Input.size()) {
+    ssize_t Ret = pwrite(InputFd, Input.data() + Written,
+                         Input.size() - Written, Written);
+    if (Ret <= 0)
+      return 127;
+    Written += Ret;
+  }
+  lseek(InputFd, 0, SEEK_SET);
+
+  std::string InputPath = "/proc/self/fd/" + std::to_string(InputFd);
+  std::vector<std::string> Args = {Target};
+  for (auto &Arg : TargetArgs)
+    Args.push_back(Arg == "@@" ? InputPath : Arg);
+  std::vector<char *> Argv;
+  for (auto &Arg : Args)
+    Argv.push_back(const_cast<char *>(Arg.c_str()));
+  Argv.push_back(NULL);
+
+  posix_spawn_file_actions_t Actions;
+  posix_spawn_file_actions_init(&Actions);
+  posix_spawn_file_actions_adddup2(&Actions, InputFd, STDIN_FILENO);
+  posix_spawn_file_actions_addopen(&Actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&Actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  pid_t Pid;
+  int Error = posix_spawn(&Pid, Target.c_str(), &Actions, NULL, Argv.data(),
+                          environ);
+  posix_spawn_file_actions_destroy(&Actions);
+  if (Error)
+    return 127;
+
+  int Status;
+  if (waitpid(Pid, &Status, 0) == -1)
+    return 127;
+  if (WIFSIGNALED(Status))
+    return 128 + WTERMSIG(Status);
+  return WEXITSTATUS(Status);
 }
\ No newline at end of file
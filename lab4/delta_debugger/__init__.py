@@ -1,15 +1,47 @@
-from typing import Union
+import os
+
+from typing import Dict, List, Optional, Sequence, Tuple, Union
 from subprocess import run, PIPE
 
+try:
+    from delta_debugger._executor import Executor, TargetRunner
+except ImportError:
+    # The extension is optional, see setup.py.
+    Executor = TargetRunner = None
+
+# Runners of run_target by target and modification time, which keep the fork
+# server of the target across runs.
+_runners: Dict[Tuple[str, int], "TargetRunner"] = {}
+
+
+def get_runner(target: str) -> Optional["TargetRunner"]:
+    """
+    Get the native runner of the target, None without the extension.
+    """
+    if TargetRunner is None:
+        return None
+    key = (str(target), os.stat(target).st_mtime_ns)
+    if key not in _runners:
+        _runners[key] = TargetRunner(target)
+    return _runners[key]
+
 
 def run_target(target: str, input: Union[str, bytes]) -> int:
     """
     Run the target program with input on its stdin.
 
+    With the native extension, the input is delivered through a memfd and
+    the run is forked from a fork server of the target if it has one, see
+    src/PyTargetRunner.cpp.
+
     :param target: The target program to run.
     :param input: The input to pass to the target program.
-    :return: The return code of the target program.
+    :return: The return code of the target program, 128 + signal number if
+        it was killed by a signal, with or without the extension.
     """
+    runner = get_runner(target)
+    if runner is not None:
+        return runner.run(input)
     if isinstance(input, str):
         input = input.encode()
     process = run(
@@ -25,4 +57,83 @@ def run_target(target: str, input: Union[str, bytes]) -> int:
     #     f"out:\n{process.stdout}\n"
     #     f"err:\n{process.stderr}"
     # )
+    if process.returncode < 0:
+        # Killed by a signal, report it as a shell and the extension do.
+        return 128 - process.returncode
     return process.returncode
+
+
+def run_targets(
+    target: str, inputs: Sequence[Union[str, bytes]], jobs: Optional[int] = None
+) -> List[int]:
+    """
+    Run the target program with every input on its stdin.
+
+    With the native extension, the inputs run on parallel runners, and one at
+    a time with run_target otherwise.
+
+    :param target: The target program to run.
+    :param inputs: The inputs to pass to the target program.
+    :param jobs: Number of parallel runs, one per hardware thread by default.
+    :return: The return codes of the inputs.
+    """
+    runner = get_runner(target)
+    if runner is not None:
+        return runner.run_batch(inputs, jobs or 0)
+    return [run_target(target, input) for input in inputs]
+
+
+class SerialExecutor:
+    """
+    Fallback of the native Executor without the extension: runs the
+    candidates one at a time with run_target, with the same cache of the
+    return codes of the inputs.
+
+    :param target: The target program to run.
+    """
+
+    def __init__(self, target: str):
+        self.target = target
+        self.cache: Dict[bytes, int] = {}
+        self.runs = 0
+        self.hits = 0
+
+    def run(
+        self, inputs: Sequence[Union[str, bytes]], stop_on_failure: bool = False
+    ) -> List[Optional[int]]:
+        """
+        Run the target with every input, unless it was run before.
+
+        :param inputs: The candidates.
+        :param stop_on_failure: If set, do not run the candidates after the
+            first one with a non-zero return code.
+        :return: The return codes of the inputs, None for the ones that
+            were not run.
+        """
+        codes: List[Optional[int]] = []
+        failed = False
+        for input in inputs:
+            if isinstance(input, str):
+                input = input.encode()
+            code = self.cache.get(input)
+            if code is not None:
+                self.hits += 1
+            elif not (stop_on_failure and failed):
+                code = self.cache[input] = run_target(self.target, input)
+                self.runs += 1
+            failed = failed or bool(code)
+            codes.append(code)
+        return codes
+
+
+def make_executor(target: str, jobs: Optional[int] = None):
+    """
+    Get an executor of candidates for the target: the native Executor, which
+    runs them on parallel workers, or the SerialExecutor without it.
+
+    :param target: The target program to run.
+    :param jobs: Number of parallel runs, one per hardware thread by default.
+    """
+    if Executor is None:
+        return SerialExecutor(target)
+    return Executor(target, jobs or 0)
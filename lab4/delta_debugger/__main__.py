@@ -1,12 +1,13 @@
 #! /usr/bin/env python3
 
+import os
 import sys
 
 from sys import argv
 from pathlib import Path
 
 from delta_debugger import run_target
-from delta_debugger.delta import delta_debug
+from delta_debugger.delta import STRUCTURES, delta_debug, hierarchical_delta_debug
 
 
 def exist_check(file):
@@ -17,10 +18,14 @@ def exist_check(file):
 
 
 def main() -> int:
-    if len(argv) < 3:
-        print(f"usage: {argv[0]} [target] [crashing input file]")
+    if len(argv) < 3 or (len(argv) > 3 and argv[3] not in STRUCTURES):
+        print(
+            f"usage: {argv[0]} [target] [crashing input file] "
+            f"[hierarchical mode: {' | '.join(STRUCTURES)}]"
+        )
         return 1
     target, input_file = argv[1], argv[2]
+    structure = argv[3] if len(argv) > 3 else None
     if not Path(target).exists():
         print(f"{target} not found", sys.stderr)
         return 1
@@ -37,7 +42,14 @@ def main() -> int:
             )
             return 1
 
-    delta_debugging_result = delta_debug(target=target, input=input)
+    # DELTA_JOBS sets the number of parallel runs of the target.
+    jobs = int(os.environ.get("DELTA_JOBS") or 0)
+    if structure is None:
+        delta_debugging_result = delta_debug(target=target, input=input, jobs=jobs)
+    else:
+        delta_debugging_result = hierarchical_delta_debug(
+            target=target, input=input, jobs=jobs, structure=structure
+        )
 
     print(
         f"Original Input Size: {len(input)}",
@@ -51,6 +63,6 @@ def main() -> int:
 
 if __name__ == "__main__":
     """
-    usage: delta-debug [target] [crashing input file]
+    usage: delta-debug [target] [crashing input file] [lines | brackets]
     """
     sys.exit(main(*sys.argv[1:]))
@@ -1,24 +1,202 @@
 import math
+import re
 
-from typing import Tuple
+from typing import List, Optional, Sequence, Tuple, Union
 
-from delta_debugger import run_target
+from delta_debugger import make_executor
 
 EMPTY_STRING = b""
 
+# Units of ddmin: the bytes of an input, or a list of coarser units.
+Units = Union[bytes, List[bytes]]
 
-def delta_debug(target: str, input: bytes) -> bytes:
+# Tokens of the lexer of the hierarchical mode: words, whitespace, string
+# literals and single characters.
+TOKEN_PATTERN = re.compile(
+    rb"""[A-Za-z0-9_]+|\s+|"(?:\\.|[^"\\])*"|'(?:\\.|[^'\\])*'|.""", re.DOTALL
+)
+OPENERS = (b"(", b"[", b"{")
+CLOSERS = (b")", b"]", b"}")
+
+# Structures of the hierarchical mode, see hierarchical_delta_debug.
+STRUCTURES = ("lines", "brackets")
+
+
+def split(input: Units, n: int) -> List[Units]:
+    """
+    Split input into n chunks whose sizes differ by one at most.
+
+    :param input: input to split
+    :param n: number of chunks, at most len(input)
+    :return: the chunks, in order.
+    """
+    size, rest = divmod(len(input), n)
+    chunks = []
+    start = 0
+    for index in range(n):
+        end = start + size + (index < rest)
+        chunks.append(input[start:end])
+        start = end
+    return chunks
+
+
+def join(units: Units) -> bytes:
+    """
+    Get the input made of units.
+    """
+    return units if isinstance(units, bytes) else EMPTY_STRING.join(units)
+
+
+def concat(chunks: Sequence[Units], empty: Units) -> Units:
+    """
+    Concatenate chunks of units into units of the type of empty.
+    """
+    if isinstance(empty, bytes):
+        return EMPTY_STRING.join(chunks)
+    return [unit for chunk in chunks for unit in chunk]
+
+
+def next_input(executor, input: Units, n: int) -> Tuple[Units, int]:
+    """
+    Run a round of ddmin: reduce to the first of the n subsets of input that
+    still crashes, else to the first of their complements that does.
+
+    The subsets and the complements are run as one batch, which stops at the
+    first crashing candidate. A subset crashing first means that the subsets
+    before it do not crash, as ddmin requires.
+
+    :param executor: executor of the candidates, see make_executor
+    :param input: crashing input, as bytes or as a list of units
+    :param n: number of subsets, at most len(input)
+    :return: the next input and n to try, where n is larger than the size
+        of the input once it is 1-minimal.
+    """
+    subsets = split(input, n)
+    complements = [
+        concat(subsets[:index] + subsets[index + 1 :], input[:0])
+        for index in range(n)
+    ]
+    # With two subsets, the complements are the same subsets.
+    candidates = subsets + complements if n > 2 else subsets
+    codes = executor.run(
+        [join(candidate) for candidate in candidates], stop_on_failure=True
+    )
+    for index, code in enumerate(codes):
+        if code:
+            if index < n:
+                return candidates[index], 2
+            return candidates[index], max(n - 1, 2)
+    if n < len(input):
+        return input, min(2 * n, len(input))
+    return input, len(input) + 1
+
+
+def ddmin(executor, input: Units) -> bytes:
+    """
+    Minimize a crashing input until removing any of its units makes the
+    crash go away.
+
+    :param executor: executor of the candidates, see make_executor
+    :param input: crashing input, as bytes or as a list of units
+    :return: the 1-minimal crashing input.
+    """
+    n = 2
+    while n <= len(input):
+        input, n = next_input(executor, input, n)
+    return join(input)
+
+
+def delta_debug(target: str, input: bytes, jobs: Optional[int] = None) -> bytes:
     """
     Delta-Debugging algorithm
 
-    TODO: Implement your algorithm for delta-debugging.
+    Candidates run on parallel workers, and every candidate runs once even
+    if it comes up again in a later round, see make_executor.
+
+    :param target: target program
+    :param input: crashing input to be minimized
+    :param jobs: number of parallel runs, one per hardware thread by default
+    :return: 1-minimal crashing input.
+    """
+    return ddmin(make_executor(target, jobs), input)
+
+
+def tokenize(input: bytes) -> List[bytes]:
+    """
+    Split input into the tokens of TOKEN_PATTERN.
+    """
+    return TOKEN_PATTERN.findall(input)
+
+
+def group_tokens(tokens: List[bytes], depth: int) -> List[bytes]:
+    """
+    Merge every bracket group opened at nesting depth into one unit, with
+    its brackets and everything inside.
+
+    Brackets of any kind nest, and a closing bracket outside of any group is
+    a token like any other.
+
+    :param tokens: tokens of the input, see tokenize
+    :param depth: number of brackets around the groups to merge
+    :return: the units, as many as tokens if no group is opened at depth.
+    """
+    units: List[bytes] = []
+    group: List[bytes] = []
+    level = 0
+    for token in tokens:
+        closing = token in CLOSERS and level > 0
+        if closing:
+            level -= 1
+        if level > depth or (level == depth and (closing or token in OPENERS)):
+            group.append(token)
+            if closing and level == depth:
+                units.append(EMPTY_STRING.join(group))
+                group = []
+        else:
+            units.append(token)
+        if token in OPENERS:
+            level += 1
+    # A group that is not closed ends with the input.
+    if group:
+        units.append(EMPTY_STRING.join(group))
+    return units
+
+
+def hierarchical_delta_debug(
+    target: str, input: bytes, jobs: Optional[int] = None, structure: str = "lines"
+) -> bytes:
+    """
+    Hierarchical Delta-Debugging: run ddmin over coarse units of the input
+    first, then over finer units of what is left, and last over its bytes.
+
+    - lines: over the lines of the input, then its tokens.
+    - brackets: over the tokens and the bracket groups outside of any group,
+      then over those one level deeper, and so on until no group is left.
 
-    Hint: It may be helpful to use an auxilary function that
-    takes as input a target, input string, n and
-    returns the next input and n to try.
+    Removing a coarse unit removes many bytes at the cost of a single run,
+    and the finer levels only split what survived. The levels share the
+    cache of the executor, so candidates that come up again run once. The
+    result is 1-minimal over bytes as with delta_debug.
 
     :param target: target program
     :param input: crashing input to be minimized
+    :param jobs: number of parallel runs, one per hardware thread by default
+    :param structure: coarse units to start from, one of STRUCTURES
     :return: 1-minimal crashing input.
     """
-    return input
+    if structure not in STRUCTURES:
+        raise ValueError(f"structure must be one of {', '.join(STRUCTURES)}")
+    executor = make_executor(target, jobs)
+    if structure == "lines":
+        input = ddmin(executor, input.splitlines(keepends=True))
+        input = ddmin(executor, tokenize(input))
+    else:
+        depth = 0
+        while True:
+            tokens = tokenize(input)
+            units = group_tokens(tokens, depth)
+            input = ddmin(executor, units)
+            if len(units) == len(tokens):
+                break
+            depth += 1
+    return ddmin(executor, input)
@@ -0,0 +1 @@
+../../common/include/ForkServer.h
\ No newline at end of file
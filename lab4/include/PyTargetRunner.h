@@ -0,0 +1 @@
+../../common/include/PyTargetRunner.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../common/include/TargetRunner.h
\ No newline at end of file
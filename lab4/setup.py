@@ -3,7 +3,7 @@
 import sys
 from os import path
 
-from setuptools import setup, find_packages
+from setuptools import Extension, setup, find_packages
 
 BASE_PATH = path.dirname(path.abspath(__file__))
 
@@ -18,4 +18,16 @@ setup(
     entry_points={"console_scripts": ["delta-debugger=delta_debugger.__main__:main"]},
     packages=find_packages(include=["delta_debug", "delta_debug.*"]),
     install_requires=requirements,
+    # Optional: without a compiler, candidates run one at a time.
+    ext_modules=[
+        Extension(
+            "delta_debugger._executor",
+            sources=["src/Executor.cpp", "src/PyTargetRunner.cpp"],
+            include_dirs=[f"{BASE_PATH}/include"],
+            extra_compile_args=["-std=c++14", "-O2", "-pthread"],
+            extra_link_args=["-pthread"],
+            language="c++",
+            optional=True,
+        )
+    ],
 )
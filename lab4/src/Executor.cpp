@@ -0,0 +1,334 @@
+/**
+ * Native execution backend of the delta debugger, the
+ * delta_debugger._executor extension module.
+ *
+ * Executor(target, jobs=0) runs the target with inputs on its stdin, as
+ * delta_debugger.run_target does, and remembers the exit code of every input
+ * it ran. run(inputs, stop_on_failure=False) runs a batch of candidates, such
+ * as the subsets and complements of a ddmin round, on one worker thread per
+ * hardware thread by default and returns their exit codes. An input that
+ * was run before, or that comes up twice in the batch, only runs once.
+ * Every worker runs the target with a TargetRunner of its own, through a
+ * fork server when the target has one, see TargetRunner.h. The runners are
+ * kept across batches, so that their fork servers start once per worker
+ * rather than once per batch.
+ *
+ * With stop_on_failure, workers start no candidate after one that failed,
+ * that is exited with a non-zero code, and the ones not started are None in
+ * the result. Candidates before it in the batch still run, so that the first
+ * failing candidate does not depend on the scheduling of the workers.
+ *
+ * The module also provides the TargetRunner of delta_debugger.run_target,
+ * see src/PyTargetRunner.cpp.
+ */
+
+#include "PyTargetRunner.h"
+#include "TargetRunner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Code of a candidate that was not run.
+static const int NOT_RUN = -1;
+
+/**
+ * Runners of the target that are not in use, kept with their fork servers
+ * from one batch to the next.
+ */
+class RunnerPool {
+public:
+  RunnerPool(const std::string &Target, const std::vector<std::string> &Env)
+      : Target(Target), Env(Env) {}
+
+  /**
+   * Take an idle runner, or a new one if there is none. With ForkServer,
+   * its fork server is started if it does not have one, e.g. when the
+   * previous one died.
+   */
+  std::unique_ptr<TargetRunner> take(bool ForkServer) {
+    std::unique_ptr<TargetRunner> Runner;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      if (!Idle.empty()) {
+        Runner = std::move(Idle.back());
+        Idle.pop_back();
+      }
+    }
+    if (!Runner)
+      Runner.reset(new TargetRunner(Target, Env));
+    if (ForkServer && !Runner->hasServer())
+      Runner->startServer();
+    return Runner;
+  }
+
+  /**
+   * Give a runner back for the next batches.
+   */
+  void give(std::unique_ptr<TargetRunner> Runner) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Idle.push_back(std::move(Runner));
+  }
+
+private:
+  const std::string Target;
+  const std::vector<std::string> Env;
+  std::vector<std::unique_ptr<TargetRunner>> Idle;
+  std::mutex Lock;
+};
+
+/**
+ * The candidates of a batch that are not in the cache, in batch order.
+ */
+struct Batch {
+  RunnerPool &Runners;
+  bool ForkServer = false;
+  std::vector<const std::string *> Inputs;
+  std::vector<int> Codes;
+  bool StopOnFailure = false;
+  std::atomic<size_t> Next{0};
+  std::atomic<size_t> FirstFailure{SIZE_MAX};
+
+  Batch(RunnerPool &Runners) : Runners(Runners) {}
+
+  /**
+   * Take candidates until none are left, or with StopOnFailure, until the
+   * ones left come after a failing one.
+   */
+  void work() {
+    std::unique_ptr<TargetRunner> Worker = Runners.take(ForkServer);
+    while (true) {
+      size_t Index = Next++;
+      if (Index >= Inputs.size() || (StopOnFailure && Index > FirstFailure))
+        break;
+      int Code = Worker->run(*Inputs[Index]);
+      Codes[Index] = Code;
+      size_t Seen = FirstFailure;
+      while (Code != 0 && Index < Seen &&
+             !FirstFailure.compare_exchange_weak(Seen, Index)) {
+      }
+    }
+    Runners.give(std::move(Worker));
+  }
+};
+
+struct ExecutorState {
+  std::string Target;
+  std::vector<std::string> Env;
+  int Jobs = 0;
+  // Whether the target has a fork server, -1 until the first run.
+  int ForkServer = -1;
+  // Exit code of every input run so far.
+  std::unordered_map<std::string, int> Cache;
+  std::mutex CacheLock;
+  unsigned long long Runs = 0;
+  unsigned long long Hits = 0;
+  // Runners of the workers, whose fork servers stop with the executor.
+  std::unique_ptr<RunnerPool> Runners;
+};
+
+struct ExecutorObject {
+  PyObject_HEAD
+  ExecutorState *State;
+};
+
+static int executorInit(ExecutorObject *Self, PyObject *Args,
+                        PyObject *Kwargs) {
+  static const char *Keywords[] = {"target", "jobs", NULL};
+  PyObject *TargetPath, *Bytes = NULL;
+  int Jobs = 0;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "O|i:Executor",
+                                   const_cast<char **>(Keywords), &TargetPath,
+                                   &Jobs) ||
+      !PyUnicode_FSConverter(TargetPath, &Bytes))
+    return -1;
+  // Runs release the GIL while they use the state, so it cannot be replaced.
+  if (Self->State != NULL) {
+    Py_DECREF(Bytes);
+    PyErr_SetString(PyExc_RuntimeError, "Executor is already initialized");
+    return -1;
+  }
+  Self->State = new ExecutorState();
+  Self->State->Target.assign(PyBytes_AS_STRING(Bytes), PyBytes_GET_SIZE(Bytes));
+  Py_DECREF(Bytes);
+  Self->State->Env = getTargetEnv();
+  Self->State->Runners.reset(
+      new RunnerPool(Self->State->Target, Self->State->Env));
+  Self->State->Jobs =
+      Jobs > 0 ? Jobs : std::max(1u, std::thread::hardware_concurrency());
+  return 0;
+}
+
+static void executorDealloc(ExecutorObject *Self) {
+  PyTypeObject *Type = Py_TYPE(Self);
+  delete Self->State;
+  Type->tp_free(reinterpret_cast<PyObject *>(Self));
+#if PY_VERSION_HEX >= 0x03080000
+  // Instances of heap types hold a reference to their type since 3.8.
+  Py_DECREF(Type);
+#endif
+}
+
+static PyObject *executorRun(ExecutorObject *Self, PyObject *Args,
+                             PyObject *Kwargs) {
+  static const char *Keywords[] = {"inputs", "stop_on_failure", NULL};
+  PyObject *Sequence;
+  int StopOnFailure = 0;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "O|p:run",
+                                   const_cast<char **>(Keywords), &Sequence,
+                                   &StopOnFailure))
+    return NULL;
+  ExecutorState *State = Self->State;
+  if (State == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "Executor is not initialized");
+    return NULL;
+  }
+  std::vector<std::string> Inputs;
+  if (!readInputs(Sequence, Inputs))
+    return NULL;
+
+  std::vector<int> Codes(Inputs.size(), NOT_RUN);
+  Py_BEGIN_ALLOW_THREADS;
+  // Run every input that is not in the cache once, up to the first
+  // candidate known to fail with StopOnFailure.
+  Batch Work(*State->Runners);
+  Work.StopOnFailure = StopOnFailure;
+  std::vector<size_t> TaskOf(Inputs.size(), SIZE_MAX);
+  {
+    std::unordered_map<std::string, size_t> Tasks;
+    std::lock_guard<std::mutex> Guard(State->CacheLock);
+    bool Failed = false;
+    for (size_t Index = 0; Index < Inputs.size(); ++Index) {
+      auto Cached = State->Cache.find(Inputs[Index]);
+      if (Cached != State->Cache.end()) {
+        Codes[Index] = Cached->second;
+        Failed = Failed || Cached->second != 0;
+        ++State->Hits;
+      } else if (!(StopOnFailure && Failed)) {
+        auto Task = Tasks.emplace(Inputs[Index], Work.Inputs.size());
+        if (Task.second)
+          Work.Inputs.push_back(&Inputs[Index]);
+        else
+          ++State->Hits;
+        TaskOf[Index] = Task.first->second;
+      }
+    }
+    if (State->ForkServer == -1 && !Work.Inputs.empty())
+      State->ForkServer = hasForkServer(State->Target, State->Env);
+    Work.ForkServer = State->ForkServer == 1;
+  }
+  Work.Codes.resize(Work.Inputs.size(), NOT_RUN);
+
+  int Jobs = std::max<size_t>(
+      1, std::min<size_t>(State->Jobs, Work.Inputs.size()));
+  std::vector<std::thread> Workers;
+  for (int Index = 1; Index < Jobs; ++Index)
+    Workers.emplace_back([&Work] { Work.work(); });
+  Work.work();
+  for (auto &Worker : Workers)
+    Worker.join();
+
+  {
+    std::lock_guard<std::mutex> Guard(State->CacheLock);
+    for (size_t Task = 0; Task < Work.Inputs.size(); ++Task) {
+      if (Work.Codes[Task] != NOT_RUN) {
+        State->Cache.emplace(*Work.Inputs[Task], Work.Codes[Task]);
+        ++State->Runs;
+      }
+    }
+  }
+  for (size_t Index = 0; Index < Inputs.size(); ++Index) {
+    if (TaskOf[Index] != SIZE_MAX)
+      Codes[Index] = Work.Codes[TaskOf[Index]];
+  }
+  Py_END_ALLOW_THREADS;
+
+  PyObject *Result = PyList_New(Codes.size());
+  if (Result == NULL)
+    return NULL;
+  for (size_t Index = 0; Index < Codes.size(); ++Index) {
+    PyObject *Code;
+    if (Codes[Index] == NOT_RUN) {
+      Code = Py_None;
+      Py_INCREF(Code);
+    } else if ((Code = PyLong_FromLong(Codes[Index])) == NULL) {
+      Py_DECREF(Result);
+      return NULL;
+    }
+    PyList_SET_ITEM(Result, Index, Code);
+  }
+  return Result;
+}
+
+static PyObject *executorGetRuns(ExecutorObject *Self, void *Closure) {
+  return PyLong_FromUnsignedLongLong(Self->State ? Self->State->Runs : 0);
+}
+
+static PyObject *executorGetHits(ExecutorObject *Self, void *Closure) {
+  return PyLong_FromUnsignedLongLong(Self->State ? Self->State->Hits : 0);
+}
+
+static PyMethodDef ExecutorMethods[] = {
+    {"run", (PyCFunction)(void (*)(void))executorRun,
+     METH_VARARGS | METH_KEYWORDS,
+     "run(inputs, stop_on_failure=False)\n--\n\n"
+     "Run the target with every input on parallel workers, unless it was\n"
+     "run before. Returns the exit codes of the inputs, None for the ones\n"
+     "after the first failing input that were not started with\n"
+     "stop_on_failure."},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyGetSetDef ExecutorGetSet[] = {
+    {"runs", (getter)executorGetRuns, NULL,
+     "Number of runs of the target so far.", NULL},
+    {"hits", (getter)executorGetHits, NULL,
+     "Number of candidates answered without a run so far.", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyType_Slot ExecutorSlots[] = {
+    {Py_tp_doc, const_cast<char *>(
+                    "Executor(target, jobs=0)\n--\n\n"
+                    "Runs the target on parallel workers and caches the exit "
+                    "code of every input.")},
+    {Py_tp_new, reinterpret_cast<void *>(PyType_GenericNew)},
+    {Py_tp_init, reinterpret_cast<void *>(executorInit)},
+    {Py_tp_dealloc, reinterpret_cast<void *>(executorDealloc)},
+    {Py_tp_methods, ExecutorMethods},
+    {Py_tp_getset, ExecutorGetSet},
+    {0, NULL},
+};
+
+static PyType_Spec ExecutorSpec = {
+    "delta_debugger._executor.Executor", sizeof(ExecutorObject), 0,
+    Py_TPFLAGS_DEFAULT, ExecutorSlots,
+};
+
+static struct PyModuleDef Module = {
+    PyModuleDef_HEAD_INIT, "_executor",
+    "Parallel, cached execution of delta debugging candidates.", -1, NULL,
+};
+
+PyMODINIT_FUNC PyInit__executor(void) {
+  PyObject *Mod = PyModule_Create(&Module);
+  if (Mod == NULL)
+    return NULL;
+  PyObject *Type = PyType_FromSpec(&ExecutorSpec);
+  if (Type == NULL || PyModule_AddObject(Mod, "Executor", Type) < 0) {
+    Py_XDECREF(Type);
+    Py_DECREF(Mod);
+    return NULL;
+  }
+  if (!addTargetRunnerType(Mod, "delta_debugger._executor.TargetRunner")) {
+    Py_DECREF(Mod);
+    return NULL;
+  }
+  return Mod;
+}
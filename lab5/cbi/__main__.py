@@ -1,18 +1,20 @@
 #! /usr/bin/env python3
 
 import json
+import os
 import sys
 
 from dataclasses import asdict
 from pathlib import Path
 
-from cbi.cbi import cbi
-from cbi.utils import get_logs
+from cbi.cbi import cbi_from_target
 
 
 def main() -> int:
     """
     Usage: cbi [target] [fuzzer-output-dir]
+
+    CBI_JOBS sets the number of parallel runs of the target.
     """
     if len(sys.argv) < 3:
         print(
@@ -29,10 +31,9 @@ def main() -> int:
         print(f"{fuzz_output_dir} not found", file=sys.stderr)
         return 1
 
-    # Generate the cbi logs
-    success_logs, failure_logs = get_logs(target=target, fuzz_dir=Path(fuzz_output_dir))
-    # Analyze the cbi logs and generate the report
-    report = cbi(success_logs=success_logs, failure_logs=failure_logs)
+    # Run the target on the inputs and analyze their cbi logs
+    jobs = int(os.environ.get("CBI_JOBS") or 0)
+    report = cbi_from_target(target=target, fuzz_dir=Path(fuzz_output_dir), jobs=jobs)
     # Visualize the report
     print(report)
     # Save the report to a file
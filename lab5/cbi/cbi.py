@@ -3,7 +3,8 @@
 from collections import defaultdict
 import itertools
 from pathlib import Path
-from typing import Dict, Iterable, List, Set
+from sys import stderr
+from typing import Dict, Iterable, List, Optional, Set, Tuple
 from cbi.data_format import (
     CBILog,
     ObservationStatus,
@@ -12,10 +13,26 @@ from cbi.data_format import (
     PredicateType,
     Report,
 )
-from cbi.utils import get_logs
+from cbi.prune import PruneMap, expand_observations, get_prune_map, native_prune_map
+from cbi.utils import (
+    check_return_codes,
+    get_input_dirs,
+    get_inputs,
+    get_log_files,
+    get_logs,
+    read_log,
+)
+
+try:
+    from cbi._aggregate import aggregate, collect
+except ImportError:
+    # The extension is optional, see setup.py.
+    aggregate = collect = None
 
 
-def collect_observations(log: CBILog) -> Dict[Predicate, ObservationStatus]:
+def collect_observations(
+    log: CBILog, prune_map: Optional[PruneMap] = None
+) -> Dict[Predicate, ObservationStatus]:
     """
     Traverse the CBILog and collect observation status for each predicate.
 
@@ -25,55 +42,182 @@ def collect_observations(log: CBILog) -> Dict[Predicate, ObservationStatus]:
     `Predicate(line=3, column=5, pred_type="BranchFalse")` as False.
 
     :param log: the log
+    :param prune_map: the sites pruned from the target, whose predicates are
+        derived from those of the log, see cbi.prune
     :return: a dictionary of predicates and their observation status.
     """
     observations: Dict[Predicate, ObservationStatus] = defaultdict(
         lambda: ObservationStatus.NEVER
     )
 
-    """
-    TODO: Add your code here
-
-    Hint: The PredicateType.alternatives will come in handy.
-    """
-
+    for entry in log:
+        for pred_type, status in PredicateType.alternatives(entry.value):
+            predicate = Predicate(line=entry.line, column=entry.column, value=pred_type)
+            observations[predicate] = ObservationStatus.merge(
+                observations[predicate], status
+            )
 
-    return observations
+    return expand_observations(observations, prune_map)
 
 
-def collect_all_predicates(logs: Iterable[CBILog]) -> Set[Predicate]:
+def collect_all_predicates(
+    logs: Iterable[CBILog], prune_map: Optional[PruneMap] = None
+) -> Set[Predicate]:
     """
     Collect all predicates from the logs.
 
     :param logs: Collection of CBILogs
+    :param prune_map: the sites pruned from the target, see cbi.prune
     :return: Set of all predicates found across all logs.
     """
     predicates = set()
 
-    # TODO: Add your code here
-
+    for log in logs:
+        for entry in log:
+            for pred_type, _ in PredicateType.alternatives(entry.value):
+                predicates.add(
+                    Predicate(line=entry.line, column=entry.column, value=pred_type)
+                )
+
+    # The predicates of a pruned site exist if those of its source do.
+    sites = {(predicate.line, predicate.column) for predicate in predicates}
+    for site in prune_map or []:
+        if (site.source_line, site.source_column) in sites:
+            for pred_type in site.predicates:
+                predicates.add(
+                    Predicate(line=site.line, column=site.column, value=pred_type)
+                )
 
     return predicates
 
 
-def cbi(success_logs: List[CBILog], failure_logs: List[CBILog]) -> Report:
+def cbi(
+    success_logs: List[CBILog],
+    failure_logs: List[CBILog],
+    prune_map: Optional[PruneMap] = None,
+) -> Report:
     """
     Compute the CBI report.
 
     :param success_logs: logs of successful runs
     :param failure_logs: logs of failing runs
+    :param prune_map: the sites pruned from the target, see cbi.prune
     :return: the report
     """
-    all_predicates = collect_all_predicates(itertools.chain(success_logs, failure_logs))
+    all_predicates = collect_all_predicates(
+        itertools.chain(success_logs, failure_logs), prune_map
+    )
 
     predicate_infos: Dict[Predicate, PredicateInfo] = {
         pred: PredicateInfo(pred) for pred in all_predicates
     }
 
-    # TODO: Add your code here to compute the information for each predicate.
-
-
+    for logs, failed in ((success_logs, False), (failure_logs, True)):
+        for log in logs:
+            for predicate, status in collect_observations(log, prune_map).items():
+                info = predicate_infos[predicate]
+                observed_true = status in (
+                    ObservationStatus.ONLY_TRUE,
+                    ObservationStatus.BOTH,
+                )
+                if failed:
+                    info.f_obs += 1
+                    info.f += observed_true
+                else:
+                    info.s_obs += 1
+                    info.s += observed_true
 
     # Finally, create a report and return it.
     report = Report(predicate_info_list=list(predicate_infos.values()))
     return report
+
+
+def cbi_from_files(
+    success_files: List[Path],
+    failure_files: List[Path],
+    threads: Optional[int] = None,
+    prune_map: Optional[PruneMap] = None,
+) -> Report:
+    """
+    Compute the CBI report from the log files of the runs, as read by read_log.
+
+    The native extension streams the logs on worker threads without building
+    CBILogs. Without it, the logs are read and passed to cbi.
+
+    :param success_files: logs of successful runs
+    :param failure_files: logs of failing runs
+    :param threads: number of worker threads, all hardware threads by default
+    :param prune_map: the sites pruned from the target, see cbi.prune
+    :return: the report
+    """
+    if aggregate is None:
+        return cbi(
+            success_logs=[read_log(file) for file in success_files],
+            failure_logs=[read_log(file) for file in failure_files],
+            prune_map=prune_map,
+        )
+
+    return report_from_counters(
+        aggregate(
+            success_files,
+            failure_files,
+            threads or 0,
+            prune_map=native_prune_map(prune_map),
+        )
+    )
+
+
+def cbi_from_target(target: str, fuzz_dir: Path, jobs: Optional[int] = None) -> Report:
+    """
+    Compute the CBI report of the inputs under fuzz_dir.
+
+    The native extension runs the inputs on parallel workers that count the
+    predicates of every run as soon as it is done, without keeping its log.
+    Without it, the logs are collected and passed to cbi_from_files. The
+    sites pruned from a target built with a prune map, target.cbi.map, are
+    derived from the logs, see cbi.prune.
+
+    :param target: the target program to run
+    :param fuzz_dir: the directory containing the fuzzer output
+    :param jobs: number of parallel runs, one per hardware thread by default
+    :return: the report
+    """
+    prune_map = get_prune_map(target)
+    if collect is None:
+        success_files, failure_files = get_log_files(target=target, fuzz_dir=fuzz_dir)
+        return cbi_from_files(
+            success_files=success_files,
+            failure_files=failure_files,
+            prune_map=prune_map,
+        )
+
+    success_dir, failure_dir = get_input_dirs(fuzz_dir)
+    print("Collecting cbi logs...", file=stderr)
+    success_inputs = get_inputs(success_dir)
+    failure_inputs = get_inputs(failure_dir)
+    success_codes, failure_codes, predicates = collect(
+        target,
+        success_inputs,
+        failure_inputs,
+        jobs=jobs or 0,
+        counters=True,
+        prune_map=native_prune_map(prune_map),
+    )
+    check_return_codes(success_inputs, success_codes, 0)
+    check_return_codes(failure_inputs, failure_codes, 1)
+    return report_from_counters(predicates)
+
+
+def report_from_counters(predicates: List[Tuple[int, ...]]) -> Report:
+    """
+    Create the report of the (line, column, type, s, f, s_obs, f_obs) tuples
+    of the native extension.
+    """
+    predicate_info_list = []
+    for line, column, type_index, s, f, s_obs, f_obs in predicates:
+        info = PredicateInfo(
+            Predicate(line=line, column=column, value=PredicateType.ALL_TYPES[type_index])
+        )
+        info.s, info.f, info.s_obs, info.f_obs = s, f, s_obs, f_obs
+        predicate_info_list.append(info)
+    return Report(predicate_info_list=predicate_info_list)
@@ -215,10 +215,9 @@ class PredicateInfo:
 
         :return: The failure value.
         """
-        # TODO: Implement the calculation of the failure value.
-
-
-        return 0
+        if self.s + self.f == 0:
+            return 0
+        return self.f / (self.s + self.f)
 
     @property
     def context(self) -> float:
@@ -227,9 +226,9 @@ class PredicateInfo:
 
         :return: The context value.
         """
-        # TODO: Implement the calculation of the context value.
-
-        return 0
+        if self.s_obs + self.f_obs == 0:
+            return 0
+        return self.f_obs / (self.s_obs + self.f_obs)
 
     @property
     def increase(self):
@@ -238,9 +237,7 @@ class PredicateInfo:
 
         :return: The increase value.
         """
-        # TODO: Implement the calculation of the increase value.
-
-        return 0
+        return self.failure - self.context
 
     """
     Helper methods that map variable names to names in lecture slides.
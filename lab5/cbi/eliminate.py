@@ -0,0 +1,195 @@
+#! /usr/bin/env python3
+
+"""
+Iterative predicate elimination: pick the predicate with the highest
+Increase, drop every failing run in which it was true, since it explains
+them, and rank the remaining predicates again on the failing runs left.
+
+Runs are numbered, and every predicate keeps the runs in which it was
+observed and the runs in which it was true as bitsets, Python ints whose bit
+i stands for run i. The successful runs never change, so s and s_obs are
+counted once. A round only counts f and f_obs of every predicate with an AND
+of its bitsets and the failing runs left, and drops the runs explained by
+the pick with an AND-NOT.
+"""
+
+import sys
+
+from dataclasses import dataclass
+from pathlib import Path
+from typing import Dict, List, Optional
+
+from cbi.cbi import collect_observations
+from cbi.data_format import CBILog, ObservationStatus, Predicate, PredicateInfo
+from cbi.prune import PruneMap, get_prune_map
+from cbi.utils import get_log_files, read_log
+
+OBSERVED_TRUE = (ObservationStatus.ONLY_TRUE, ObservationStatus.BOTH)
+
+
+def popcount(bits: int) -> int:
+    """
+    Number of runs in a bitset.
+    """
+    return bin(bits).count("1")
+
+
+if hasattr(int, "bit_count"):
+    popcount = int.bit_count  # noqa: F811, Python 3.10+
+
+
+@dataclass
+class EliminationRound:
+    """
+    Data class for a round of the elimination.
+
+    :param predicate_info: The pick of the round, with its counters over the
+        failing runs left at that round.
+    :param explained: The number of failing runs in which the pick was true,
+        dropped after the round.
+    :param remaining: The number of failing runs left after the round.
+    """
+
+    predicate_info: PredicateInfo
+    explained: int
+    remaining: int
+
+    def __str__(self) -> str:
+        info = self.predicate_info
+        return (
+            f"{info.predicate}: Increase {info.increase:.4f}, "
+            f"explains {self.explained} failing runs, {self.remaining} left"
+        )
+
+
+class RunBitsets:
+    """
+    The runs in which every predicate was observed and was true.
+
+    :param success_logs: logs of successful runs
+    :param failure_logs: logs of failing runs
+    :param prune_map: the sites pruned from the target, see cbi.prune
+    """
+
+    def __init__(
+        self,
+        success_logs: List[CBILog],
+        failure_logs: List[CBILog],
+        prune_map: Optional[PruneMap] = None,
+    ):
+        self.observed: Dict[Predicate, int] = {}
+        self.true: Dict[Predicate, int] = {}
+        # Successful runs come first, failing runs after them.
+        run = 0
+        for log in success_logs + failure_logs:
+            bit = 1 << run
+            for predicate, status in collect_observations(log, prune_map).items():
+                if status == ObservationStatus.NEVER:
+                    continue
+                self.observed[predicate] = self.observed.get(predicate, 0) | bit
+                if status in OBSERVED_TRUE:
+                    self.true[predicate] = self.true.get(predicate, 0) | bit
+            run += 1
+        self.success_runs = (1 << len(success_logs)) - 1
+        self.failure_runs = ((1 << run) - 1) & ~self.success_runs
+
+    @classmethod
+    def from_files(
+        cls,
+        success_files: List[Path],
+        failure_files: List[Path],
+        prune_map: Optional[PruneMap] = None,
+    ) -> "RunBitsets":
+        """
+        Read the .cbi.jsonl or .cbi.bin logs of the runs.
+        """
+        return cls(
+            success_logs=[read_log(file) for file in success_files],
+            failure_logs=[read_log(file) for file in failure_files],
+            prune_map=prune_map,
+        )
+
+    def eliminate(self, max_rounds: Optional[int] = None) -> List[EliminationRound]:
+        """
+        Pick predicates until no failing run is left, or no predicate has a
+        positive Increase on the failing runs left.
+
+        :param max_rounds: If set, stop after that many picks.
+        :return: The rounds, in the order of the picks.
+        """
+        successful: Dict[Predicate, PredicateInfo] = {}
+        for predicate, observed in self.observed.items():
+            info = PredicateInfo(predicate)
+            info.s = popcount(self.true.get(predicate, 0) & self.success_runs)
+            info.s_obs = popcount(observed & self.success_runs)
+            successful[predicate] = info
+
+        # Ties go to the first predicate in source order.
+        predicates = sorted(self.observed)
+        rounds: List[EliminationRound] = []
+        failing = self.failure_runs
+        while failing and (max_rounds is None or len(rounds) < max_rounds):
+            best: Optional[PredicateInfo] = None
+            for predicate in predicates:
+                observed = self.observed[predicate]
+                if not observed & failing:
+                    continue
+                info = PredicateInfo(predicate)
+                info.s = successful[predicate].s
+                info.s_obs = successful[predicate].s_obs
+                info.f = popcount(self.true.get(predicate, 0) & failing)
+                info.f_obs = popcount(observed & failing)
+                if best is None or (info.increase, info.f) > (best.increase, best.f):
+                    best = info
+            if best is None or best.increase <= 0:
+                break
+            failing &= ~self.true.get(best.predicate, 0)
+            rounds.append(
+                EliminationRound(
+                    predicate_info=best, explained=best.f, remaining=popcount(failing)
+                )
+            )
+        return rounds
+
+
+def eliminate(
+    success_logs: List[CBILog],
+    failure_logs: List[CBILog],
+    max_rounds: Optional[int] = None,
+    prune_map: Optional[PruneMap] = None,
+) -> List[EliminationRound]:
+    """
+    Run the iterative elimination on the logs, see RunBitsets.eliminate.
+    """
+    return RunBitsets(success_logs, failure_logs, prune_map).eliminate(max_rounds)
+
+
+def main() -> int:
+    """
+    Usage: cbi-eliminate [target] [fuzzer-output-dir] [max rounds]
+    """
+    if len(sys.argv) < 3:
+        print(main.__doc__.strip(), file=sys.stderr)
+        return 1
+    target, fuzz_output_dir = sys.argv[1:3]
+    max_rounds = int(sys.argv[3]) if len(sys.argv) > 3 else None
+    if not Path(target).exists():
+        print(f"{target} not found", file=sys.stderr)
+        return 1
+    if not Path(fuzz_output_dir).exists():
+        print(f"{fuzz_output_dir} not found", file=sys.stderr)
+        return 1
+
+    success_files, failure_files = get_log_files(
+        target=target, fuzz_dir=Path(fuzz_output_dir)
+    )
+    bitsets = RunBitsets.from_files(
+        success_files, failure_files, prune_map=get_prune_map(target)
+    )
+    for round_ in bitsets.eliminate(max_rounds):
+        print(round_)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
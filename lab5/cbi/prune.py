@@ -0,0 +1,145 @@
+#! /usr/bin/env python3
+
+"""
+Sites left uninstrumented by the -cbi-prune flag of the CBIInstrument pass.
+
+A pruned site never ran, or runs exactly when another site of its block, its
+source, does, and the outcome of every execution of the source decides the
+outcome of the pruned site. The pass records the latter in the file given to
+-cbi-prune-map, one JSON line per site:
+
+    {"line": 4, "column": 7, "kind": "branch",
+     "source_line": 3, "source_column": 5, "source_kind": "return",
+     "predicates": {"BranchTrue": ["ReturnPositive"],
+                    "BranchFalse": ["ReturnZero", "ReturnNegative"]}}
+
+where every predicate of the site is true in an execution if the source
+predicate true in the same execution is listed. The observations of a run
+are derived from those of its sources before they are counted, so a report
+is the same as without pruning.
+"""
+
+import json
+
+from dataclasses import dataclass
+from pathlib import Path
+from typing import Dict, List, Optional, Union
+
+from cbi.data_format import ObservationStatus, Predicate, PredicateType
+
+PRUNE_MAP_EXTENSION = ".cbi.map"
+
+OBSERVED_TRUE = (ObservationStatus.ONLY_TRUE, ObservationStatus.BOTH)
+
+
+@dataclass
+class DerivedSite:
+    """
+    Data class for a line of the prune map.
+
+    :param line: The line of the pruned site.
+    :param column: The column of the pruned site.
+    :param kind: The kind of the pruned site, branch or return.
+    :param source_line: The line of its source.
+    :param source_column: The column of its source.
+    :param source_kind: The kind of its source, branch or return.
+    :param predicates: The source predicate types making each predicate type
+        of the pruned site true.
+    """
+
+    line: int
+    column: int
+    kind: str
+    source_line: int
+    source_column: int
+    source_kind: str
+    predicates: Dict[str, List[str]]
+
+
+PruneMap = List[DerivedSite]
+
+
+def _site_types(kind: str) -> List[str]:
+    return PredicateType.BRANCH_TYPES if kind == "branch" else PredicateType.RETURN_TYPES
+
+
+def read_prune_map(path: Union[str, Path]) -> PruneMap:
+    """
+    Read the prune map written by the CBIInstrument pass.
+    """
+    with open(path) as fp:
+        return [DerivedSite(**json.loads(line)) for line in fp if line.strip()]
+
+
+def get_prune_map(target: str) -> Optional[PruneMap]:
+    """
+    Read the prune map of a target, target.cbi.map, if it was built with one.
+    """
+    path = Path(f"{target}{PRUNE_MAP_EXTENSION}")
+    return read_prune_map(path) if path.exists() else None
+
+
+def expand_observations(
+    observations: Dict[Predicate, ObservationStatus], prune_map: Optional[PruneMap]
+) -> Dict[Predicate, ObservationStatus]:
+    """
+    Add the observations of the pruned sites of a run, derived from those of
+    their sources, to the observations of the run.
+
+    A pruned predicate is observed if its source was, true if one of the
+    source predicates it lists was true, and false if another one was.
+    """
+    if not prune_map:
+        return observations
+    for site in prune_map:
+        source = {
+            pred_type: observations.get(
+                Predicate(
+                    line=site.source_line, column=site.source_column, value=pred_type
+                ),
+                ObservationStatus.NEVER,
+            )
+            for pred_type in _site_types(site.source_kind)
+        }
+        if all(status == ObservationStatus.NEVER for status in source.values()):
+            continue
+        for pred_type in _site_types(site.kind):
+            predicate = Predicate(line=site.line, column=site.column, value=pred_type)
+            status = observations.get(predicate, ObservationStatus.NEVER)
+            for source_type, source_status in source.items():
+                if source_status in OBSERVED_TRUE:
+                    status = ObservationStatus.merge(
+                        status,
+                        ObservationStatus.from_bool(
+                            source_type in site.predicates[pred_type]
+                        ),
+                    )
+            observations[predicate] = status
+    return observations
+
+
+def native_prune_map(prune_map: Optional[PruneMap]) -> list:
+    """
+    The prune map as the native extension takes it, a list of
+    (line, column, type, source line, source column, source is a branch,
+    mask of source types) tuples, with types as indices in
+    PredicateType.ALL_TYPES.
+    """
+    entries = []
+    for site in prune_map or []:
+        for pred_type in _site_types(site.kind):
+            mask = 0
+            for source_type in site.predicates[pred_type]:
+                mask |= 1 << PredicateType.ALL_TYPES.index(source_type)
+            entries.append(
+                (
+                    site.line,
+                    site.column,
+                    PredicateType.ALL_TYPES.index(pred_type),
+                    site.source_line,
+                    site.source_column,
+                    site.source_kind == "branch",
+                    mask,
+                )
+            )
+    return entries
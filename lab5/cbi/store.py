@@ -0,0 +1,450 @@
+#! /usr/bin/env python3
+
+"""
+Persistent CBI state: the s, f, s_obs and f_obs counters of every predicate
+seen so far, in a file that is mapped in memory.
+
+The file is a header followed by an open addressing hash table of records,
+probed linearly from a hash of the predicate. Folding a run in only touches
+the records of the predicates it observed, and a report is a scan of the
+table, so neither reads the logs of earlier runs. The table doubles in place
+once it is half full. Every operation holds a lock on the file, so that
+several processes can fold runs into the same store.
+
+Every change to the table is staged first: the records it writes go after
+the table and are flushed, then the header commits them together with the
+new number of predicates and runs, and only then are they written to the
+table. Growing the table stages every record and clears the table before
+inserting them again. A change cut short by a crash or a kill is finished
+from the staged records by the next operation on the store, so a run is
+folded in whole or not at all and no counter is lost.
+"""
+
+import fcntl
+import mmap
+import os
+import struct
+import sys
+
+from pathlib import Path
+from typing import Dict, Iterator, List, Optional, Union
+
+from cbi.cbi import collect_observations
+from cbi.data_format import (
+    CBILog,
+    ObservationStatus,
+    Predicate,
+    PredicateInfo,
+    PredicateType,
+    Report,
+)
+from cbi.prune import PruneMap, get_prune_map
+from cbi.utils import read_log
+
+STORE_MAGIC = 0x4554415453494243  # "CBISTATE"
+STORE_VERSION = 1
+# magic, version, capacity, number of predicates, staged records, successful
+# runs, failing runs, whether the staged records replace the table
+STORE_HEADER = struct.Struct("=QIIIIQQI")
+STORE_HEADER_SIZE = 64
+# line, column, type (index in PredicateType.ALL_TYPES), used, s, f, s_obs, f_obs
+STORE_RECORD = struct.Struct("=iiiIQQQQ")
+STORE_INITIAL_CAPACITY = 1024
+
+OBSERVED_TRUE = (ObservationStatus.ONLY_TRUE, ObservationStatus.BOTH)
+
+
+def predicate_hash(line: int, column: int, type_index: int) -> int:
+    """
+    Hash of a predicate that does not depend on the process, unlike hash().
+    """
+    key = (line & 0xFFFFFFFF) << 32 | (column & 0x1FFFFFFF) << 3 | type_index
+    key = ((key ^ (key >> 33)) * 0xFF51AFD7ED558CCD) & 0xFFFFFFFFFFFFFFFF
+    return key ^ (key >> 33)
+
+
+class CBIStore:
+    """
+    Predicate counters kept in a file, see above.
+
+    Use as a context manager, or call close when done:
+
+        with CBIStore(path) as store:
+            store.add_run(log, failed=True)
+            print(store.report())
+
+    :param path: The file of the store, created if it does not exist.
+    """
+
+    def __init__(self, path: Union[str, Path]):
+        self.path = Path(path)
+        self.fd = os.open(self.path, os.O_RDWR | os.O_CREAT, 0o666)
+        self.map: Optional[mmap.mmap] = None
+        with self._locked():
+            if os.fstat(self.fd).st_size == 0:
+                self._resize(STORE_INITIAL_CAPACITY)
+                self._write_header(STORE_INITIAL_CAPACITY, 0, 0, 0)
+            self._remap()
+            magic, version, *_ = STORE_HEADER.unpack_from(self.map)
+            if magic != STORE_MAGIC or version != STORE_VERSION:
+                raise ValueError(f"{self.path} is not a CBI store")
+            self._finish_staged()
+
+    def __enter__(self) -> "CBIStore":
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
+
+    def close(self) -> None:
+        if self.map is not None:
+            self.map.close()
+            self.map = None
+        if self.fd != -1:
+            os.close(self.fd)
+            self.fd = -1
+
+    def add_run(
+        self, log: CBILog, failed: bool, prune_map: Optional[PruneMap] = None
+    ) -> None:
+        """
+        Fold the log of a run into the counters.
+
+        :param log: The log of the run.
+        :param failed: Whether the run failed.
+        :param prune_map: The sites pruned from the target, see cbi.prune.
+        """
+        self.add_observations(collect_observations(log, prune_map), failed)
+
+    def add_log_file(
+        self, log_file: Path, failed: bool, prune_map: Optional[PruneMap] = None
+    ) -> None:
+        """
+        Fold the .cbi.jsonl or .cbi.bin log of a run into the counters.
+        """
+        self.add_run(read_log(log_file), failed, prune_map)
+
+    def add_observations(
+        self, observations: Dict[Predicate, ObservationStatus], failed: bool
+    ) -> None:
+        """
+        Fold the observations of a run, as collect_observations returns them,
+        into the counters.
+        """
+        with self._locked():
+            self._refresh()
+            capacity, size, num_success, num_failure = self._read_header()
+            if (size + len(observations)) * 2 > capacity:
+                capacity = self._grow(size + len(observations))
+            records = []
+            for predicate, status in observations.items():
+                if status == ObservationStatus.NEVER:
+                    continue
+                type_index = PredicateType.ALL_TYPES.index(predicate.pred_type)
+                _, record = self._find(
+                    capacity, predicate.line, predicate.column, type_index
+                )
+                _, _, _, used, s, f, s_obs, f_obs = record
+                if not used:
+                    size += 1
+                observed_true = status in OBSERVED_TRUE
+                if failed:
+                    f += observed_true
+                    f_obs += 1
+                else:
+                    s += observed_true
+                    s_obs += 1
+                records.append(
+                    (
+                        predicate.line,
+                        predicate.column,
+                        type_index,
+                        1,
+                        s,
+                        f,
+                        s_obs,
+                        f_obs,
+                    )
+                )
+            if failed:
+                num_failure += 1
+            else:
+                num_success += 1
+            self._commit(capacity, size, num_success, num_failure, records)
+
+    @property
+    def num_runs(self) -> Dict[str, int]:
+        """
+        The number of successful and failing runs folded in so far.
+        """
+        with self._locked():
+            self._refresh()
+            _, _, num_success, num_failure = self._read_header()
+        return {"success": num_success, "failure": num_failure}
+
+    def predicate_infos(self) -> List[PredicateInfo]:
+        """
+        The counters of every predicate seen so far.
+        """
+        with self._locked():
+            self._refresh()
+            return list(self._records())
+
+    def report(self) -> Report:
+        """
+        The report of all runs folded in so far.
+        """
+        return Report(predicate_info_list=self.predicate_infos())
+
+    def ranked(self, limit: Optional[int] = None) -> List[PredicateInfo]:
+        """
+        The predicates with a positive Increase, highest first, as CBI ranks
+        them.
+
+        :param limit: If set, only return the limit first predicates.
+        """
+        ranked = sorted(
+            (info for info in self.predicate_infos() if info.increase > 0),
+            key=lambda info: (-info.increase, info.predicate),
+        )
+        return ranked if limit is None else ranked[:limit]
+
+    def _locked(self):
+        return _FileLock(self.fd)
+
+    def _read_header(self):
+        _, _, capacity, size, _, num_success, num_failure, _ = STORE_HEADER.unpack_from(
+            self.map
+        )
+        return capacity, size, num_success, num_failure
+
+    def _write_header(
+        self,
+        capacity: int,
+        size: int,
+        num_success: int,
+        num_failure: int,
+        staged: int = 0,
+        replace: bool = False,
+    ) -> None:
+        header = STORE_HEADER.pack(
+            STORE_MAGIC,
+            STORE_VERSION,
+            capacity,
+            size,
+            staged,
+            num_success,
+            num_failure,
+            replace,
+        )
+        if self.map is not None:
+            self.map[: len(header)] = header
+        else:
+            os.pwrite(self.fd, header, 0)
+
+    def _resize(self, capacity: int) -> None:
+        os.ftruncate(self.fd, STORE_HEADER_SIZE + capacity * STORE_RECORD.size)
+
+    def _remap(self) -> None:
+        """
+        Map the file again if another process resized it.
+        """
+        size = os.fstat(self.fd).st_size
+        if self.map is None or len(self.map) != size:
+            if self.map is not None:
+                self.map.close()
+            self.map = mmap.mmap(self.fd, size)
+
+    def _refresh(self) -> None:
+        """
+        Map the file again if needed, and finish a change that was cut short.
+        """
+        self._remap()
+        self._finish_staged()
+
+    def _records(self) -> Iterator[PredicateInfo]:
+        capacity, *_ = self._read_header()
+        for line, column, type_index, used, s, f, s_obs, f_obs in STORE_RECORD.iter_unpack(
+            self.map[STORE_HEADER_SIZE : STORE_HEADER_SIZE + capacity * STORE_RECORD.size]
+        ):
+            if used:
+                info = PredicateInfo(
+                    Predicate(
+                        line=line,
+                        column=column,
+                        value=PredicateType.ALL_TYPES[type_index],
+                    )
+                )
+                info.s, info.f, info.s_obs, info.f_obs = s, f, s_obs, f_obs
+                yield info
+
+    def _find(self, capacity: int, line: int, column: int, type_index: int):
+        """
+        Find the record of a predicate, or the free slot for it.
+
+        :return: The offset of the slot and its record.
+        """
+        mask = capacity - 1
+        slot = predicate_hash(line, column, type_index) & mask
+        while True:
+            offset = STORE_HEADER_SIZE + slot * STORE_RECORD.size
+            record = STORE_RECORD.unpack_from(self.map, offset)
+            if not record[3] or record[:3] == (line, column, type_index):
+                return offset, record
+            slot = (slot + 1) & mask
+
+    def _grow(self, size: int) -> int:
+        """
+        Double the table until size predicates keep it half full, and insert
+        the records again.
+
+        :return: The new capacity.
+        """
+        capacity, _, num_success, num_failure = self._read_header()
+        records = [
+            record
+            for record in STORE_RECORD.iter_unpack(
+                self.map[STORE_HEADER_SIZE : STORE_HEADER_SIZE + capacity * STORE_RECORD.size]
+            )
+            if record[3]
+        ]
+        while size * 2 > capacity:
+            capacity *= 2
+        self._commit(
+            capacity, len(records), num_success, num_failure, records, replace=True
+        )
+        return capacity
+
+    def _commit(
+        self,
+        capacity: int,
+        size: int,
+        num_success: int,
+        num_failure: int,
+        records: List[tuple],
+        replace: bool = False,
+    ) -> None:
+        """
+        Write records to a table of the given capacity, with the header that
+        goes with them, all or nothing.
+
+        The records are staged after the table and flushed before the header
+        commits them, see _finish_staged.
+
+        :param replace: Whether the records replace the table, as when it
+            grows, instead of updating the records of their predicates.
+        """
+        old_capacity, *_ = self._read_header()
+        table_end = STORE_HEADER_SIZE + old_capacity * STORE_RECORD.size
+        staging = STORE_HEADER_SIZE + capacity * STORE_RECORD.size
+        self.map.close()
+        self.map = None
+        # Drop what an earlier change that did not get to its header left
+        # after the table, so that a new part of the table starts out empty.
+        os.ftruncate(self.fd, table_end)
+        os.ftruncate(self.fd, staging + len(records) * STORE_RECORD.size)
+        self._remap()
+        self.map[staging:] = b"".join(STORE_RECORD.pack(*record) for record in records)
+        self.map.flush()
+        # From here on, the change is finished from the staged records even if
+        # this process dies.
+        self._write_header(
+            capacity,
+            size,
+            num_success,
+            num_failure,
+            staged=len(records),
+            replace=replace,
+        )
+        self.map.flush()
+        self._finish_staged()
+
+    def _finish_staged(self) -> None:
+        """
+        Write the records staged by _commit to the table, then drop them.
+        Does nothing if no change is pending. Finishing a change again after a
+        crash gives the same table, as the staged records hold the counters
+        of their predicates and not increments.
+        """
+        (
+            _,
+            _,
+            capacity,
+            size,
+            staged,
+            num_success,
+            num_failure,
+            replace,
+        ) = STORE_HEADER.unpack_from(self.map)
+        if not staged:
+            return
+        staging = STORE_HEADER_SIZE + capacity * STORE_RECORD.size
+        records = list(
+            STORE_RECORD.iter_unpack(
+                self.map[staging : staging + staged * STORE_RECORD.size]
+            )
+        )
+        if replace:
+            self.map[STORE_HEADER_SIZE:staging] = bytes(staging - STORE_HEADER_SIZE)
+        for record in records:
+            offset, _ = self._find(capacity, *record[:3])
+            STORE_RECORD.pack_into(self.map, offset, *record)
+        self.map.flush()
+        self._write_header(capacity, size, num_success, num_failure)
+        self.map.flush()
+        self.map.close()
+        self.map = None
+        os.ftruncate(self.fd, staging)
+        self._remap()
+
+
+class _FileLock:
+    """
+    Exclusive lock on a file for the duration of a with block.
+    """
+
+    def __init__(self, fd: int):
+        self.fd = fd
+
+    def __enter__(self):
+        fcntl.flock(self.fd, fcntl.LOCK_EX)
+
+    def __exit__(self, *_):
+        fcntl.flock(self.fd, fcntl.LOCK_UN)
+
+
+def main() -> int:
+    """
+    Usage:
+    cbi-store [store] add [target] [success|failure] [log files...]
+    cbi-store [store] report [limit]
+
+    The logs of add are runs of target, whose prune map, if it was built with
+    one, completes them, see cbi.prune.
+    """
+    if len(sys.argv) < 3 or sys.argv[2] not in ("add", "report"):
+        print(main.__doc__.strip(), file=sys.stderr)
+        return 1
+    with CBIStore(sys.argv[1]) as store:
+        if sys.argv[2] == "add":
+            if len(sys.argv) < 5 or sys.argv[4] not in ("success", "failure"):
+                print(main.__doc__.strip(), file=sys.stderr)
+                return 1
+            prune_map = get_prune_map(sys.argv[3])
+            for log_file in sys.argv[5:]:
+                store.add_log_file(
+                    Path(log_file),
+                    failed=sys.argv[4] == "failure",
+                    prune_map=prune_map,
+                )
+            return 0
+        limit = int(sys.argv[3]) if len(sys.argv) > 3 else None
+        num_runs = store.num_runs
+        print(f"{num_runs['success']} successful runs, {num_runs['failure']} failing runs")
+        for info in store.ranked(limit):
+            print(f"{info.predicate}: {info.increase}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,9 +1,11 @@
 #! /usr/bin/env python3
 
 import json
+import os
+import struct
 
 from contextlib import suppress
-from typing import Dict, List, Tuple, Union
+from typing import Dict, List, Optional, Sequence, Tuple, Union
 from pathlib import Path
 from subprocess import run, PIPE
 from sys import stderr
@@ -12,21 +14,61 @@ from tqdm import tqdm
 
 from cbi.data_format import CBILog, CBILogEntry
 
+try:
+    from cbi._aggregate import TargetRunner, collect
+except ImportError:
+    # The extension is optional, see setup.py.
+    TargetRunner = collect = None
 
-def run_target(target: str, input: Union[str, bytes]) -> int:
+# Runners of run_target by target and modification time, which keep the fork
+# server of the target across runs.
+_runners: Dict[Tuple[str, int], "TargetRunner"] = {}
+
+
+def get_runner(target: str) -> Optional["TargetRunner"]:
+    """
+    Get the native runner of the target, None without the extension.
+    """
+    if TargetRunner is None:
+        return None
+    key = (str(target), os.stat(target).st_mtime_ns)
+    if key not in _runners:
+        _runners[key] = TargetRunner(target)
+    return _runners[key]
+
+
+def run_target(
+    target: str, input: Union[str, bytes], log_prefix: Optional[Path] = None
+) -> int:
     """
     Run the target program with input on its stdin.
+
+    With the native extension, the input is delivered through a memfd and
+    the run is forked from a fork server of the target if it has one, see
+    src/PyTargetRunner.cpp.
+
     :param target: The target program to run.
     :param input: The input to pass to the target program.
-    :return: The return code of the target program.
+    :param log_prefix: If set, the runtime writes its logs to log_prefix
+        followed by their extension instead of next to the target.
+    :return: The return code of the target program, 128 + signal number if
+        it was killed by a signal, with or without the extension.
     """
+    runner = get_runner(target)
+    if runner is not None:
+        return runner.run(input, log_prefix)
     if isinstance(input, str):
         input = input.encode()
+    env = None
+    if log_prefix is not None:
+        env = dict(os.environ, INSTR_LOG=str(log_prefix).replace("%", "%%"))
+        env.pop("INSTR_LOG_FD", None)
     process = run(
         [target],
         input=input,
         stdout=PIPE,
         stderr=PIPE,
+        env=env,
     )
 
     # Debug information
@@ -35,87 +77,276 @@ def run_target(target: str, input: Union[str, bytes]) -> int:
     #     f"out:\n{process.stdout}\n"
     #     f"err:\n{process.stderr}"
     # )
+    if process.returncode < 0:
+        # Killed by a signal, report it as a shell and the extension do.
+        return 128 - process.returncode
     return process.returncode
 
 
+def run_targets(
+    target: str, inputs: Sequence[Union[str, bytes]], jobs: Optional[int] = None
+) -> List[int]:
+    """
+    Run the target program with every input on its stdin.
+
+    With the native extension, the inputs run on parallel runners, and one at
+    a time with run_target otherwise.
+
+    :param target: The target program to run.
+    :param inputs: The inputs to pass to the target program.
+    :param jobs: Number of parallel runs, one per hardware thread by default.
+    :return: The return codes of the inputs.
+    """
+    runner = get_runner(target)
+    if runner is not None:
+        return runner.run_batch(inputs, jobs or 0)
+    return [run_target(target, input) for input in inputs]
+
+
 CBI_EXTENSION = ".cbi.jsonl"
+CBI_BIN_EXTENSION = ".cbi.bin"
 
+# Predicate counts of a run, see include/CBIFormat.h.
+CBI_FILE_MAGIC = 0x544E554F43494243
+CBI_FILE_HEADER = struct.Struct("=QII")
+CBI_RECORD = struct.Struct("=iiiIQQ")
 
-def get_log_data_for_dir(
+# Kind and a representative value of every CBIPredicateType.
+CBI_PREDICATE_ENTRIES = [
+    ("branch", True),
+    ("branch", False),
+    ("return", 1),
+    ("return", 0),
+    ("return", -1),
+]
+
+# Header of the ring files of the runtime, see include/LogCore.h.
+LOGCORE_MAGIC = 0x474E495252474F4C
+LOGCORE_HEADER = struct.Struct("=QQQ")
+LOGCORE_HEADER_SIZE = 64
+
+
+def recover_ring_files(log_file: Path) -> None:
+    """
+    Append the events left in the ring files of killed runs to their log.
+
+    The runtime buffers events in <log>.<pid>.ring and drains them at exit
+    and on crashes, a run killed by an uncaught signal leaves them there.
+    Every run logs to files of its own, so the ring files of log_file belong
+    to a run that is over.
+
+    :param log_file: The log the ring files belong to.
+    """
+    for ring_file in log_file.parent.glob(log_file.name + ".*.ring"):
+        data = ring_file.read_bytes()
+        if len(data) >= LOGCORE_HEADER_SIZE:
+            magic, _, length = LOGCORE_HEADER.unpack_from(data)
+            if magic == LOGCORE_MAGIC:
+                with log_file.open("ab") as fp:
+                    fp.write(data[LOGCORE_HEADER_SIZE:][:length])
+        with suppress(FileNotFoundError):
+            ring_file.unlink()
+
+
+def read_cbi_bin(path: Path) -> CBILog:
+    """
+    Read the predicate counts written by a target built with -cbi-counters.
+
+    :param path: The .cbi.bin file of the run.
+    :return: A CBILog with one entry per predicate that was observed true,
+        which is all that the analysis uses from a JSON log.
+    """
+    data = path.read_bytes()
+    magic, _, count = CBI_FILE_HEADER.unpack_from(data)
+    if magic != CBI_FILE_MAGIC:
+        raise ValueError(f"{path} is not a CBI counts file")
+    log: CBILog = []
+    for line, column, pred_type, _, _, true_count in CBI_RECORD.iter_unpack(
+        data[CBI_FILE_HEADER.size :][: count * CBI_RECORD.size]
+    ):
+        if true_count > 0:
+            kind, value = CBI_PREDICATE_ENTRIES[pred_type]
+            log.append(CBILogEntry(kind=kind, line=line, column=column, value=value))
+    return log
+
+
+def read_log(path: Path) -> CBILog:
+    """
+    Read the log of a run, a .cbi.jsonl or a .cbi.bin file.
+
+    :param path: The log file, a missing file is a run without predicates.
+    :return: The CBILog of the run.
+    """
+    if path.suffix == ".bin":
+        return read_cbi_bin(path)
+    if not path.exists():
+        return []
+    with path.open("r") as fp:
+        # Parse all lines in the log file
+        return [CBILogEntry(**json.loads(log_entry)) for log_entry in fp.readlines()]
+
+
+def get_inputs(input_dir: Path) -> List[Path]:
+    """
+    Get the input files in input_dir, leaving out the logs next to them.
+    """
+    return [
+        file
+        for file in input_dir.glob("input*")
+        if file.is_file() and len(file.suffixes) == 0
+    ]
+
+
+def get_log_file(input_file: Path) -> Path:
+    """
+    Get the log that the run of input_file left next to it, to be read by read_log.
+    """
+    bin_file = input_file.with_suffix(CBI_BIN_EXTENSION)
+    return bin_file if bin_file.exists() else input_file.with_suffix(CBI_EXTENSION)
+
+
+def check_return_codes(
+    inputs: List[Path], return_codes: List[int], expected_return_code: int
+) -> None:
+    """
+    Check that the runs of inputs returned expected_return_code.
+    """
+    for input_file, return_code in zip(inputs, return_codes):
+        assert (
+            return_code == expected_return_code
+        ), f"return_code didn't match expected value: {expected_return_code}"
+
+
+def get_log_files_for_dir(
     target: str, input_dir: Path, expected_return_code: int = 0
-) -> List[CBILog]:
+) -> List[Path]:
     """
-    Get the logs for the target program on the input files in the input_dir.
+    Run the target program on the input files in the input_dir.
 
     :param target: The target program to run.
     :param input_dir: The directory containing the input files.
     :param expected_return_code: The expected return code of the target program.
-    :return: A list of CBILogs, one for every file in input_dir.
+    :return: The log file of every file in input_dir, to be read by read_log.
     """
-    log_file = Path(target).with_suffix(CBI_EXTENSION)
-
-    # Clean up old file if necessary
-    with suppress(FileNotFoundError):
-        log_file.unlink()
-
     progress_bar = tqdm(
-        [
-            file
-            for file in input_dir.glob("input*")
-            if file.is_file() and len(file.suffixes) == 0
-        ],
+        get_inputs(input_dir),
         desc=f"Processing {input_dir}",
         dynamic_ncols=True,
     )
 
-    log_data: List[CBILog] = list()
+    log_files: List[Path] = list()
     for file in progress_bar:
-        #  Run the target program with file
+        # Run the target program with file, logging next to it.
+        log_file = file.with_suffix(CBI_EXTENSION)
+        bin_file = file.with_suffix(CBI_BIN_EXTENSION)
+        for old_file in (log_file, bin_file):
+            with suppress(FileNotFoundError):
+                old_file.unlink()
         with open(file, "rb") as fp:
-            return_code = run_target(target=target, input=fp.read())
+            return_code = run_target(
+                target=target, input=fp.read(), log_prefix=file
+            )
             assert (
                 return_code == expected_return_code
             ), f"return_code didn't match expected value: {expected_return_code}"
 
-        if not log_file.exists():
-            log_data.append([])
-        else:
-            # Move the log file to appropriate location.
-            log_save_location = file.with_suffix(CBI_EXTENSION)
-            log_file.rename(log_save_location)
-            with log_save_location.open("r") as fp:
-                # Parse all lines in the log file and add them to the log_data
-                log_data.append(
-                    [CBILogEntry(**json.loads(log_entry)) for log_entry in fp.readlines()]
-                )
-    return log_data
+        recover_ring_files(log_file)
+        # Only the predicates are needed, drop the coverage of the run.
+        with suppress(FileNotFoundError):
+            file.with_suffix(".cov").unlink()
+        log_files.append(get_log_file(file))
+    return log_files
 
 
-def get_logs(target: str, fuzz_dir: Path) -> Tuple[List[CBILog], List[CBILog]]:
+def get_log_data_for_dir(
+    target: str, input_dir: Path, expected_return_code: int = 0
+) -> List[CBILog]:
     """
-    Get all the logs for the target program.
-
-    Runs the target program with each input file under fuzz_dir to generate .cbi.jsonl files.
-    Parses the .cbi.jsonl files and returns two lists of CBILogs.
+    Get the logs for the target program on the input files in the input_dir.
 
     :param target: The target program to run.
-    :param fuzz_dir: The directory containing the fuzzer output.
-    :return: Two lists of CBILogs,
-        The first list contains logs for successful runs,
-        and second list contains logs for failed runs.
+    :param input_dir: The directory containing the input files.
+    :param expected_return_code: The expected return code of the target program.
+    :return: A list of CBILogs, one for every file in input_dir.
+    """
+    return [
+        read_log(log_file)
+        for log_file in get_log_files_for_dir(
+            target=target, input_dir=input_dir, expected_return_code=expected_return_code
+        )
+    ]
+
+
+def get_input_dirs(fuzz_dir: Path) -> Tuple[Path, Path]:
+    """
+    Get the directories of the successful and the failing inputs under fuzz_dir.
     """
     success_dir = fuzz_dir / "success"
     failure_dir = fuzz_dir / "failure"
 
     success_dir.mkdir(parents=True, exist_ok=True)
     failure_dir.mkdir(parents=True, exist_ok=True)
+    return success_dir, failure_dir
+
+
+def get_log_files(
+    target: str, fuzz_dir: Path, jobs: Optional[int] = None
+) -> Tuple[List[Path], List[Path]]:
+    """
+    Run the target program with each input file under fuzz_dir to generate
+    its logs, without reading them.
+
+    With the native extension, the inputs run on parallel workers, see
+    src/CBICollect.cpp, and one at a time otherwise.
+
+    :param target: The target program to run.
+    :param fuzz_dir: The directory containing the fuzzer output.
+    :param jobs: Number of parallel runs, one per hardware thread by default.
+    :return: Two lists of log files,
+        The first list contains logs of successful runs,
+        and second list contains logs of failed runs.
+    """
+    success_dir, failure_dir = get_input_dirs(fuzz_dir)
 
     print("Collecting cbi logs...", file=stderr)
-    success_logs = get_log_data_for_dir(
+    if collect is not None:
+        success_inputs = get_inputs(success_dir)
+        failure_inputs = get_inputs(failure_dir)
+        success_codes, failure_codes, _ = collect(
+            target, success_inputs, failure_inputs, jobs=jobs or 0
+        )
+        check_return_codes(success_inputs, success_codes, 0)
+        check_return_codes(failure_inputs, failure_codes, 1)
+        return (
+            [get_log_file(file) for file in success_inputs],
+            [get_log_file(file) for file in failure_inputs],
+        )
+
+    success_logs = get_log_files_for_dir(
         target=target, input_dir=success_dir, expected_return_code=0
     )
-    failure_logs = get_log_data_for_dir(
+    failure_logs = get_log_files_for_dir(
         target=target, input_dir=failure_dir, expected_return_code=1
     )
 
     return success_logs, failure_logs
+
+
+def get_logs(target: str, fuzz_dir: Path) -> Tuple[List[CBILog], List[CBILog]]:
+    """
+    Get all the logs for the target program.
+
+    Runs the target program with each input file under fuzz_dir to generate .cbi.jsonl files.
+    Parses the .cbi.jsonl files and returns two lists of CBILogs.
+
+    :param target: The target program to run.
+    :param fuzz_dir: The directory containing the fuzzer output.
+    :return: Two lists of CBILogs,
+        The first list contains logs for successful runs,
+        and second list contains logs for failed runs.
+    """
+    success_files, failure_files = get_log_files(target=target, fuzz_dir=fuzz_dir)
+    return (
+        [read_log(log_file) for log_file in success_files],
+        [read_log(log_file) for log_file in failure_files],
+    )
@@ -0,0 +1,105 @@
+#ifndef CBI_AGGREGATE_H
+#define CBI_AGGREGATE_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Parts of the cbi._aggregate extension module shared by the aggregation of
+ * logs, src/CBIAggregate.cpp, and the collection of logs from runs of the
+ * target, src/CBICollect.cpp.
+ */
+
+struct Counters {
+  uint64_t S = 0;
+  uint64_t F = 0;
+  uint64_t SObs = 0;
+  uint64_t FObs = 0;
+
+  void merge(const Counters &Other) {
+    S += Other.S;
+    F += Other.F;
+    SObs += Other.SObs;
+    FObs += Other.FObs;
+  }
+};
+
+// Observation flags of the predicates of one run.
+using RunMap = std::unordered_map<uint64_t, uint8_t>;
+// Counters of predicates over many runs.
+using CounterMap = std::unordered_map<uint64_t, Counters>;
+
+/**
+ * A predicate of a site left uninstrumented by -cbi-prune, see cbi/prune.py.
+ * It is observed when its source site is, and true when one of the source
+ * predicates in Mask, of 1 << CBIPredicateType, is true.
+ */
+struct DerivedPredicate {
+  uint64_t Key;
+  int SourceLine;
+  int SourceCol;
+  bool SourceIsBranch;
+  unsigned Mask;
+};
+
+using PruneMap = std::vector<DerivedPredicate>;
+
+/**
+ * @brief Read a prune map from a sequence of (line, column, type,
+ * source line, source column, source is a branch, mask) tuples, as
+ * cbi.prune.native_prune_map returns it, or from None.
+ */
+bool parsePruneMap(PyObject *Sequence, PruneMap &Map);
+
+/**
+ * @brief Add the predicates of the pruned sites to the predicates of a run.
+ */
+void expandRun(const PruneMap &Map, RunMap &Run);
+
+/**
+ * @brief Read a whole file into Data.
+ *
+ * @return 0, or the errno of the failure.
+ */
+int readFile(const std::string &Path, std::string &Data);
+
+/**
+ * @brief Collect the predicates that a run observed from its .cbi.jsonl or
+ * .cbi.bin log. A log that does not exist is a run without any predicate.
+ *
+ * @param Path Path to the log.
+ * @param Data Buffer to read the log into.
+ * @param Run Map to store the predicates of the run.
+ * @param Error Message to set on failure.
+ * @return false if the log cannot be read or is malformed.
+ */
+bool readRunLog(const std::string &Path, std::string &Data, RunMap &Run,
+                std::string &Error);
+
+/**
+ * @brief Add the predicates of a successful or failing run to Counts.
+ */
+void countRun(const RunMap &Run, bool Failure, CounterMap &Counts);
+
+/**
+ * @brief Sum the counters of every thread into a list of
+ * (line, column, type, s, f, s_obs, f_obs) tuples, sorted by predicate.
+ */
+PyObject *buildPredicateList(const std::vector<CounterMap> &Maps);
+
+/**
+ * @brief Append the paths of a sequence of str or os.PathLike to Paths.
+ */
+bool appendPaths(PyObject *Sequence, std::vector<std::string> &Paths);
+
+/**
+ * @brief collect(), see src/CBICollect.cpp.
+ */
+PyObject *collect(PyObject *Self, PyObject *Args, PyObject *Kwargs);
+
+#endif // CBI_AGGREGATE_H
@@ -0,0 +1,55 @@
+#ifndef CBI_FORMAT_H
+#define CBI_FORMAT_H
+
+#include <stdint.h>
+
+/**
+ * Predicate counts of a run, written to <exe>.cbi.bin by modules built with
+ * -cbi-counters.
+ *
+ * CBIInstrument gives the predicates of every function dense ids and emits
+ * a table of CBIPredicate, as the LLVM type { i32, i32, i32 }, with an array
+ * of two i64 counters per predicate: the number of times its site was
+ * observed and the number of times the predicate was true. A branch site has
+ * the BranchTrue and BranchFalse predicates, a return site the three
+ * Return ones, with consecutive ids.
+ *
+ * At exit, or when the program crashes, the runtime writes a CBIFileHeader
+ * followed by a CBIRecord for every predicate of the registered tables, in
+ * native byte order. Predicates of sites that were never observed have zero
+ * counts.
+ */
+
+#define CBI_FILE_MAGIC 0x544e554f43494243ULL /* "CBICOUNT" */
+#define CBI_FILE_VERSION 1
+
+enum CBIPredicateType {
+  CBI_BRANCH_TRUE,
+  CBI_BRANCH_FALSE,
+  CBI_RETURN_POSITIVE,
+  CBI_RETURN_ZERO,
+  CBI_RETURN_NEGATIVE,
+};
+
+struct CBIPredicate {
+  int32_t Line;
+  int32_t Col;
+  int32_t Type;
+};
+
+struct CBIFileHeader {
+  uint64_t Magic;
+  uint32_t Version;
+  uint32_t Count; /* number of records */
+};
+
+struct CBIRecord {
+  int32_t Line;
+  int32_t Col;
+  int32_t Type;
+  uint32_t Padding;
+  uint64_t Observed;
+  uint64_t True;
+};
+
+#endif // CBI_FORMAT_H
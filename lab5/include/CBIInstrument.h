@@ -14,6 +14,7 @@ struct CBIInstrument : public FunctionPass {
 
   CBIInstrument() : FunctionPass(ID) {}
 
+  bool doInitialization(Module &M) override;
   bool runOnFunction(Function &F) override;
 };
 } // namespace instrument
@@ -0,0 +1 @@
+../../common/include/LogCore.h
\ No newline at end of file
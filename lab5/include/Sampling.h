@@ -0,0 +1,53 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <set>
+
+using namespace llvm;
+
+/**
+ * @brief Split F into acyclic regions that each have an uninstrumented fast
+ * path copy and a slow path copy to be instrumented, chosen at region entry
+ * by a countdown of the sites left until the next sample.
+ *
+ * Regions start at the function entry, at the targets of back edges and
+ * after calls to functions defined in the module, which may consume the
+ * countdown themselves. Without those, every path from a region entry is
+ * acyclic and has at most W sites, W being the weight of the region. The
+ * region entry checks Countdown: if it is above W, no site of the region can
+ * be sampled and the fast path runs, decrementing Countdown by the number of
+ * sites of every block in one subtraction. Otherwise, the slow path runs,
+ * whose sites decrement Countdown one by one and draw the next countdown.
+ *
+ * A site right after a call that ends a region, such as the return value of
+ * the call, runs after the sites of the callee and is not covered by any
+ * region check. Such sites must not be counted by CountSites and must count
+ * Countdown down themselves in both copies.
+ *
+ * Values live across blocks are first demoted to stack slots, so that
+ * control can switch between the two copies at region boundaries.
+ * Functions with exception handling pads are left unchanged.
+ *
+ * @param F Function to transform.
+ * @param Countdown Thread-local i32 countdown.
+ * @param CountSites Number of sites of a block, the sites that are
+ *        instrumented in its slow path copy afterwards.
+ * @param SlowBlocks Set to store the slow path copies.
+ * @return true if F was transformed.
+ */
+bool createSamplingRegions(Function &F, GlobalVariable *Countdown,
+                           function_ref<unsigned(BasicBlock &)> CountSites,
+                           std::set<BasicBlock *> &SlowBlocks);
+
+/**
+ * @brief Check if a call ends a sampling region: it may run sites of other
+ * functions, which consume the countdown. External functions are not
+ * instrumented.
+ */
+bool endsSamplingRegion(CallInst *Call);
+
+#endif // SAMPLING_H
@@ -1,10 +1,35 @@
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "CBIFormat.h"
+#include "ForkServer.h"
+#include "LogCore.h"
+
 const int STR_MAX_SIZE = 1024;
 
+static void append_path(char *buf, int buf_size, int *len, const char *str) {
+  int ret = snprintf(buf + *len, buf_size - *len, "%s", str);
+  *len = ret < buf_size - *len ? *len + ret : buf_size - 1;
+}
+
+/**
+ * Get the log file of the given extension, <exe><ext> by default.
+ *
+ * INSTR_LOG overrides it with a directory, the log then is
+ * <dir>/<exe name><ext>, or with a pattern in which %p is replaced by the
+ * pid, %e by the executable name, %x by ext and %% by %. ext is appended to
+ * patterns without %x, so that the logs of a run don't collide.
+ */
 void get_logfile(char *buf, const int buf_size, const char *ext) {
   char exe[STR_MAX_SIZE];
   int ret = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
@@ -13,14 +38,295 @@ void get_logfile(char *buf, const int buf_size, const char *ext) {
     exit(1);
   }
   exe[ret] = 0;
+  const char *name = strrchr(exe, '/');
+  name = name != NULL ? name + 1 : exe;
+
+  const char *pattern = getenv("INSTR_LOG");
+  struct stat st;
+  if (pattern == NULL || *pattern == 0) {
+    snprintf(buf, buf_size, "%s%s", exe, ext);
+    return;
+  }
+  if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode)) {
+    snprintf(buf, buf_size, "%s/%s%s", pattern, name, ext);
+    return;
+  }
+
+  char pid[16];
+  snprintf(pid, sizeof(pid), "%d", (int)getpid());
+  int len = 0;
+  int has_ext = 0;
+  buf[0] = 0;
+  for (const char *c = pattern; *c != 0; ++c) {
+    char literal[2] = {*c, 0};
+    const char *part = literal;
+    if (*c == '%' && c[1] != 0) {
+      literal[0] = *++c;
+      if (*c == 'p') {
+        part = pid;
+      } else if (*c == 'e') {
+        part = name;
+      } else if (*c == 'x') {
+        part = ext;
+        has_ext = 1;
+      }
+    }
+    append_path(buf, buf_size, &len, part);
+  }
+  if (!has_ext) {
+    append_path(buf, buf_size, &len, ext);
+  }
+}
+
+/**
+ * Get the fd inherited for the log of the given extension, -1 if none.
+ * INSTR_LOG_FD lists them as <ext>=<fd> separated by commas, with ext
+ * without its dot, e.g. cov=3,binops=4. It takes precedence over INSTR_LOG.
+ */
+static int get_logfd(const char *ext) {
+  const char *list = getenv("INSTR_LOG_FD");
+  if (*ext == '.') {
+    ++ext;
+  }
+  size_t ext_len = strlen(ext);
+  while (list != NULL && *list != 0) {
+    if (strncmp(list, ext, ext_len) == 0 && list[ext_len] == '=') {
+      int fd = atoi(list + ext_len + 1);
+      return fcntl(fd, F_GETFD) != -1 ? fd : -1;
+    }
+    list = strchr(list, ',');
+    if (list != NULL) {
+      ++list;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Coverage and predicate events go through ring files that are drained at
+ * exit and on crashes, see LogCore.h.
+ */
+static struct logcore cov_log;
+static struct logcore cbi_log;
+
+/**
+ * Modules built with -cbi-sample only report a site when the thread's
+ * __cbi_countdown of sites runs out, which happens for every site execution
+ * with probability CBI_SAMPLE_RATE (default 1/100, also accepts decimals).
+ * Countdowns are drawn from the matching geometric distribution. The first
+ * site execution of a thread draws its first countdown, and is sampled with
+ * the same probability as any other.
+ */
+__thread int __cbi_countdown __attribute__((tls_model("initial-exec"))) = 0;
+static double sample_log = 0; /* log(1 - rate), 0 to sample every site */
+static __thread unsigned long long sample_state = 0;
+static __thread int countdown_drawn = 0;
+static pthread_once_t sample_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Predicate tables registered by functions built with -cbi-counters. Their
+ * counts are written to <exe>.cbi.bin once, at exit or from the crash
+ * handler, see CBIFormat.h.
+ */
+struct cbi_counters {
+  unsigned long long *counters; /* observed and true count per predicate */
+  const struct CBIPredicate *predicates;
+  int count;
+  struct cbi_counters *next;
+};
+static struct cbi_counters *all_counters = NULL;
+static char counters_file[1024];
+static int counters_dumped = 0;
+
+/**
+ * Write the counts of all registered predicates.
+ * Only uses async-signal-safe functions.
+ */
+static void dump_counters(void) {
+  struct cbi_counters *table =
+      __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+  if (table == NULL || __atomic_exchange_n(&counters_dumped, 1,
+                                           __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  struct CBIFileHeader header = {CBI_FILE_MAGIC, CBI_FILE_VERSION, 0};
+  for (struct cbi_counters *t = table; t != NULL; t = t->next) {
+    header.Count += t->count;
+  }
+  int fd = open(counters_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+  if (fd == -1) {
+    return;
+  }
+  logcore_write_fd(fd, (const char *)&header, sizeof(header));
+  struct CBIRecord records[256];
+  int len = 0;
+  for (struct cbi_counters *t = table; t != NULL; t = t->next) {
+    for (int i = 0; i < t->count; ++i) {
+      struct CBIRecord *record = &records[len++];
+      record->Line = t->predicates[i].Line;
+      record->Col = t->predicates[i].Col;
+      record->Type = t->predicates[i].Type;
+      record->Padding = 0;
+      record->Observed = t->counters[2 * i];
+      record->True = t->counters[2 * i + 1];
+      if (len == sizeof(records) / sizeof(records[0])) {
+        logcore_write_fd(fd, (const char *)records, sizeof(records));
+        len = 0;
+      }
+    }
+  }
+  logcore_write_fd(fd, (const char *)records, len * sizeof(records[0]));
+  close(fd);
+}
+
+static const int crash_signals[] = {SIGSEGV, SIGFPE, SIGBUS, SIGILL, SIGABRT};
+static struct sigaction old_actions[sizeof(crash_signals) / sizeof(int)];
+
+static void crash_handler(int sig) {
+  logcore_drain_signal(&cov_log);
+  logcore_drain_signal(&cbi_log);
+  dump_counters();
+  for (int i = 0; i < sizeof(crash_signals) / sizeof(int); ++i) {
+    if (crash_signals[i] == sig) {
+      sigaction(sig, &old_actions[i], NULL);
+    }
+  }
+  raise(sig);
+}
+
+static void close_logs(void) {
+  logcore_close(&cov_log);
+  logcore_close(&cbi_log);
+  dump_counters();
+}
+
+/**
+ * Forget the rings of the parent in a forked child, and move logs named
+ * after the pid to files of the child.
+ */
+static void reset_after_fork(void) {
+  char logfile[STR_MAX_SIZE];
+  // Don't draw the same samples as the parent.
+  sample_state = 0;
+  logcore_after_fork(&cov_log);
+  get_logfile(logfile, sizeof(logfile), ".cov");
+  logcore_init(&cov_log, logfile, cov_log.fd);
+  logcore_after_fork(&cbi_log);
+  get_logfile(logfile, sizeof(logfile), ".cbi.jsonl");
+  logcore_init(&cbi_log, logfile, cbi_log.fd);
+  // The child reports its own predicates only.
+  get_logfile(counters_file, sizeof(counters_file), ".cbi.bin");
+  struct cbi_counters *table =
+      __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+  for (; table != NULL; table = table->next) {
+    memset(table->counters, 0, 2 * table->count * sizeof(*table->counters));
+  }
+  counters_dumped = 0;
+}
+
+/**
+ * Parse a sampling rate written as 1/N or as a decimal.
+ */
+static double parse_rate(const char *rate) {
+  const char *slash = strchr(rate, '/');
+  if (slash != NULL) {
+    double denominator = atof(slash + 1);
+    return denominator != 0 ? atof(rate) / denominator : 0;
+  }
+  return atof(rate);
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *pos = buf;
+  while (len > 0) {
+    ssize_t ret = read(fd, pos, len);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return -1;
+    }
+    pos += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/**
+ * Serve the runs requested on INSTR_FORKSRV_FD, see ForkServer.h.
+ * Only returns in the children, and in targets run without a fork server.
+ */
+static void run_fork_server(void) {
+  const char *env = getenv(FORKSRV_ENV);
+  if (env == NULL || *env == 0) {
+    return;
+  }
+  int ctl_fd = atoi(env);
+  int status_fd = ctl_fd + 1;
+  uint32_t hello = FORKSRV_HELLO;
+  if (write(status_fd, &hello, sizeof(hello)) != sizeof(hello)) {
+    return;
+  }
+
+  char logfile[STR_MAX_SIZE];
+  for (;;) {
+    struct ForkServerRequest request;
+    if (read_full(ctl_fd, &request, sizeof(request)) == -1) {
+      _exit(0);
+    }
+    if (request.LogLength >= sizeof(logfile) ||
+        read_full(ctl_fd, logfile, request.LogLength) == -1) {
+      _exit(1);
+    }
+    logfile[request.LogLength] = 0;
+
+    int32_t reply[2] = {fork(), 0};
+    if (reply[0] == 0) {
+      close(ctl_fd);
+      close(status_fd);
+      unsetenv(FORKSRV_ENV);
+      if (request.LogLength > 0) {
+        setenv("INSTR_LOG", logfile, 1);
+      }
+      return;
+    }
+    if (write(status_fd, &reply[0], sizeof(reply[0])) != sizeof(reply[0])) {
+      _exit(1);
+    }
+    if (reply[0] == -1) {
+      // Reported like a shell that cannot run the command.
+      reply[1] = 127 << 8;
+    } else {
+      while (waitpid(reply[0], &reply[1], 0) == -1 && errno == EINTR) {
+      }
+    }
+    if (write(status_fd, &reply[1], sizeof(reply[1])) != sizeof(reply[1])) {
+      _exit(1);
+    }
+  }
+}
+
+__attribute__((constructor)) static void runtime_init(void) {
+  // Every run of a fork server opens its own logs as if it was exec'd.
+  run_fork_server();
+
+  char logfile[STR_MAX_SIZE];
+  get_logfile(logfile, sizeof(logfile), ".cov");
+  logcore_init(&cov_log, logfile, get_logfd(".cov"));
+  get_logfile(logfile, sizeof(logfile), ".cbi.jsonl");
+  logcore_init(&cbi_log, logfile, get_logfd(".cbi.jsonl"));
+  get_logfile(counters_file, sizeof(counters_file), ".cbi.bin");
+  atexit(close_logs);
+  pthread_atfork(NULL, NULL, reset_after_fork);
 
-  int len = strlen(exe);
-  strncpy(buf, exe, len);
-  buf[len] = 0;
-  for (int i = 0; i <= strlen(ext); ++i) {
-    buf[buf_size - (i + 1)] = 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crash_handler;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < sizeof(crash_signals) / sizeof(int); ++i) {
+    sigaction(crash_signals[i], &action, &old_actions[i]);
   }
-  strncat(buf, ext, strlen(ext));
 }
 
 void __sanitize__(int divisor, int line, int col) {
@@ -31,31 +337,165 @@ void __sanitize__(int divisor, int line, int col) {
 }
 
 void __coverage__(int line, int col) {
-  char logfile[STR_MAX_SIZE];
-  get_logfile(logfile, sizeof(logfile), ".cov");
-  FILE *f = fopen(logfile, "a");
-  fprintf(f, "%d,%d\n", line, col);
-  fclose(f);
+  char event[32];
+  int len = snprintf(event, sizeof(event), "%d,%d\n", line, col);
+  logcore_append(&cov_log, event, len);
 }
 
 void __cbi_branch__(int line, int col, int cond) {
-  char logfile[STR_MAX_SIZE];
-  get_logfile(logfile, sizeof(logfile), ".cbi.jsonl");
-  FILE *f = fopen(logfile, "a");
-  fprintf(
-      f,
+  char event[128];
+  int len = snprintf(
+      event, sizeof(event),
       "{\"kind\": \"branch\", \"line\": %d, \"column\": %d, \"value\": %s}\n",
       line, col, cond ? "true" : "false");
-  fclose(f);
+  logcore_append(&cbi_log, event, len);
 }
 
 void __cbi_return__(int line, int col, int rv) {
-  char logfile[STR_MAX_SIZE];
-  get_logfile(logfile, sizeof(logfile), ".cbi.jsonl");
-  FILE *f = fopen(logfile, "a");
-  fprintf(
-      f,
+  char event[128];
+  int len = snprintf(
+      event, sizeof(event),
       "{\"kind\": \"return\", \"line\": %d, \"column\": %d, \"value\": %d}\n",
       line, col, rv);
-  fclose(f);
+  logcore_append(&cbi_log, event, len);
+}
+
+static unsigned long long next_random(void) {
+  if (sample_state == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // splitmix64 finalizer, so that close seeds give unrelated streams.
+    unsigned long long seed = (unsigned long long)now.tv_nsec ^
+                              ((unsigned long long)getpid() << 32) ^
+                              (unsigned long long)(size_t)&sample_state;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+    sample_state = (seed ^ (seed >> 31)) | 1;
+  }
+  // xorshift64*
+  sample_state ^= sample_state >> 12;
+  sample_state ^= sample_state << 25;
+  sample_state ^= sample_state >> 27;
+  return sample_state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Read CBI_SAMPLE_RATE, on the first sampled site so that a bad value does
+ * not affect programs built without -cbi-sample. A bad value falls back to
+ * the default rate with a warning.
+ */
+static void init_sampling(void) {
+  const char *sample_rate = getenv("CBI_SAMPLE_RATE");
+  double rate = 0.01;
+  if (sample_rate != NULL && *sample_rate != 0) {
+    double value = parse_rate(sample_rate);
+    if (value > 0 && value <= 1) {
+      rate = value;
+    } else {
+      fprintf(stderr, "Warning: CBI_SAMPLE_RATE must be in (0, 1], "
+                      "using 1/100\n");
+    }
+  }
+  sample_log = rate < 1 ? log1p(-rate) : 0;
+}
+
+/**
+ * Draw the number of site executions until the next sample, this one
+ * included.
+ */
+static int next_countdown(void) {
+  pthread_once(&sample_once, init_sampling);
+  if (sample_log == 0) {
+    return 1;
+  }
+  // Uniform in (0, 1].
+  double u = ((next_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+  double countdown = floor(log(u) / sample_log) + 1;
+  return countdown < INT_MAX ? (int)countdown : INT_MAX;
+}
+
+/**
+ * Count a site execution down, and draw the number of site executions until
+ * the next sample when the countdown runs out.
+ *
+ * @return 1 if this execution is sampled.
+ */
+static int sample_site(void) {
+  if (--__cbi_countdown > 0) {
+    return 0;
+  }
+  if (!countdown_drawn) {
+    // The countdown of the thread was never drawn, start it here.
+    countdown_drawn = 1;
+    __cbi_countdown = next_countdown();
+    if (--__cbi_countdown > 0) {
+      return 0;
+    }
+  }
+  __cbi_countdown = next_countdown();
+  return 1;
+}
+
+void __cbi_sampled_branch__(int line, int col, int cond) {
+  if (sample_site()) {
+    __cbi_branch__(line, col, cond);
+  }
+}
+
+void __cbi_sampled_return__(int line, int col, int rv) {
+  if (sample_site()) {
+    __cbi_return__(line, col, rv);
+  }
+}
+
+void __cbi_register__(unsigned long long *counters,
+                      const struct CBIPredicate *predicates, int count) {
+  struct cbi_counters *table = malloc(sizeof(struct cbi_counters));
+  if (table == NULL) {
+    fprintf(stderr, "Error: Cannot allocate predicate counters\n");
+    exit(1);
+  }
+  table->counters = counters;
+  table->predicates = predicates;
+  table->count = count;
+  table->next = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&all_counters, &table->next, table, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+/**
+ * Count the BranchTrue and BranchFalse predicates of a branch, whose
+ * counters start at counters. Racing increments may lose counts.
+ */
+void __cbi_branch_counter__(unsigned long long *counters, int cond) {
+  counters[0]++;
+  counters[1] += cond != 0;
+  counters[2]++;
+  counters[3] += cond == 0;
+}
+
+/**
+ * Count the ReturnPositive, ReturnZero and ReturnNegative predicates of a
+ * return value, whose counters start at counters.
+ */
+void __cbi_return_counter__(unsigned long long *counters, int rv) {
+  counters[0]++;
+  counters[1] += rv > 0;
+  counters[2]++;
+  counters[3] += rv == 0;
+  counters[4]++;
+  counters[5] += rv < 0;
+}
+
+void __cbi_sampled_branch_counter__(unsigned long long *counters, int cond) {
+  if (sample_site()) {
+    __cbi_branch_counter__(counters, cond);
+  }
+}
+
+void __cbi_sampled_return_counter__(unsigned long long *counters, int rv) {
+  if (sample_site()) {
+    __cbi_return_counter__(counters, rv);
+  }
 }
@@ -3,7 +3,7 @@
 import sys
 from os import path
 
-from setuptools import setup, find_packages
+from setuptools import Extension, setup, find_packages
 
 BASE_PATH = path.dirname(path.abspath(__file__))
 
@@ -17,7 +17,29 @@ setup(
     name="cbi",
     python_requires=">=3.6",
     description="Tool for cooperative bug isolation",
-    entry_points={"console_scripts": ["cbi=cbi.__main__:main"]},
+    entry_points={
+        "console_scripts": [
+            "cbi=cbi.__main__:main",
+            "cbi-eliminate=cbi.eliminate:main",
+            "cbi-store=cbi.store:main",
+        ]
+    },
     packages=find_packages(include=["cbi", "cbi.*"]),
     install_requires=requirements,
+    # Optional: without a compiler, cbi falls back to its Python aggregation.
+    ext_modules=[
+        Extension(
+            "cbi._aggregate",
+            sources=[
+                "src/CBIAggregate.cpp",
+                "src/CBICollect.cpp",
+                "src/PyTargetRunner.cpp",
+            ],
+            include_dirs=[f"{BASE_PATH}/include"],
+            extra_compile_args=["-std=c++14", "-O2", "-pthread"],
+            extra_link_args=["-pthread"],
+            language="c++",
+            optional=True,
+        )
+    ],
 )
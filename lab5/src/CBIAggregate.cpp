@@ -0,0 +1,424 @@
+/**
+ * Native aggregation of CBI logs, the cbi._aggregate extension module.
+ *
+ * aggregate(success_logs, failure_logs, threads=0, prune_map=None) takes the paths of the
+ * logs of the successful and the failing runs, .cbi.jsonl or .cbi.bin files,
+ * and returns a list of (line, column, type, s, f, s_obs, f_obs) tuples, one
+ * per predicate of the sites found in the logs. type is a CBIPredicateType,
+ * which is also the index of the type in PredicateType.ALL_TYPES.
+ *
+ * Runs are handed out to the worker threads one at a time. A worker reads
+ * the log of a run, collects the predicates that the run observed and the
+ * ones it observed true, and adds them to its own counters. The counters of
+ * all workers are summed once they are done. A log that does not exist is a
+ * run without any predicate, as in cbi.utils. With a prune map, the
+ * predicates of the sites left uninstrumented by -cbi-prune are derived from
+ * those of their sources, as in cbi.prune.
+ *
+ * The module also provides collect(), which runs the target to produce the
+ * logs, see src/CBICollect.cpp, and the TargetRunner of cbi.utils.run_target,
+ * see src/PyTargetRunner.cpp.
+ */
+
+#include "CBIAggregate.h"
+#include "CBIFormat.h"
+#include "PyTargetRunner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static const uint8_t OBSERVED = 1;
+static const uint8_t OBSERVED_TRUE = 2;
+
+/**
+ * Key of a predicate: line, column and CBIPredicateType.
+ */
+static uint64_t predicateKey(int Line, int Col, int Type) {
+  return ((uint64_t)(uint32_t)Line << 32) | ((uint64_t)(Col & 0x1fffffff) << 3) |
+         (uint64_t)(Type & 7);
+}
+
+static void predicateOfKey(uint64_t Key, int &Line, int &Col, int &Type) {
+  Line = (int)(uint32_t)(Key >> 32);
+  Col = (int)((Key >> 3) & 0x1fffffff);
+  Type = (int)(Key & 7);
+}
+
+static void observe(RunMap &Run, int Line, int Col, int Type, bool True) {
+  Run[predicateKey(Line, Col, Type)] |= OBSERVED | (True ? OBSERVED_TRUE : 0);
+}
+
+/**
+ * Observe all predicates of a site, as PredicateType.alternatives does for a
+ * log entry.
+ */
+static void observeBranch(RunMap &Run, int Line, int Col, bool Value) {
+  observe(Run, Line, Col, CBI_BRANCH_TRUE, Value);
+  observe(Run, Line, Col, CBI_BRANCH_FALSE, !Value);
+}
+
+static void observeReturn(RunMap &Run, int Line, int Col, long Value) {
+  observe(Run, Line, Col, CBI_RETURN_POSITIVE, Value > 0);
+  observe(Run, Line, Col, CBI_RETURN_ZERO, Value == 0);
+  observe(Run, Line, Col, CBI_RETURN_NEGATIVE, Value < 0);
+}
+
+int readFile(const std::string &Path, std::string &Data) {
+  int Fd = open(Path.c_str(), O_RDONLY);
+  if (Fd == -1)
+    return errno;
+  struct stat Stat;
+  if (fstat(Fd, &Stat) == -1) {
+    int Error = errno;
+    close(Fd);
+    return Error;
+  }
+  Data.resize(Stat.st_size);
+  size_t Done = 0;
+  while (Done < Data.size()) {
+    ssize_t Read = read(Fd, &Data[Done], Data.size() - Done);
+    if (Read == -1 && errno == EINTR)
+      continue;
+    if (Read <= 0) {
+      int Error = Read == 0 ? 0 : errno;
+      close(Fd);
+      Data.resize(Done);
+      return Error;
+    }
+    Done += Read;
+  }
+  close(Fd);
+  return 0;
+}
+
+/**
+ * Find the value of a field of a JSON line, such as "line": 3.
+ *
+ * @return the start of the value, or NULL if the line has no such field.
+ */
+static const char *findField(const char *Begin, const char *End,
+                             const char *Name) {
+  size_t Length = strlen(Name);
+  auto *Pos = static_cast<const char *>(memmem(Begin, End - Begin, Name, Length));
+  if (Pos == NULL)
+    return NULL;
+  Pos += Length;
+  while (Pos < End && (*Pos == ' ' || *Pos == ':'))
+    ++Pos;
+  return Pos < End ? Pos : NULL;
+}
+
+static bool parseLong(const char *Pos, const char *End, long &Value) {
+  bool Negative = Pos < End && *Pos == '-';
+  if (Negative)
+    ++Pos;
+  if (Pos == End || *Pos < '0' || *Pos > '9')
+    return false;
+  unsigned long Magnitude = 0;
+  while (Pos < End && *Pos >= '0' && *Pos <= '9')
+    Magnitude = Magnitude * 10 + (*Pos++ - '0');
+  Value = Negative ? -(long)Magnitude : (long)Magnitude;
+  return true;
+}
+
+/**
+ * Collect the predicates of the lines of a .cbi.jsonl log, as written by
+ * lib/runtime.c.
+ */
+static bool parseJsonLog(const std::string &Data, RunMap &Run) {
+  const char *Begin = Data.data();
+  const char *End = Begin + Data.size();
+  while (Begin < End) {
+    auto *LineEnd =
+        static_cast<const char *>(memchr(Begin, '\n', End - Begin));
+    if (LineEnd == NULL)
+      LineEnd = End;
+    if (LineEnd != Begin) {
+      auto *LinePos = findField(Begin, LineEnd, "\"line\"");
+      auto *ColPos = findField(Begin, LineEnd, "\"column\"");
+      auto *ValuePos = findField(Begin, LineEnd, "\"value\"");
+      long Line, Col, Value;
+      if (!LinePos || !ColPos || !ValuePos ||
+          !parseLong(LinePos, LineEnd, Line) ||
+          !parseLong(ColPos, LineEnd, Col))
+        return false;
+      if (*ValuePos == 't' || *ValuePos == 'f')
+        observeBranch(Run, Line, Col, *ValuePos == 't');
+      else if (parseLong(ValuePos, LineEnd, Value))
+        observeReturn(Run, Line, Col, Value);
+      else
+        return false;
+    }
+    Begin = LineEnd + 1;
+  }
+  return true;
+}
+
+/**
+ * Collect the predicates of the observed sites of a .cbi.bin file, see
+ * include/CBIFormat.h.
+ */
+static bool parseBinLog(const std::string &Data, RunMap &Run) {
+  CBIFileHeader Header;
+  if (Data.size() < sizeof(Header))
+    return false;
+  memcpy(&Header, Data.data(), sizeof(Header));
+  if (Header.Magic != CBI_FILE_MAGIC || Header.Version != CBI_FILE_VERSION ||
+      (Data.size() - sizeof(Header)) / sizeof(CBIRecord) < Header.Count)
+    return false;
+  for (uint32_t Index = 0; Index < Header.Count; ++Index) {
+    CBIRecord Record;
+    memcpy(&Record, Data.data() + sizeof(Header) + Index * sizeof(Record),
+           sizeof(Record));
+    if (Record.Type < CBI_BRANCH_TRUE || Record.Type > CBI_RETURN_NEGATIVE)
+      return false;
+    if (Record.Observed > 0)
+      observe(Run, Record.Line, Record.Col, Record.Type, Record.True > 0);
+  }
+  return true;
+}
+
+static bool endsWith(const std::string &String, const char *Suffix) {
+  size_t Length = strlen(Suffix);
+  return String.size() >= Length &&
+         String.compare(String.size() - Length, Length, Suffix) == 0;
+}
+
+bool readRunLog(const std::string &Path, std::string &Data, RunMap &Run,
+                std::string &Error) {
+  Run.clear();
+  int Errno = readFile(Path, Data);
+  if (Errno == ENOENT) {
+    return true;
+  } else if (Errno != 0) {
+    Error = Path + ": " + strerror(Errno);
+    return false;
+  }
+  bool Parsed = endsWith(Path, ".bin") ? parseBinLog(Data, Run)
+                                       : parseJsonLog(Data, Run);
+  if (!Parsed)
+    Error = Path + " is not a valid CBI log";
+  return Parsed;
+}
+
+bool parsePruneMap(PyObject *Sequence, PruneMap &Map) {
+  if (Sequence == Py_None)
+    return true;
+  PyObject *Fast = PySequence_Fast(Sequence, "prune_map must be a sequence");
+  if (Fast == NULL)
+    return false;
+  Py_ssize_t Size = PySequence_Fast_GET_SIZE(Fast);
+  for (Py_ssize_t Index = 0; Index < Size; ++Index) {
+    int Line, Col, Type, SourceLine, SourceCol, SourceIsBranch;
+    unsigned Mask;
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(Fast, Index),
+                          "iiiiipI;prune_map entries are (line, column, type, "
+                          "source line, source column, source is a branch, "
+                          "mask) tuples",
+                          &Line, &Col, &Type, &SourceLine, &SourceCol,
+                          &SourceIsBranch, &Mask)) {
+      Py_DECREF(Fast);
+      return false;
+    }
+    Map.push_back({predicateKey(Line, Col, Type), SourceLine, SourceCol,
+                   SourceIsBranch != 0, Mask});
+  }
+  Py_DECREF(Fast);
+  return true;
+}
+
+void expandRun(const PruneMap &Map, RunMap &Run) {
+  for (auto &Derived : Map) {
+    int First = Derived.SourceIsBranch ? CBI_BRANCH_TRUE : CBI_RETURN_POSITIVE;
+    int Last = Derived.SourceIsBranch ? CBI_BRANCH_FALSE : CBI_RETURN_NEGATIVE;
+    uint8_t Flags = 0;
+    for (int Type = First; Type <= Last; ++Type) {
+      auto Source =
+          Run.find(predicateKey(Derived.SourceLine, Derived.SourceCol, Type));
+      if (Source == Run.end())
+        continue;
+      Flags |= OBSERVED;
+      if ((Source->second & OBSERVED_TRUE) && (Derived.Mask & (1u << Type)))
+        Flags |= OBSERVED_TRUE;
+    }
+    if (Flags)
+      Run[Derived.Key] |= Flags;
+  }
+}
+
+void countRun(const RunMap &Run, bool Failure, CounterMap &Counts) {
+  for (auto &Entry : Run) {
+    Counters &Count = Counts[Entry.first];
+    bool True = Entry.second & OBSERVED_TRUE;
+    if (Failure) {
+      ++Count.FObs;
+      Count.F += True;
+    } else {
+      ++Count.SObs;
+      Count.S += True;
+    }
+  }
+}
+
+PyObject *buildPredicateList(const std::vector<CounterMap> &Maps) {
+  std::map<uint64_t, Counters> Predicates;
+  for (auto &Map : Maps) {
+    for (auto &Entry : Map)
+      Predicates[Entry.first].merge(Entry.second);
+  }
+
+  PyObject *Result = PyList_New(Predicates.size());
+  if (Result == NULL)
+    return NULL;
+  Py_ssize_t Index = 0;
+  for (auto &Entry : Predicates) {
+    int Line, Col, Type;
+    predicateOfKey(Entry.first, Line, Col, Type);
+    const Counters &Count = Entry.second;
+    PyObject *Item = Py_BuildValue(
+        "(iiiKKKK)", Line, Col, Type, (unsigned long long)Count.S,
+        (unsigned long long)Count.F, (unsigned long long)Count.SObs,
+        (unsigned long long)Count.FObs);
+    if (Item == NULL) {
+      Py_DECREF(Result);
+      return NULL;
+    }
+    PyList_SET_ITEM(Result, Index++, Item);
+  }
+  return Result;
+}
+
+bool appendPaths(PyObject *Sequence, std::vector<std::string> &Paths) {
+  PyObject *Fast = PySequence_Fast(Sequence, "logs must be a sequence");
+  if (Fast == NULL)
+    return false;
+  Py_ssize_t Size = PySequence_Fast_GET_SIZE(Fast);
+  for (Py_ssize_t Index = 0; Index < Size; ++Index) {
+    PyObject *Bytes = NULL;
+    if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(Fast, Index), &Bytes)) {
+      Py_DECREF(Fast);
+      return false;
+    }
+    Paths.emplace_back(PyBytes_AS_STRING(Bytes), PyBytes_GET_SIZE(Bytes));
+    Py_DECREF(Bytes);
+  }
+  Py_DECREF(Fast);
+  return true;
+}
+
+struct Aggregation {
+  std::vector<std::string> Paths;
+  size_t NumSuccess = 0;
+  PruneMap Prune;
+  std::atomic<size_t> Next{0};
+  std::atomic<bool> Failed{false};
+  std::mutex ErrorLock;
+  std::string Error;
+
+  void fail(const std::string &Message) {
+    std::lock_guard<std::mutex> Guard(ErrorLock);
+    if (!Failed.exchange(true))
+      Error = Message;
+  }
+
+  /**
+   * Take runs until none are left and add their predicates to Counts.
+   */
+  void work(CounterMap &Counts) {
+    RunMap Run;
+    std::string Data, Message;
+    while (!Failed) {
+      size_t Index = Next++;
+      if (Index >= Paths.size())
+        return;
+      if (!readRunLog(Paths[Index], Data, Run, Message))
+        return fail(Message);
+      expandRun(Prune, Run);
+      countRun(Run, Index >= NumSuccess, Counts);
+    }
+  }
+};
+
+static PyObject *aggregate(PyObject *Self, PyObject *Args, PyObject *Kwargs) {
+  static const char *Keywords[] = {"success_logs", "failure_logs", "threads",
+                                   "prune_map", NULL};
+  PyObject *SuccessLogs, *FailureLogs, *Prune = Py_None;
+  int Threads = 0;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "OO|iO:aggregate",
+                                   const_cast<char **>(Keywords), &SuccessLogs,
+                                   &FailureLogs, &Threads, &Prune))
+    return NULL;
+
+  Aggregation State;
+  if (!parsePruneMap(Prune, State.Prune))
+    return NULL;
+  if (!appendPaths(SuccessLogs, State.Paths))
+    return NULL;
+  State.NumSuccess = State.Paths.size();
+  if (!appendPaths(FailureLogs, State.Paths))
+    return NULL;
+
+  if (Threads <= 0)
+    Threads = std::max(1u, std::thread::hardware_concurrency());
+  Threads = std::max<size_t>(1, std::min<size_t>(Threads, State.Paths.size()));
+
+  std::vector<CounterMap> Maps(Threads);
+  Py_BEGIN_ALLOW_THREADS;
+  std::vector<std::thread> Workers;
+  for (int Index = 1; Index < Threads; ++Index)
+    Workers.emplace_back([&, Index] { State.work(Maps[Index]); });
+  State.work(Maps[0]);
+  for (auto &Worker : Workers)
+    Worker.join();
+  Py_END_ALLOW_THREADS;
+
+  if (State.Failed) {
+    PyErr_SetString(PyExc_ValueError, State.Error.c_str());
+    return NULL;
+  }
+  return buildPredicateList(Maps);
+}
+
+static PyMethodDef Methods[] = {
+    {"aggregate", (PyCFunction)(void (*)(void))aggregate,
+     METH_VARARGS | METH_KEYWORDS,
+     "aggregate(success_logs, failure_logs, threads=0, prune_map=None)\n--\n\n"
+     "Count the s, f, s_obs and f_obs of every predicate of the CBI logs,\n"
+     "and of the pruned predicates of prune_map.\n"
+     "Returns a list of (line, column, type, s, f, s_obs, f_obs) tuples."},
+    {"collect", (PyCFunction)(void (*)(void))collect,
+     METH_VARARGS | METH_KEYWORDS,
+     "collect(target, success_inputs, failure_inputs, jobs=0, counters=False,\n"
+     "        prune_map=None)\n"
+     "--\n\n"
+     "Run target on every input on parallel workers, logging next to the\n"
+     "inputs. Returns the return codes of the successful and the failing\n"
+     "inputs, and the predicates as aggregate() does if counters is set,\n"
+     "in which case the logs are removed once counted."},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef Module = {
+    PyModuleDef_HEAD_INIT, "_aggregate", "Native collection and aggregation of CBI logs.", -1,
+    Methods,
+};
+
+PyMODINIT_FUNC PyInit__aggregate(void) {
+  PyObject *Mod = PyModule_Create(&Module);
+  if (Mod == NULL)
+    return NULL;
+  if (!addTargetRunnerType(Mod, "cbi._aggregate.TargetRunner")) {
+    Py_DECREF(Mod);
+    return NULL;
+  }
+  return Mod;
+}
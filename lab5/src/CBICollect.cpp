@@ -0,0 +1,178 @@
+/**
+ * Parallel collection of CBI logs, collect() of the cbi._aggregate module.
+ *
+ * collect(target, success_inputs, failure_inputs, jobs=0, counters=False,
+ * prune_map=None) runs the target with every input on its stdin, as
+ * cbi.utils.run_target does, on one worker thread per hardware thread by
+ * default. Every run logs next to its input, to <input>.cbi.jsonl or
+ * <input>.cbi.bin, through INSTR_LOG, so that runs never share a log. The
+ * events left in the ring files of killed runs are recovered and the
+ * coverage of the runs is removed. With counters set, every worker counts
+ * the predicates of its runs as aggregate() does, with those of prune_map,
+ * and removes their logs.
+ *
+ * Every worker runs the target with a TargetRunner of its own, through a
+ * fork server when the target has one, see TargetRunner.h.
+ */
+
+#include "CBIAggregate.h"
+#include "LogCore.h"
+#include "TargetRunner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+static const char *CBI_EXTENSION = ".cbi.jsonl";
+static const char *CBI_BIN_EXTENSION = ".cbi.bin";
+
+struct Collection {
+  std::string Target;
+  std::vector<std::string> Env;
+  std::vector<std::string> Inputs;
+  size_t NumSuccess = 0;
+  bool ForkServer = false;
+  bool Counters = false;
+  PruneMap Prune;
+  std::vector<int> ReturnCodes;
+  std::atomic<size_t> Next{0};
+  std::atomic<bool> Failed{false};
+  std::mutex ErrorLock;
+  std::string Error;
+
+  void fail(const std::string &Message) {
+    std::lock_guard<std::mutex> Guard(ErrorLock);
+    if (!Failed.exchange(true))
+      Error = Message;
+  }
+
+  /**
+   * Take inputs until none are left, run them and count their predicates in
+   * Counts if Counters is set.
+   */
+  void work(CounterMap &Counts) {
+    TargetRunner Worker(Target, Env);
+    if (ForkServer && !Worker.startServer("/dev/null"))
+      return fail("Cannot start the fork server of " + Target);
+    RunMap Run;
+    std::string Data, Message;
+    while (!Failed) {
+      size_t Index = Next++;
+      if (Index >= Inputs.size())
+        return;
+      const std::string &Input = Inputs[Index];
+      std::string LogFile = Input + CBI_EXTENSION;
+      std::string BinFile = Input + CBI_BIN_EXTENSION;
+      std::string CovFile = Input + ".cov";
+      unlink(LogFile.c_str());
+      unlink(BinFile.c_str());
+
+      int Errno = readFile(Input, Data);
+      if (Errno != 0)
+        return fail(Input + ": " + strerror(Errno));
+      ReturnCodes[Index] = Worker.run(Data, Input);
+
+      logcore_recover(LogFile.c_str());
+      logcore_recover(CovFile.c_str());
+      // Only the predicates are needed, drop the coverage of the run.
+      unlink(CovFile.c_str());
+      if (!Counters)
+        continue;
+      bool HasBin = access(BinFile.c_str(), F_OK) == 0;
+      if (!readRunLog(HasBin ? BinFile : LogFile, Data, Run, Message))
+        return fail(Message);
+      expandRun(Prune, Run);
+      countRun(Run, Index >= NumSuccess, Counts);
+      unlink(LogFile.c_str());
+      unlink(BinFile.c_str());
+    }
+  }
+};
+
+static PyObject *toList(const std::vector<int> &Codes, size_t Begin,
+                        size_t End) {
+  PyObject *List = PyList_New(End - Begin);
+  if (List == NULL)
+    return NULL;
+  for (size_t Index = Begin; Index < End; ++Index) {
+    PyObject *Code = PyLong_FromLong(Codes[Index]);
+    if (Code == NULL) {
+      Py_DECREF(List);
+      return NULL;
+    }
+    PyList_SET_ITEM(List, Index - Begin, Code);
+  }
+  return List;
+}
+
+PyObject *collect(PyObject *Self, PyObject *Args, PyObject *Kwargs) {
+  static const char *Keywords[] = {"target", "success_inputs",
+                                   "failure_inputs", "jobs", "counters",
+                                   "prune_map", NULL};
+  PyObject *TargetPath, *SuccessInputs, *FailureInputs, *Prune = Py_None;
+  int Jobs = 0, Counters = 0;
+  if (!PyArg_ParseTupleAndKeywords(Args, Kwargs, "OOO|ipO:collect",
+                                   const_cast<char **>(Keywords), &TargetPath,
+                                   &SuccessInputs, &FailureInputs, &Jobs,
+                                   &Counters, &Prune))
+    return NULL;
+
+  Collection State;
+  if (!parsePruneMap(Prune, State.Prune))
+    return NULL;
+  std::vector<std::string> Target;
+  PyObject *TargetList = PyTuple_Pack(1, TargetPath);
+  bool Parsed = TargetList != NULL && appendPaths(TargetList, Target);
+  Py_XDECREF(TargetList);
+  if (!Parsed || !appendPaths(SuccessInputs, State.Inputs))
+    return NULL;
+  State.NumSuccess = State.Inputs.size();
+  if (!appendPaths(FailureInputs, State.Inputs))
+    return NULL;
+  State.Target = Target[0];
+  State.Env = getTargetEnv();
+  State.Counters = Counters;
+  State.ReturnCodes.resize(State.Inputs.size(), 127);
+
+  if (Jobs <= 0)
+    Jobs = std::max(1u, std::thread::hardware_concurrency());
+  Jobs = std::max<size_t>(1, std::min<size_t>(Jobs, State.Inputs.size()));
+
+  std::vector<CounterMap> Maps(Jobs);
+  Py_BEGIN_ALLOW_THREADS;
+  State.ForkServer =
+      !State.Inputs.empty() && hasForkServer(State.Target, State.Env);
+  std::vector<std::thread> Workers;
+  for (int Index = 1; Index < Jobs; ++Index)
+    Workers.emplace_back([&, Index] { State.work(Maps[Index]); });
+  State.work(Maps[0]);
+  for (auto &Worker : Workers)
+    Worker.join();
+  Py_END_ALLOW_THREADS;
+
+  if (State.Failed) {
+    PyErr_SetString(PyExc_OSError, State.Error.c_str());
+    return NULL;
+  }
+  PyObject *Predicates = Py_None;
+  if (Counters)
+    Predicates = buildPredicateList(Maps);
+  else
+    Py_INCREF(Py_None);
+  if (Predicates == NULL)
+    return NULL;
+  PyObject *SuccessCodes = toList(State.ReturnCodes, 0, State.NumSuccess);
+  PyObject *FailureCodes =
+      toList(State.ReturnCodes, State.NumSuccess, State.ReturnCodes.size());
+  PyObject *Result = NULL;
+  if (SuccessCodes != NULL && FailureCodes != NULL)
+    Result = PyTuple_Pack(3, SuccessCodes, FailureCodes, Predicates);
+  Py_XDECREF(SuccessCodes);
+  Py_XDECREF(FailureCodes);
+  Py_DECREF(Predicates);
+  return Result;
+}
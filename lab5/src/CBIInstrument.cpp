@@ -1,4 +1,19 @@
 #include "CBIInstrument.h"
+#include "CBIFormat.h"
+#include "Sampling.h"
+
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <tuple>
 
 using namespace llvm;
 
@@ -8,6 +23,415 @@ const auto PASS_NAME = "CBIInstrument";
 const auto PASS_DESC = "Instrumentation for CBI";
 const auto CBI_BRANCH_FUNCTION_NAME = "__cbi_branch__";
 const auto CBI_RETURN_FUNCTION_NAME = "__cbi_return__";
+const auto CBI_SAMPLED_BRANCH_FUNCTION_NAME = "__cbi_sampled_branch__";
+const auto CBI_SAMPLED_RETURN_FUNCTION_NAME = "__cbi_sampled_return__";
+const auto CBI_COUNTDOWN_NAME = "__cbi_countdown";
+const auto CBI_BRANCH_COUNTER_FUNCTION_NAME = "__cbi_branch_counter__";
+const auto CBI_RETURN_COUNTER_FUNCTION_NAME = "__cbi_return_counter__";
+const auto CBI_SAMPLED_BRANCH_COUNTER_FUNCTION_NAME =
+    "__cbi_sampled_branch_counter__";
+const auto CBI_SAMPLED_RETURN_COUNTER_FUNCTION_NAME =
+    "__cbi_sampled_return_counter__";
+const auto CBI_REGISTER_FUNCTION_NAME = "__cbi_register__";
+const auto CBI_PREDICATES_NAME = "__cbi_predicates";
+const auto CBI_COUNTERS_NAME = "__cbi_counters";
+// Hook the Instrument pass inserts before every instruction, see
+// Instrument.cpp.
+const auto COVERAGE_FUNCTION_NAME = "__coverage__";
+
+// Predicates of a branch and of a return site, see CBIFormat.h.
+const int BRANCH_PREDICATES = 2;
+const int RETURN_PREDICATES = 3;
+// Names of the CBIPredicateTypes, as in cbi.data_format.PredicateType.
+const char *PREDICATE_NAMES[] = {"BranchTrue", "BranchFalse", "ReturnPositive",
+                                 "ReturnZero", "ReturnNegative"};
+
+static cl::opt<bool>
+    Sample("cbi-sample",
+           cl::desc("Only report a random sample of the predicates, at the "
+                    "rate set by CBI_SAMPLE_RATE at runtime"));
+
+static cl::opt<bool> CountPredicates(
+    "cbi-counters",
+    cl::desc("Count the predicates in a table of the module and write one "
+             "binary record per run instead of a JSON line per event"));
+
+static cl::opt<bool>
+    Prune("cbi-prune",
+          cl::desc("Skip the sites that are unreachable, and with "
+                   "-cbi-prune-map, the sites whose predicates can be derived "
+                   "from those of another site of their block"));
+
+static cl::opt<std::string> PruneMap(
+    "cbi-prune-map", cl::value_desc("file"),
+    cl::desc("File to record the sites derived by -cbi-prune in, as JSON "
+             "lines read by the cbi package"));
+
+/**
+ * A site left uninstrumented by -cbi-prune. Source runs exactly when Site
+ * does, and every predicate of Site is true in an execution if one of the
+ * predicates of Source in its mask, of 1 << CBIPredicateType, is.
+ */
+struct DerivedSite {
+  Instruction *Site;
+  Instruction *Source;
+  std::vector<unsigned> Masks;
+};
+
+// Bounds of the return values of every return predicate.
+const struct {
+  int Type;
+  int64_t Min;
+  int64_t Max;
+} SIGN_CLASSES[] = {{CBI_RETURN_POSITIVE, 1, INT32_MAX},
+                    {CBI_RETURN_ZERO, 0, 0},
+                    {CBI_RETURN_NEGATIVE, INT32_MIN, -1}};
+
+/**
+ * Predicate counters of the function being instrumented with -cbi-counters.
+ * Every site (line, column, is branch) maps to the id of its first predicate
+ * in the function, and every predicate has an observed and a true counter.
+ */
+struct PredicateCounters {
+  GlobalVariable *Counters = nullptr;
+  std::map<std::tuple<int, int, bool>, unsigned> Sites;
+};
+
+/**
+ * Check if Inst is a site of CBI: a conditional branch or a call returning
+ * an int, with debug information.
+ */
+static bool isSite(Instruction &Inst) {
+  if (!Inst.getDebugLoc()) {
+    return false;
+  }
+  if (auto *Branch = dyn_cast<BranchInst>(&Inst)) {
+    return Branch->isConditional();
+  }
+  if (auto *Call = dyn_cast<CallInst>(&Inst)) {
+    auto *Callee = Call->getCalledFunction();
+    return Call->getType()->isIntegerTy(32) &&
+           !(Callee && Callee->isIntrinsic());
+  }
+  return false;
+}
+
+static std::tuple<int, int, bool> siteKey(Instruction &Site) {
+  auto &DebugLoc = Site.getDebugLoc();
+  return std::make_tuple(DebugLoc.getLine(), DebugLoc.getCol(),
+                         isa<BranchInst>(&Site));
+}
+
+/**
+ * Get the mask of all the predicates of a site.
+ */
+static unsigned allPredicates(Instruction &Site) {
+  return isa<BranchInst>(&Site) ? (1 << CBI_BRANCH_TRUE) | (1 << CBI_BRANCH_FALSE)
+                                : (1 << CBI_RETURN_POSITIVE) |
+                                      (1 << CBI_RETURN_ZERO) |
+                                      (1 << CBI_RETURN_NEGATIVE);
+}
+
+/**
+ * Check if Inst is a call to the coverage hook, which always returns.
+ */
+static bool isCoverageHook(Instruction &Inst) {
+  auto *Call = dyn_cast<CallInst>(&Inst);
+  auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+  return Callee && Callee->getName() == COVERAGE_FUNCTION_NAME;
+}
+
+/**
+ * Check if Inst is a non-volatile load or store of a stack slot of the
+ * function, which cannot trap.
+ */
+static bool isSlotAccess(Instruction &Inst) {
+  if (auto *Load = dyn_cast<LoadInst>(&Inst)) {
+    return !Load->isVolatile() &&
+           isa<AllocaInst>(Load->getPointerOperand()->stripPointerCasts());
+  }
+  if (auto *Store = dyn_cast<StoreInst>(&Inst)) {
+    return !Store->isVolatile() &&
+           isa<AllocaInst>(Store->getPointerOperand()->stripPointerCasts());
+  }
+  return false;
+}
+
+/**
+ * Check if the instruction after Inst always runs once Inst has: Inst cannot
+ * trap, like a division by zero or a faulting load, and returns.
+ */
+static bool alwaysContinues(Instruction &Inst) {
+  return isCoverageHook(Inst) || isa<DbgInfoIntrinsic>(&Inst) ||
+         isSlotAccess(Inst) || isSafeToSpeculativelyExecute(&Inst);
+}
+
+/**
+ * Get the last call before Branch in its block, if every instruction between
+ * them always continues, so that the call runs exactly when Branch does.
+ */
+static CallInst *getSourceCall(BranchInst *Branch) {
+  for (auto *Prev = Branch->getPrevNode(); Prev; Prev = Prev->getPrevNode()) {
+    if (!alwaysContinues(*Prev)) {
+      return dyn_cast<CallInst>(Prev);
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Get the value a load of a stack slot reads, as code built without
+ * optimizations stores values to their variable and loads them back: the
+ * value of the last store to the slot before the load in its block, if
+ * nothing else may write the slot in between. Other values are returned
+ * unchanged.
+ */
+static Value *getStoredValue(Value *V) {
+  auto *Load = dyn_cast<LoadInst>(V);
+  if (!Load || !isSlotAccess(*Load)) {
+    return V;
+  }
+  auto *Slot = Load->getPointerOperand()->stripPointerCasts();
+  for (auto *Prev = Load->getPrevNode(); Prev; Prev = Prev->getPrevNode()) {
+    auto *Store = dyn_cast<StoreInst>(Prev);
+    if (Store && isSlotAccess(*Store)) {
+      if (Store->getPointerOperand()->stripPointerCasts() == Slot) {
+        return Store->getValueOperand();
+      }
+    } else if (Prev->mayWriteToMemory() && !isCoverageHook(*Prev)) {
+      return V;
+    }
+  }
+  return V;
+}
+
+/**
+ * Evaluate a signed or equality comparison.
+ *
+ * @return false if Pred is neither.
+ */
+static bool compareSigned(CmpInst::Predicate Pred, int64_t Lhs, int64_t Rhs,
+                          bool &Result) {
+  switch (Pred) {
+  case CmpInst::ICMP_EQ:
+    Result = Lhs == Rhs;
+    return true;
+  case CmpInst::ICMP_NE:
+    Result = Lhs != Rhs;
+    return true;
+  case CmpInst::ICMP_SGT:
+    Result = Lhs > Rhs;
+    return true;
+  case CmpInst::ICMP_SGE:
+    Result = Lhs >= Rhs;
+    return true;
+  case CmpInst::ICMP_SLT:
+    Result = Lhs < Rhs;
+    return true;
+  case CmpInst::ICMP_SLE:
+    Result = Lhs <= Rhs;
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Get the mask of the return predicates of Call for which Cmp is true, if
+ * Cmp compares the return value of Call to a constant, directly or through
+ * a stack slot, and its outcome only depends on the sign of the return
+ * value.
+ */
+static bool getCompareMask(ICmpInst *Cmp, CallInst *Call, unsigned &TrueMask) {
+  auto Pred = Cmp->getPredicate();
+  auto *Const = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+  if (getStoredValue(Cmp->getOperand(1)) == Call) {
+    Pred = Cmp->getSwappedPredicate();
+    Const = dyn_cast<ConstantInt>(Cmp->getOperand(0));
+  } else if (getStoredValue(Cmp->getOperand(0)) != Call) {
+    return false;
+  }
+  if (!Const) {
+    return false;
+  }
+  int64_t C = Const->getSExtValue();
+  TrueMask = 0;
+  for (auto &Class : SIGN_CLASSES) {
+    // Signed comparisons are monotonic over the values of a class, == and !=
+    // are constant over them unless C is inside.
+    bool AtMin, AtMax;
+    if (!compareSigned(Pred, Class.Min, C, AtMin) ||
+        !compareSigned(Pred, Class.Max, C, AtMax) || AtMin != AtMax ||
+        (Class.Min < C && C < Class.Max)) {
+      return false;
+    }
+    TrueMask |= AtMin ? 1 << Class.Type : 0;
+  }
+  return true;
+}
+
+/**
+ * Check if Call always returns a value of the same sign, as a function of
+ * the module returning constants does, and get its return predicate.
+ */
+static bool isConstantReturn(CallInst *Call, int &Type) {
+  auto *Callee = Call->getCalledFunction();
+  if (!Callee || Callee->isDeclaration() || Callee->isInterposable()) {
+    return false;
+  }
+  Type = -1;
+  for (auto &BB : *Callee) {
+    auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator());
+    if (!Ret) {
+      continue;
+    }
+    auto *Const = dyn_cast_or_null<ConstantInt>(Ret->getReturnValue());
+    if (!Const) {
+      return false;
+    }
+    int64_t Value = Const->getSExtValue();
+    int RetType = Value > 0    ? CBI_RETURN_POSITIVE
+                  : Value == 0 ? CBI_RETURN_ZERO
+                               : CBI_RETURN_NEGATIVE;
+    if (Type != -1 && Type != RetType) {
+      return false;
+    }
+    Type = RetType;
+  }
+  return Type != -1;
+}
+
+/**
+ * Find the sites of F that -cbi-prune leaves uninstrumented: the sites in
+ * blocks unreachable from the entry, which never run, and with a prune map:
+ * - a branch on a constant, or on a comparison of the return value of the
+ *   last call of its block to a constant that only depends on its sign,
+ *   derived from the return site of that call;
+ * - the return site of a call to a function returning constants of one
+ *   sign, derived from the branch ending its block.
+ * In both cases, no instruction between the call and the branch may trap
+ * or not return, see getSourceCall.
+ */
+static void findPrunedSites(Function &F, std::set<Instruction *> &Unreachable,
+                            std::vector<DerivedSite> &Derived) {
+  std::set<BasicBlock *> Reachable;
+  for (auto *BB : depth_first(&F.getEntryBlock())) {
+    Reachable.insert(BB);
+  }
+  for (auto &BB : F) {
+    if (!Reachable.count(&BB)) {
+      for (auto &Inst : BB) {
+        if (isSite(Inst)) {
+          Unreachable.insert(&Inst);
+        }
+      }
+      continue;
+    }
+    if (PruneMap.empty()) {
+      continue;
+    }
+
+    auto *Branch = dyn_cast<BranchInst>(BB.getTerminator());
+    if (!Branch || !isSite(*Branch)) {
+      continue;
+    }
+    auto *LastCall = getSourceCall(Branch);
+    if (!LastCall || !isSite(*LastCall)) {
+      continue;
+    }
+    unsigned CallMask = allPredicates(*LastCall);
+    unsigned TrueMask;
+    auto *Cond = Branch->getCondition();
+    auto *Cmp = dyn_cast<ICmpInst>(Cond);
+    if (auto *Const = dyn_cast<ConstantInt>(Cond)) {
+      TrueMask = Const->isOne() ? CallMask : 0;
+    } else if (!Cmp || !getCompareMask(Cmp, LastCall, TrueMask)) {
+      // The branch stays, and may be the source of the last call.
+      int Type;
+      if (isConstantReturn(LastCall, Type)) {
+        std::vector<unsigned> Masks(RETURN_PREDICATES, 0);
+        Masks[Type - CBI_RETURN_POSITIVE] = allPredicates(*Branch);
+        Derived.push_back({LastCall, Branch, Masks});
+      }
+      continue;
+    }
+    Derived.push_back({Branch, LastCall, {TrueMask, CallMask & ~TrueMask}});
+  }
+}
+
+/**
+ * Get the sites that -cbi-prune leaves uninstrumented, by site key. Sites
+ * sharing the key of an instrumented site are instrumented too.
+ */
+static std::set<std::tuple<int, int, bool>>
+getPrunedKeys(Function &F, std::set<Instruction *> &Unreachable,
+              std::vector<DerivedSite> &Derived) {
+  std::set<Instruction *> Pruned = Unreachable;
+  for (auto &Site : Derived) {
+    Pruned.insert(Site.Site);
+  }
+  std::set<std::tuple<int, int, bool>> Keys, Kept;
+  for (inst_iterator Iter = inst_begin(F), E = inst_end(F); Iter != E; ++Iter) {
+    if (isSite(*Iter)) {
+      (Pruned.count(&*Iter) ? Keys : Kept).insert(siteKey(*Iter));
+    }
+  }
+  for (auto &Key : Kept) {
+    Keys.erase(Key);
+  }
+  return Keys;
+}
+
+/**
+ * Append the derived sites that are left uninstrumented to the prune map.
+ */
+static void writePruneMap(std::vector<DerivedSite> &Derived,
+                          std::set<std::tuple<int, int, bool>> &PrunedKeys) {
+  std::error_code EC;
+  raw_fd_ostream Out(PruneMap, EC, sys::fs::F_Append);
+  if (EC) {
+    errs() << "Cannot write " << PruneMap << ": " << EC.message() << "\n";
+    return;
+  }
+  for (auto &Site : Derived) {
+    if (!PrunedKeys.count(siteKey(*Site.Site))) {
+      continue;
+    }
+    auto &Loc = Site.Site->getDebugLoc();
+    auto &SourceLoc = Site.Source->getDebugLoc();
+    bool IsBranch = isa<BranchInst>(Site.Site);
+    int First = IsBranch ? CBI_BRANCH_TRUE : CBI_RETURN_POSITIVE;
+    Out << "{\"line\": " << Loc.getLine() << ", \"column\": " << Loc.getCol()
+        << ", \"kind\": \"" << (IsBranch ? "branch" : "return")
+        << "\", \"source_line\": " << SourceLoc.getLine()
+        << ", \"source_column\": " << SourceLoc.getCol()
+        << ", \"source_kind\": \""
+        << (isa<BranchInst>(Site.Source) ? "branch" : "return")
+        << "\", \"predicates\": {";
+    for (unsigned Index = 0; Index < Site.Masks.size(); ++Index) {
+      Out << (Index ? ", " : "") << "\"" << PREDICATE_NAMES[First + Index]
+          << "\": [";
+      bool Empty = true;
+      for (int Type = CBI_BRANCH_TRUE; Type <= CBI_RETURN_NEGATIVE; ++Type) {
+        if (Site.Masks[Index] & (1 << Type)) {
+          Out << (Empty ? "" : ", ") << "\"" << PREDICATE_NAMES[Type] << "\"";
+          Empty = false;
+        }
+      }
+      Out << "]";
+    }
+    Out << "}}\n";
+  }
+}
+
+/**
+ * Check if Inst is the call ending a sampling region. Its return value is
+ * reported in both copies of the region, by a hook that counts down itself.
+ */
+static bool isRegionEndSite(Instruction &Inst) {
+  auto *Call = dyn_cast<CallInst>(&Inst);
+  return Sample && Call && endsSamplingRegion(Call);
+}
 
 /**
  * @brief Instrument a BranchInst with calls to __cbi_branch__
@@ -29,6 +453,22 @@ void instrumentBranch(Module *M, BranchInst *Branch, int Line, int Col);
  */
 void instrumentReturn(Module *M, CallInst *Call, int Line, int Col);
 
+PredicateCounters createPredicateCounters(Function &F,
+                                          std::vector<Instruction *> &Sites);
+void instrumentBranchCounter(Module *M, PredicateCounters &Counters,
+                             BranchInst *Branch, int Line, int Col);
+void instrumentReturnCounter(Module *M, PredicateCounters &Counters,
+                             CallInst *Call, int Line, int Col);
+
+bool CBIInstrument::doInitialization(Module &M) {
+  // Functions append their derived sites to the map of the module.
+  if (Prune && !PruneMap.empty()) {
+    std::error_code EC;
+    raw_fd_ostream Out(PruneMap, EC, sys::fs::F_None);
+  }
+  return false;
+}
+
 bool CBIInstrument::runOnFunction(Function &F) {
   auto FunctionName = F.getName().str();
   outs() << "Running " << PASS_DESC << " on function " << FunctionName << "\n";
@@ -46,27 +486,80 @@ bool CBIInstrument::runOnFunction(Function &F) {
   M->getOrInsertFunction(CBI_RETURN_FUNCTION_NAME, VoidType, Int32Type,
                          Int32Type, Int32Type);
 
+  // Find the pruned sites before the sampling regions change the code.
+  std::set<std::tuple<int, int, bool>> PrunedKeys;
+  if (Prune) {
+    std::set<Instruction *> Unreachable;
+    std::vector<DerivedSite> Derived;
+    findPrunedSites(F, Unreachable, Derived);
+    PrunedKeys = getPrunedKeys(F, Unreachable, Derived);
+    if (!PruneMap.empty()) {
+      writePruneMap(Derived, PrunedKeys);
+    }
+  }
+  auto IsInstrumented = [&](Instruction &Inst) {
+    return isSite(Inst) && !PrunedKeys.count(siteKey(Inst));
+  };
+
+  // With -cbi-sample, only the slow path copies of the regions are
+  // instrumented, with hooks that count down to the next sample, except for
+  // the return values of calls ending a region.
+  std::set<BasicBlock *> SlowBlocks;
+  bool Sampled = false;
+  if (Sample) {
+    auto *Countdown = M->getNamedGlobal(CBI_COUNTDOWN_NAME);
+    if (!Countdown) {
+      Countdown = new GlobalVariable(
+          *M, Int32Type, false, GlobalValue::ExternalLinkage, nullptr,
+          CBI_COUNTDOWN_NAME, nullptr, GlobalValue::InitialExecTLSModel);
+    }
+    M->getOrInsertFunction(CBI_SAMPLED_BRANCH_FUNCTION_NAME, VoidType,
+                           Int32Type, Int32Type, BoolType);
+    M->getOrInsertFunction(CBI_SAMPLED_RETURN_FUNCTION_NAME, VoidType,
+                           Int32Type, Int32Type, Int32Type);
+    Sampled = createSamplingRegions(
+        F, Countdown,
+        [&](BasicBlock &BB) {
+          unsigned Sites = 0;
+          for (auto &Inst : BB) {
+            Sites += IsInstrumented(Inst) && !isRegionEndSite(Inst);
+          }
+          return Sites;
+        },
+        SlowBlocks);
+  }
+
+  // Collect the sites first, instrumenting calls adds instructions.
+  std::vector<Instruction *> Sites;
   for (inst_iterator Iter = inst_begin(F), E = inst_end(F); Iter != E; ++Iter) {
     Instruction &Inst = (*Iter);
-    llvm::DebugLoc DebugLoc = Inst.getDebugLoc();
-    if (!DebugLoc) {
-      // Skip Instruction if it doesn't have debug information.
+    if (Sampled && !SlowBlocks.count(Inst.getParent()) &&
+        !isRegionEndSite(Inst)) {
       continue;
     }
+    if (IsInstrumented(Inst)) {
+      Sites.push_back(&Inst);
+    }
+  }
 
-    int Line = DebugLoc.getLine();
-    int Col = DebugLoc.getCol();
+  PredicateCounters Table;
+  if (CountPredicates) {
+    Table = createPredicateCounters(F, Sites);
+  }
 
-    /**
-     * TODO: Add code to check the type of instruction
-     * and call appropriate instrumentation function.
-     *
-     * If Inst is a Branch Instruction then
-     *   use instrumentBranch
-     * Else if it is a Call returning an int then
-     *   use instrumentReturn
-     * @param Branch
-     */
+  for (auto *Inst : Sites) {
+    int Line = Inst->getDebugLoc().getLine();
+    int Col = Inst->getDebugLoc().getCol();
+    auto *Branch = dyn_cast<BranchInst>(Inst);
+    if (CountPredicates && Branch) {
+      instrumentBranchCounter(M, Table, Branch, Line, Col);
+    } else if (CountPredicates) {
+      instrumentReturnCounter(M, Table, cast<CallInst>(Inst), Line, Col);
+    } else if (Branch) {
+      instrumentBranch(M, Branch, Line, Col);
+    } else {
+      instrumentReturn(M, cast<CallInst>(Inst), Line, Col);
+    }
   }
   return true;
 }
@@ -78,9 +571,12 @@ void instrumentBranch(Module *M, BranchInst *Branch, int Line, int Col) {
   auto &Context = M->getContext();
   auto Int32Type = Type::getInt32Ty(Context);
 
-  /**
-   * TODO: Add code to instrument the Branch Instruction.
-   */
+  auto *Fun = M->getFunction(Sample ? CBI_SAMPLED_BRANCH_FUNCTION_NAME
+                                    : CBI_BRANCH_FUNCTION_NAME);
+  std::vector<Value *> Args = {ConstantInt::get(Int32Type, Line),
+                               ConstantInt::get(Int32Type, Col),
+                               Branch->getCondition()};
+  CallInst::Create(Fun, Args, "", Branch);
 }
 
 /**
@@ -90,11 +586,127 @@ void instrumentReturn(Module *M, CallInst *Call, int Line, int Col) {
   auto &Context = M->getContext();
   auto Int32Type = Type::getInt32Ty(Context);
 
-  /**
-   * TODO: Add code to instrument the Call Instruction.
-   *
-   * Note: CallInst::Create(.) follows Insert Before semantics.
-   */
+  auto *Fun = M->getFunction(Sample ? CBI_SAMPLED_RETURN_FUNCTION_NAME
+                                    : CBI_RETURN_FUNCTION_NAME);
+  std::vector<Value *> Args = {ConstantInt::get(Int32Type, Line),
+                               ConstantInt::get(Int32Type, Col), Call};
+  CallInst::Create(Fun, Args, "", Call->getNextNode());
+}
+
+/**
+ * Create the predicate table and counters of the sites of a function, and a
+ * constructor that registers them with the runtime, which writes the counts
+ * to the .cbi.bin file at exit.
+ */
+PredicateCounters createPredicateCounters(Function &F,
+                                          std::vector<Instruction *> &Sites) {
+  PredicateCounters Counters;
+  std::vector<std::tuple<int, int, int>> Predicates;
+  for (auto *Inst : Sites) {
+    auto &DebugLoc = Inst->getDebugLoc();
+    bool IsBranch = isa<BranchInst>(Inst);
+    // The two copies of a sampled site share their predicates.
+    if (!Counters.Sites.emplace(siteKey(*Inst), Predicates.size()).second) {
+      continue;
+    }
+    int First = IsBranch ? CBI_BRANCH_TRUE : CBI_RETURN_POSITIVE;
+    int Count = IsBranch ? BRANCH_PREDICATES : RETURN_PREDICATES;
+    for (int Type = First; Type < First + Count; ++Type) {
+      Predicates.emplace_back(DebugLoc.getLine(), DebugLoc.getCol(), Type);
+    }
+  }
+  if (Predicates.empty()) {
+    return Counters;
+  }
+
+  Module &M = *F.getParent();
+  auto &Context = M.getContext();
+  auto *VoidType = Type::getVoidTy(Context);
+  auto *Int32Type = Type::getInt32Ty(Context);
+  auto *Int64Type = Type::getInt64Ty(Context);
+  auto *Int8PtrType = Type::getInt8PtrTy(Context);
+  auto *Int64PtrType = Type::getInt64PtrTy(Context);
+  auto *PredicateType = StructType::get(Int32Type, Int32Type, Int32Type);
+
+  std::vector<Constant *> Entries;
+  for (auto &Predicate : Predicates) {
+    Entries.push_back(ConstantStruct::get(
+        PredicateType, ConstantInt::get(Int32Type, std::get<0>(Predicate)),
+        ConstantInt::get(Int32Type, std::get<1>(Predicate)),
+        ConstantInt::get(Int32Type, std::get<2>(Predicate))));
+  }
+  auto *TableType = ArrayType::get(PredicateType, Entries.size());
+  auto *Table = new GlobalVariable(M, TableType, true,
+                                   GlobalValue::InternalLinkage,
+                                   ConstantArray::get(TableType, Entries),
+                                   CBI_PREDICATES_NAME);
+  auto *CountersType = ArrayType::get(Int64Type, 2 * Entries.size());
+  Counters.Counters = new GlobalVariable(
+      M, CountersType, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(CountersType), CBI_COUNTERS_NAME);
+
+  M.getOrInsertFunction(CBI_REGISTER_FUNCTION_NAME, VoidType, Int64PtrType,
+                        Int8PtrType, Int32Type);
+  auto *Ctor = Function::Create(FunctionType::get(VoidType, false),
+                                GlobalValue::InternalLinkage,
+                                "__cbi_counters_init", &M);
+  IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Ctor));
+  Builder.CreateCall(
+      M.getFunction(CBI_REGISTER_FUNCTION_NAME),
+      {ConstantExpr::getPointerCast(Counters.Counters, Int64PtrType),
+       ConstantExpr::getPointerCast(Table, Int8PtrType),
+       ConstantInt::get(Int32Type, Entries.size())});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+  return Counters;
+}
+
+/**
+ * Get the counters of the first predicate of a site.
+ */
+static Value *getSiteCounters(PredicateCounters &Counters, Instruction *Site,
+                              int Line, int Col, IRBuilder<> &Builder) {
+  unsigned First = Counters.Sites[siteKey(*Site)];
+  return Builder.CreateConstInBoundsGEP2_64(
+      Counters.Counters->getValueType(), Counters.Counters, 0, 2 * First);
+}
+
+/**
+ * Count the predicates of a branch in the table of its function.
+ */
+void instrumentBranchCounter(Module *M, PredicateCounters &Counters,
+                             BranchInst *Branch, int Line, int Col) {
+  auto &Context = M->getContext();
+  auto *VoidType = Type::getVoidTy(Context);
+  auto *Int32Type = Type::getInt32Ty(Context);
+  auto *Int64PtrType = Type::getInt64PtrTy(Context);
+  auto *Name = Sample ? CBI_SAMPLED_BRANCH_COUNTER_FUNCTION_NAME
+                      : CBI_BRANCH_COUNTER_FUNCTION_NAME;
+  M->getOrInsertFunction(Name, VoidType, Int64PtrType, Int32Type);
+
+  IRBuilder<> Builder(Branch);
+  auto *SiteCounters = getSiteCounters(Counters, Branch, Line, Col, Builder);
+  auto *Cond = Builder.CreateZExt(Branch->getCondition(), Int32Type);
+  Builder.CreateCall(M->getFunction(Name), {SiteCounters, Cond});
+}
+
+/**
+ * Count the predicates of the return value of a call in the table of its
+ * function.
+ */
+void instrumentReturnCounter(Module *M, PredicateCounters &Counters,
+                             CallInst *Call, int Line, int Col) {
+  auto &Context = M->getContext();
+  auto *VoidType = Type::getVoidTy(Context);
+  auto *Int32Type = Type::getInt32Ty(Context);
+  auto *Int64PtrType = Type::getInt64PtrTy(Context);
+  auto *Name = Sample ? CBI_SAMPLED_RETURN_COUNTER_FUNCTION_NAME
+                      : CBI_RETURN_COUNTER_FUNCTION_NAME;
+  M->getOrInsertFunction(Name, VoidType, Int64PtrType, Int32Type);
+
+  IRBuilder<> Builder(Call->getNextNode());
+  auto *SiteCounters = getSiteCounters(Counters, Call, Line, Col, Builder);
+  Builder.CreateCall(M->getFunction(Name), {SiteCounters, Call});
 }
 
 char CBIInstrument::ID = 1;
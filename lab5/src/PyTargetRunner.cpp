@@ -0,0 +1 @@
+../../common/src/PyTargetRunner.cpp
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include "Sampling.h"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <map>
+#include <vector>
+
+/**
+ * Check if the value of I is used outside of its block, or by a phi node.
+ */
+static bool valueEscapes(Instruction &I) {
+  for (auto *U : I.users()) {
+    auto *UI = cast<Instruction>(U);
+    if (UI->getParent() != I.getParent() || isa<PHINode>(UI)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Demote every value live across blocks to a stack slot, as reg2mem does.
+ * Afterwards, blocks only share values through the allocas of the entry.
+ */
+static void demoteToStack(Function &F) {
+  BasicBlock &Entry = F.getEntryBlock();
+  auto *AllocaPoint = Entry.getTerminator();
+
+  // Phis first: their reloads may be used in other blocks and escape too.
+  std::vector<PHINode *> Phis;
+  for (auto &BB : F) {
+    for (auto &Phi : BB.phis()) {
+      Phis.push_back(&Phi);
+    }
+  }
+  for (auto *Phi : Phis) {
+    DemotePHIToStack(Phi, AllocaPoint);
+  }
+
+  std::vector<Instruction *> Escaping;
+  for (auto &BB : F) {
+    if (&BB == &Entry) {
+      continue;
+    }
+    for (auto &I : BB) {
+      if (valueEscapes(I)) {
+        Escaping.push_back(&I);
+      }
+    }
+  }
+  for (auto *I : Escaping) {
+    DemoteRegToStack(*I, false, AllocaPoint);
+  }
+}
+
+bool endsSamplingRegion(CallInst *Call) {
+  auto *Callee = Call->getCalledFunction();
+  return !Callee || !Callee->isDeclaration();
+}
+
+/**
+ * Add the targets of the back edges of a depth-first search from Start to
+ * Heads. Every cycle reachable from Start goes through one of them.
+ */
+static void findBackEdgeTargets(BasicBlock *Start,
+                                std::set<BasicBlock *> &Heads) {
+  std::set<BasicBlock *> Visited = {Start};
+  std::set<BasicBlock *> OnStack = {Start};
+  std::vector<std::pair<BasicBlock *, succ_iterator>> Stack = {
+      {Start, succ_begin(Start)}};
+  while (!Stack.empty()) {
+    auto *BB = Stack.back().first;
+    auto &Next = Stack.back().second;
+    if (Next == succ_end(BB)) {
+      OnStack.erase(BB);
+      Stack.pop_back();
+      continue;
+    }
+    auto *Succ = *Next++;
+    if (OnStack.count(Succ)) {
+      Heads.insert(Succ);
+    } else if (Visited.insert(Succ).second) {
+      OnStack.insert(Succ);
+      Stack.push_back({Succ, succ_begin(Succ)});
+    }
+  }
+}
+
+/**
+ * Get the largest number of sites on a path from BB to the end of its
+ * region, the region weight if BB is a region entry.
+ */
+static unsigned pathWeight(BasicBlock *BB, const std::set<BasicBlock *> &Heads,
+                           std::map<BasicBlock *, unsigned> &Sites,
+                           std::map<BasicBlock *, unsigned> &Weights) {
+  auto Found = Weights.find(BB);
+  if (Found != Weights.end()) {
+    return Found->second;
+  }
+  unsigned Longest = 0;
+  for (auto *Succ : successors(BB)) {
+    if (!Heads.count(Succ)) {
+      Longest = std::max(Longest, pathWeight(Succ, Heads, Sites, Weights));
+    }
+  }
+  return Weights[BB] = Sites[BB] + Longest;
+}
+
+/**
+ * Add the blocks of the region starting at Head to Members.
+ */
+static void collectRegion(BasicBlock *Head, const std::set<BasicBlock *> &Heads,
+                          std::set<BasicBlock *> &Members) {
+  std::vector<BasicBlock *> Worklist = {Head};
+  Members.insert(Head);
+  while (!Worklist.empty()) {
+    auto *BB = Worklist.back();
+    Worklist.pop_back();
+    for (auto *Succ : successors(BB)) {
+      if (!Heads.count(Succ) && Members.insert(Succ).second) {
+        Worklist.push_back(Succ);
+      }
+    }
+  }
+}
+
+bool createSamplingRegions(Function &F, GlobalVariable *Countdown,
+                           function_ref<unsigned(BasicBlock &)> CountSites,
+                           std::set<BasicBlock *> &SlowBlocks) {
+  for (auto &BB : F) {
+    if (BB.isEHPad()) {
+      return false;
+    }
+  }
+
+  // Keep the static allocas in an entry block of their own, which is never
+  // sampled and holds the slots of the demoted values.
+  BasicBlock &Entry = F.getEntryBlock();
+  auto FirstInst = Entry.begin();
+  while (isa<AllocaInst>(FirstInst)) {
+    ++FirstInst;
+  }
+  auto *Body = Entry.splitBasicBlock(FirstInst);
+
+  std::set<BasicBlock *> Heads = {Body};
+  std::vector<CallInst *> Calls;
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      auto *Call = dyn_cast<CallInst>(&I);
+      if (Call && endsSamplingRegion(Call)) {
+        Calls.push_back(Call);
+      }
+    }
+  }
+  for (auto *Call : Calls) {
+    Heads.insert(Call->getParent()->splitBasicBlock(Call->getNextNode()));
+  }
+  demoteToStack(F);
+  findBackEdgeTargets(Body, Heads);
+
+  std::vector<BasicBlock *> Blocks;
+  std::map<BasicBlock *, unsigned> Sites;
+  for (auto &BB : F) {
+    if (&BB != &Entry) {
+      Blocks.push_back(&BB);
+      Sites[&BB] = CountSites(BB);
+    }
+  }
+
+  // Regions without sites have nothing to sample and are left as they are.
+  std::map<BasicBlock *, unsigned> Weights;
+  std::map<BasicBlock *, unsigned> RegionWeights;
+  std::set<BasicBlock *> Members;
+  for (auto *BB : Blocks) {
+    if (!Heads.count(BB)) {
+      continue;
+    }
+    unsigned Weight = pathWeight(BB, Heads, Sites, Weights);
+    if (Weight > 0) {
+      RegionWeights[BB] = Weight;
+      collectRegion(BB, Heads, Members);
+    }
+  }
+  if (RegionWeights.empty()) {
+    return true;
+  }
+
+  // Both copies enter the next region through its check.
+  auto &Context = F.getContext();
+  std::map<BasicBlock *, BasicBlock *> Checks;
+  for (auto &Region : RegionWeights) {
+    auto *Check = BasicBlock::Create(Context, "", &F, Region.first);
+    Region.first->replaceAllUsesWith(Check);
+    Checks[Region.first] = Check;
+  }
+
+  ValueToValueMapTy VMap;
+  std::map<BasicBlock *, BasicBlock *> SlowCopies;
+  for (auto *BB : Blocks) {
+    if (!Members.count(BB)) {
+      continue;
+    }
+    auto *Slow = CloneBasicBlock(BB, VMap, ".sampled", &F);
+    if (!Heads.count(BB)) {
+      VMap[BB] = Slow;
+    }
+    SlowCopies[BB] = Slow;
+    SlowBlocks.insert(Slow);
+  }
+  for (auto *Slow : SlowBlocks) {
+    for (auto &I : *Slow) {
+      RemapInstruction(&I, VMap,
+                       RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+    }
+  }
+
+  auto *Int32Type = Type::getInt32Ty(Context);
+  for (auto &Region : RegionWeights) {
+    IRBuilder<> Builder(Checks[Region.first]);
+    auto *Count = Builder.CreateLoad(Int32Type, Countdown);
+    auto *Fast = Builder.CreateICmpSGT(
+        Count, ConstantInt::get(Int32Type, Region.second));
+    Builder.CreateCondBr(Fast, Region.first, SlowCopies[Region.first]);
+  }
+
+  // The fast path skips the sites of a block in one subtraction.
+  for (auto *BB : Members) {
+    if (Sites[BB] == 0) {
+      continue;
+    }
+    IRBuilder<> Builder(&*BB->getFirstInsertionPt());
+    auto *Count = Builder.CreateLoad(Int32Type, Countdown);
+    Builder.CreateStore(
+        Builder.CreateSub(Count, ConstantInt::get(Int32Type, Sites[BB])),
+        Countdown);
+  }
+  return true;
+}